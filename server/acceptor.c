@@ -0,0 +1,189 @@
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include "main.h"
+#include "stats.h"
+#include "affinity.h"
+#include "admission.h"
+#include "acceptor.h"
+
+typedef struct {
+	pthread_t thread;
+	int index;
+	int listenSocket;
+
+	unsigned long accepted;
+	unsigned long batches;
+	unsigned long largestBatch;
+}acceptor_t;
+
+static acceptor_t *acceptors = NULL;
+static int acceptorCount = 0;
+static int stopFd = -1;
+static acceptorDispatch_t dispatchFn;
+
+
+/***********************************************************************************
+ *	Accept everything that is waiting on our socket. Returns how many we got.
+ **********************************************************************************/
+static unsigned long acceptorDrain(acceptor_t *a){
+	unsigned long count = 0;
+	struct sockaddr addr;
+
+	while(1){
+		socklen_t addrLen = sizeof(addr);
+		int clientSocket = accept4(a->listenSocket, &addr, &addrLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if(clientSocket == -1){
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+
+			//EAGAIN means we've emptied the queue. Out of descriptors, we turn the
+			//	client away and try again.
+			if(errno != EAGAIN && errno != EWOULDBLOCK && admitAcceptFailed(a->listenSocket, errno))
+				continue;
+			return count;
+		}
+
+		//Save the IP address of the connecting client
+		uint32_t ip = ntohl(*(uint32_t *)&addr.sa_data[2]);
+		dispatchFn(clientSocket, ip);
+		count++;
+	}
+}
+
+
+/***********************************************************************************
+ *	Acceptor thread, waits on its own listening socket until we're stopped.
+ **********************************************************************************/
+static void *acceptorRun(void *arg){
+	acceptor_t *a = arg;
+	affinityApplySelf(AFFINITY_ACCEPT, a->index);
+
+	struct pollfd pfd[2] = {
+		{.fd = a->listenSocket, .events = POLLIN},
+		{.fd = stopFd, .events = POLLIN}
+	};
+
+	while(1){
+		if(poll(pfd, 2, -1) == -1){
+			if(errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "poll: %s", strerror(errno));
+			return NULL;
+		}
+		if(pfd[1].revents)
+			return NULL;
+		if(!pfd[0].revents)
+			continue;
+
+		unsigned long count = acceptorDrain(a);
+		if(!count)
+			continue;
+
+		__atomic_add_fetch(&a->accepted, count, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&a->batches, 1, __ATOMIC_RELAXED);
+		if(count > a->largestBatch)
+			__atomic_store_n(&a->largestBatch, count, __ATOMIC_RELAXED);
+	}
+}
+
+
+/***********************************************************************************
+ *	Log what each acceptor has done (registered with the stats dump)
+ **********************************************************************************/
+static void acceptorStats(void){
+	for(int i = 0; i < acceptorCount; i++){
+		acceptor_t *a = &acceptors[i];
+		syslog(LOG_INFO, "acceptor %i: accepted %lu in %lu batches, largest batch %lu", i,
+				__atomic_load_n(&a->accepted, __ATOMIC_RELAXED),
+				__atomic_load_n(&a->batches, __ATOMIC_RELAXED),
+				__atomic_load_n(&a->largestBatch, __ATOMIC_RELAXED));
+	}
+}
+
+
+/***********************************************************************************
+ *	Start an acceptor on each listening socket
+ **********************************************************************************/
+int acceptorsStart(int *listenSockets, int count, acceptorDispatch_t dispatch){
+
+	dispatchFn = dispatch;
+
+	stopFd = eventfd(0, EFD_CLOEXEC);
+	if(stopFd == -1){
+		syslog(LOG_ERR, "eventfd: %s", strerror(errno));
+		return -1;
+	}
+
+	acceptors = calloc(count, sizeof(acceptor_t));
+	if(!acceptors){
+		syslog(LOG_ERR, "calloc: %s", strerror(errno));
+		close(stopFd);
+		return -1;
+	}
+
+	//The acceptors must never be the thread that takes our signals
+	sigset_t oldSet;
+	blockSignals(&oldSet);
+	for(acceptorCount = 0; acceptorCount < count; acceptorCount++){
+		acceptor_t *a = &acceptors[acceptorCount];
+		a->index = acceptorCount;
+		a->listenSocket = listenSockets[acceptorCount];
+
+		//We drain until EAGAIN, so the listening socket can't block
+		int flags = fcntl(a->listenSocket, F_GETFL);
+		if(flags == -1 || fcntl(a->listenSocket, F_SETFL, flags | O_NONBLOCK)){
+			syslog(LOG_ERR, "fcntl: %s", strerror(errno));
+			break;
+		}
+
+		int rc = pthread_create(&a->thread, NULL, acceptorRun, a);
+		if(rc){
+			errno = rc;
+			perror("pthread_create");
+			break;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &oldSet, NULL);
+
+	if(acceptorCount != count){
+		acceptorsStop();
+		return -1;
+	}
+
+	statsRegister(acceptorStats);
+	syslog(LOG_INFO, "Started %i acceptors", acceptorCount);
+	return 0;
+}
+
+
+/***********************************************************************************
+ *	Wake every acceptor up so it exits, and wait for them
+ **********************************************************************************/
+void acceptorsStop(void){
+	if(!acceptors)
+		return;
+
+	eventfd_write(stopFd, 1);
+	for(int i = 0; i < acceptorCount; i++)
+		pthread_join(acceptors[i].thread, NULL);
+
+	free(acceptors);
+	acceptors = NULL;
+	acceptorCount = 0;
+	close(stopFd);
+	stopFd = -1;
+}
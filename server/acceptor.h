@@ -0,0 +1,17 @@
+
+#ifndef ACCEPTOR_H
+#define ACCEPTOR_H
+
+#include <stdint.h>
+
+//Called for every accepted connection (the socket is non-blocking)
+typedef void (*acceptorDispatch_t)(int socket, uint32_t ip);
+
+//Start one acceptor thread per listening socket. Each one drains every pending
+//	connection on its socket each time it wakes up.
+int acceptorsStart(int *listenSockets, int count, acceptorDispatch_t dispatch);
+
+//Stop and join all the acceptor threads
+void acceptorsStop(void);
+
+#endif //ACCEPTOR_H
@@ -0,0 +1,225 @@
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "main.h"
+#include "stats.h"
+#include "bufpool.h"
+#include "admission.h"
+
+static admitLimits_t limits;
+static const int *listeners = NULL;
+static int listenerCount = 0;
+
+//Kept open so there's always one descriptor we can give up under EMFILE
+static int reserveFd = -1;
+static pthread_mutex_t reserveLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int connections = 0;
+static int requests = 0;
+static int peakConnections = 0;
+static int peakRequests = 0;
+
+static unsigned long statAdmitted = 0;
+static unsigned long statShedConnections = 0;	//Over the connection limit
+static unsigned long statShedBuffered = 0;		//Over the buffered bytes limit (new or growing)
+static unsigned long statShedHandoff = 0;		//Taken on, but nowhere to hand it
+static unsigned long statShedReserve = 0;		//Turned away with the reserve descriptor
+static unsigned long statBusyRequests = 0;		//Packets answered with busy
+
+
+/***********************************************************************************
+ *	Log the admission numbers (registered with the stats dump)
+ **********************************************************************************/
+static void admitStats(void){
+	syslog(LOG_INFO, "admission: %i connections (peak %i, limit %i), %i requests (peak %i, limit %i), %zu of %zu bytes buffered",
+			__atomic_load_n(&connections, __ATOMIC_RELAXED), __atomic_load_n(&peakConnections, __ATOMIC_RELAXED),
+			limits.connections, __atomic_load_n(&requests, __ATOMIC_RELAXED),
+			__atomic_load_n(&peakRequests, __ATOMIC_RELAXED), limits.requests, bufInUse(), limits.buffered);
+	syslog(LOG_INFO, "admission: %lu admitted, shed %lu (connections), %lu (buffers), %lu (no room to queue), %lu (out of descriptors), %lu busy replies",
+			__atomic_load_n(&statAdmitted, __ATOMIC_RELAXED), __atomic_load_n(&statShedConnections, __ATOMIC_RELAXED),
+			__atomic_load_n(&statShedBuffered, __ATOMIC_RELAXED), __atomic_load_n(&statShedHandoff, __ATOMIC_RELAXED),
+			__atomic_load_n(&statShedReserve, __ATOMIC_RELAXED), __atomic_load_n(&statBusyRequests, __ATOMIC_RELAXED));
+
+	//For a listening socket the kernel reports its accept queue in tcp_info
+	for(int i = 0; i < listenerCount; i++){
+		struct tcp_info info;
+		socklen_t len = sizeof(info);
+		if(!getsockopt(listeners[i], IPPROTO_TCP, TCP_INFO, &info, &len))
+			syslog(LOG_INFO, "admission: listener %i accept queue %u of %u", i, info.tcpi_unacked, info.tcpi_sacked);
+	}
+}
+
+
+/***********************************************************************************
+ *	Take one of a counted resource if we're under its limit, noting the peak
+ **********************************************************************************/
+static bool admitTake(int *count, int *peak, int limit){
+	int now = __atomic_add_fetch(count, 1, __ATOMIC_RELAXED);
+	if(limit && now > limit){
+		__atomic_sub_fetch(count, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	int old = __atomic_load_n(peak, __ATOMIC_RELAXED);
+	while(now > old && !__atomic_compare_exchange_n(peak, &old, now, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return true;
+}
+
+
+/***********************************************************************************
+ *	Tell a client we're too busy for it and close it. The socket is
+ *	non-blocking (or this is all it gets), a client that can't take a few
+ *	bytes right now doesn't get them.
+ **********************************************************************************/
+static void admitTurnAway(int socket){
+	send(socket, ADMIT_BUSY_REPLY, sizeof(ADMIT_BUSY_REPLY) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+	close(socket);
+}
+
+
+/***********************************************************************************
+ *	Set the limits and open the reserve descriptor
+ **********************************************************************************/
+int admitStart(const admitLimits_t *newLimits, const int *listenSockets, int listenCount){
+	limits = *newLimits;
+	listeners = listenSockets;
+	listenerCount = listenCount;
+
+	reserveFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	if(reserveFd == -1){
+		syslog(LOG_ERR, "open /dev/null: %s", strerror(errno));
+		return -1;
+	}
+
+	statsRegister(admitStats);
+	return 0;
+}
+
+
+/***********************************************************************************
+ *	Let go of the reserve descriptor
+ **********************************************************************************/
+void admitStop(void){
+	pthread_mutex_lock(&reserveLock);
+	if(reserveFd != -1)
+		close(reserveFd);
+	reserveFd = -1;
+	listenerCount = 0;
+	pthread_mutex_unlock(&reserveLock);
+}
+
+
+/***********************************************************************************
+ *	Take on a new client, or shed it
+ **********************************************************************************/
+bool admitConnection(int socket){
+	if(limits.buffered && bufInUse() >= limits.buffered){
+		__atomic_add_fetch(&statShedBuffered, 1, __ATOMIC_RELAXED);
+		admitTurnAway(socket);
+		return false;
+	}
+	if(!admitTake(&connections, &peakConnections, limits.connections)){
+		__atomic_add_fetch(&statShedConnections, 1, __ATOMIC_RELAXED);
+		admitTurnAway(socket);
+		return false;
+	}
+
+	__atomic_add_fetch(&statAdmitted, 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+
+/***********************************************************************************
+ *	Shed a client we'd already taken on
+ **********************************************************************************/
+void admitShed(int socket){
+	__atomic_add_fetch(&statShedHandoff, 1, __ATOMIC_RELAXED);
+	admitTurnAway(socket);
+	admitRelease();
+}
+
+
+/***********************************************************************************
+ *	An admitted connection is gone
+ **********************************************************************************/
+void admitRelease(void){
+	__atomic_sub_fetch(&connections, 1, __ATOMIC_RELAXED);
+}
+
+
+/***********************************************************************************
+ *	Can a connection's buffers grow by bytes. This is a soft limit, two that
+ *	check at once can both get in, but nobody gets far past it.
+ **********************************************************************************/
+bool admitBuffer(size_t bytes){
+	if(!limits.buffered || bufInUse() + bytes <= limits.buffered)
+		return true;
+
+	__atomic_add_fetch(&statShedBuffered, 1, __ATOMIC_RELAXED);
+	return false;
+}
+
+
+/***********************************************************************************
+ *	Requests in flight
+ **********************************************************************************/
+bool admitRequest(void){
+	if(admitTake(&requests, &peakRequests, limits.requests))
+		return true;
+
+	__atomic_add_fetch(&statBusyRequests, 1, __ATOMIC_RELAXED);
+	return false;
+}
+
+void admitRequestDone(void){
+	__atomic_sub_fetch(&requests, 1, __ATOMIC_RELAXED);
+}
+
+
+/***********************************************************************************
+ *	Out of descriptors. The client stays in the accept queue (and the listener
+ *	stays readable, so we'd spin on it) until we take it, so we close the
+ *	reserve descriptor, accept the client into its place, turn it away and
+ *	open the reserve again. Only one thread does this at a time.
+ **********************************************************************************/
+bool admitAcceptFailed(int listenSocket, int err){
+	if(err != EMFILE && err != ENFILE)
+		return false;
+
+	bool shed = false;
+	pthread_mutex_lock(&reserveLock);
+	if(reserveFd != -1)
+		close(reserveFd);
+
+	//Another thread might have taken the client already, and a blocking
+	//	listener would wait for the next one
+	struct pollfd pfd = {.fd = listenSocket, .events = POLLIN};
+	if(poll(&pfd, 1, 0) == 1){
+		int clientSocket = accept4(listenSocket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if(clientSocket != -1){
+			admitTurnAway(clientSocket);
+			__atomic_add_fetch(&statShedReserve, 1, __ATOMIC_RELAXED);
+			shed = true;
+		}
+	}
+
+	//If someone else got the descriptor first we'll try again next time
+	reserveFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	pthread_mutex_unlock(&reserveLock);
+
+	if(!shed)
+		syslog(LOG_ERR, "accept: %s", strerror(err));
+	return shed;
+}
@@ -0,0 +1,48 @@
+
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+//How much the server takes on at once. 0 means no limit.
+typedef struct {
+	int connections;		//Client connections open (accepted and not yet closed)
+	size_t buffered;		//Bytes of connection buffers checked out of the pool
+	int requests;			//Packets stored (or commands run) whose reply isn't done yet
+} admitLimits_t;
+
+//Set the limits and open the reserve descriptor, once at startup. listenSockets
+//	are only looked at for the stats (how deep their accept queues are).
+int admitStart(const admitLimits_t *limits, const int *listenSockets, int listenCount);
+void admitStop(void);
+
+//Check a client we've just accepted against the limits. Returns true if it's
+//	taken on (it counts as a connection until admitRelease()), otherwise it has
+//	been shed: sent ADMIT_BUSY_REPLY and closed.
+bool admitConnection(int socket);
+
+//Shed a client that was taken on but can't be handed on (a full queue or no
+//	thread for it). It's sent ADMIT_BUSY_REPLY, closed and released.
+void admitShed(int socket);
+
+//An admitted connection has been closed
+void admitRelease(void);
+
+//A connection wants its buffers to grow by bytes. Returns false if that would
+//	take us over the buffered limit (the connection is shed).
+bool admitBuffer(size_t bytes);
+
+//A packet is about to be stored (or a command run). Returns false if too many
+//	are already in flight, the client gets ADMIT_BUSY_REPLY instead. Every true
+//	is paired with an admitRequestDone() once its reply is done.
+bool admitRequest(void);
+void admitRequestDone(void);
+
+//accept() failed with err. When that's because we're out of descriptors, the
+//	reserve one is given up for long enough to accept the next client and turn
+//	it away, so it isn't left hanging. Returns true if a client was shed that
+//	way (worth trying to accept again), false otherwise.
+bool admitAcceptFailed(int listenSocket, int err);
+
+#endif //ADMISSION_H
@@ -0,0 +1,223 @@
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <dirent.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "main.h"
+#include "stats.h"
+#include "bufpool.h"
+#include "logger.h"
+#include "affinity.h"
+
+#define MAX_NODES		64
+
+typedef struct {
+	bool configured;
+	cpu_set_t cpus;
+	int cpuCount;
+	int *cpuList;			//The CPUs in the set, in order (for index based pinning)
+	pthread_attr_t attr;
+}affinitySet_t;
+
+static affinitySet_t sets[AFFINITY_ROLES];
+static bool statsRegistered = false;
+
+//Receive CPU of each connection (from SO_INCOMING_CPU) compared to ours
+static unsigned long rxCpuCount[CPU_SETSIZE];
+static unsigned long rxMatched = 0;
+static unsigned long rxMismatched = 0;
+static unsigned long rxUnknown = 0;
+
+
+/***********************************************************************************
+ *	Find the NUMA node a CPU belongs to (-1 if we can't tell)
+ **********************************************************************************/
+static int cpuNode(int cpu){
+	char path[64];
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%i", cpu);
+
+	DIR *dir = opendir(path);
+	if(!dir)
+		return -1;
+
+	int node = -1;
+	struct dirent *ent;
+	while((ent = readdir(dir))){
+		if(!strncmp(ent->d_name, "node", 4) && sscanf(ent->d_name + 4, "%i", &node) == 1)
+			break;
+	}
+	closedir(dir);
+	return node;
+}
+
+
+/***********************************************************************************
+ *	Log where connections were received vs processed (registered with the stats dump)
+ **********************************************************************************/
+static void affinityStats(void){
+	char line[256];
+	int len = 0;
+
+	syslog(LOG_INFO, "rx cpu: %lu processed on the receiving cpu, %lu elsewhere, %lu unknown",
+			__atomic_load_n(&rxMatched, __ATOMIC_RELAXED), __atomic_load_n(&rxMismatched, __ATOMIC_RELAXED),
+			__atomic_load_n(&rxUnknown, __ATOMIC_RELAXED));
+
+	for(int cpu = 0; cpu < CPU_SETSIZE; cpu++){
+		unsigned long count = __atomic_load_n(&rxCpuCount[cpu], __ATOMIC_RELAXED);
+		if(!count)
+			continue;
+
+		len += snprintf(line + len, sizeof(line) - len, " cpu%i:%lu", cpu, count);
+		if(len > (int)sizeof(line) - 32){
+			syslog(LOG_INFO, "rx cpu histogram:%s", line);
+			len = 0;
+		}
+	}
+	if(len)
+		syslog(LOG_INFO, "rx cpu histogram:%s", line);
+}
+
+
+/***********************************************************************************
+ *	Parse a CPU list and set it for a role
+ **********************************************************************************/
+int affinityConfigure(affinityRole_t role, const char *cpuList){
+	affinitySet_t *set = &sets[role];
+	CPU_ZERO(&set->cpus);
+
+	const char *p = cpuList;
+	while(*p){
+		char *end;
+		long first = strtol(p, &end, 10);
+		long last = first;
+		if(end == p)
+			return -1;
+		if(*end == '-'){
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if(end == p)
+				return -1;
+		}
+		if(first < 0 || last < first || last >= CPU_SETSIZE)
+			return -1;
+
+		for(long cpu = first; cpu <= last; cpu++)
+			CPU_SET(cpu, &set->cpus);
+
+		if(*end == ',')
+			end++;
+		else if(*end)
+			return -1;
+		p = end;
+	}
+
+	set->cpuCount = CPU_COUNT(&set->cpus);
+	if(!set->cpuCount)
+		return -1;
+
+	free(set->cpuList);
+	set->cpuList = malloc(set->cpuCount * sizeof(int));
+	if(!set->cpuList)
+		return -1;
+	for(int cpu = 0, i = 0; cpu < CPU_SETSIZE; cpu++)
+		if(CPU_ISSET(cpu, &set->cpus))
+			set->cpuList[i++] = cpu;
+
+	if(set->configured)
+		pthread_attr_destroy(&set->attr);
+	pthread_attr_init(&set->attr);
+	pthread_attr_setaffinity_np(&set->attr, sizeof(cpu_set_t), &set->cpus);
+	set->configured = true;
+	return 0;
+}
+
+
+/***********************************************************************************
+ *	Pin the calling thread to its role's CPU(s)
+ **********************************************************************************/
+void affinityApplySelf(affinityRole_t role, int index){
+	affinitySet_t *set = &sets[role];
+	if(!set->configured)
+		return;
+
+	cpu_set_t cpus = set->cpus;
+	if(index >= 0){
+		CPU_ZERO(&cpus);
+		CPU_SET(set->cpuList[index % set->cpuCount], &cpus);
+	}
+
+	int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	if(rc){
+		errno = rc;
+		syslog(LOG_ERR, "pthread_setaffinity_np: %s", strerror(errno));
+		return;
+	}
+
+	//If every CPU we can run on is on one node, have our memory (buffers, stacks
+	//	etc.) come from that node as well
+	int node = -1;
+	for(int cpu = 0; cpu < CPU_SETSIZE; cpu++){
+		if(!CPU_ISSET(cpu, &cpus))
+			continue;
+		int cpuN = cpuNode(cpu);
+		if(cpuN < 0 || (node >= 0 && cpuN != node)){
+			node = -1;
+			break;
+		}
+		node = cpuN;
+	}
+	if(node >= 0 && node < MAX_NODES){
+		unsigned long nodeMask = 1UL << node;
+		if(syscall(SYS_set_mempolicy, MPOL_PREFERRED, &nodeMask, MAX_NODES + 1))
+			syslog(LOG_ERR, "set_mempolicy: %s", strerror(errno));
+		else
+			bufSetNode(node);
+	}
+}
+
+
+/***********************************************************************************
+ *	Attributes for creating a thread on a role's CPU set
+ **********************************************************************************/
+pthread_attr_t *affinityThreadAttr(affinityRole_t role){
+	return sets[role].configured ? &sets[role].attr : NULL;
+}
+
+
+/***********************************************************************************
+ *	Compare the CPU the kernel received the connection on with ours
+ **********************************************************************************/
+void affinityNoteConnection(int socket){
+	if(!statsRegistered){
+		//Only the first connection races here, and registering twice is harmless
+		//	compared to taking a lock per connection
+		if(!__atomic_exchange_n(&statsRegistered, true, __ATOMIC_RELAXED))
+			statsRegister(affinityStats);
+	}
+
+	int rxCpu = -1;
+	socklen_t len = sizeof(rxCpu);
+	if(getsockopt(socket, SOL_SOCKET, SO_INCOMING_CPU, &rxCpu, &len) || rxCpu < 0 || rxCpu >= CPU_SETSIZE){
+		__atomic_add_fetch(&rxUnknown, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	__atomic_add_fetch(&rxCpuCount[rxCpu], 1, __ATOMIC_RELAXED);
+	int ourCpu = sched_getcpu();
+	if(ourCpu == rxCpu)
+		__atomic_add_fetch(&rxMatched, 1, __ATOMIC_RELAXED);
+	else
+		__atomic_add_fetch(&rxMismatched, 1, __ATOMIC_RELAXED);
+
+	LOG_FAST(LOG_DEBUG, "connection received on cpu %i, processing on cpu %i", rxCpu, ourCpu);
+}
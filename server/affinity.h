@@ -0,0 +1,30 @@
+
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <pthread.h>
+
+//Which CPU set a thread is placed on
+typedef enum {
+	AFFINITY_ACCEPT,		//Accept loops, acceptors and the reaper
+	AFFINITY_WORKER,		//Anything that processes connections
+	AFFINITY_ROLES
+} affinityRole_t;
+
+//Set the CPUs for a role from a list like "0-3,8". Returns -1 if the list is invalid.
+int affinityConfigure(affinityRole_t role, const char *cpuList);
+
+//Pin the calling thread. With index >= 0 the thread gets the index'th CPU of the
+//	set to itself (wrapping around), otherwise it may run on any CPU in the set.
+//	A thread pinned to a single NUMA node also prefers that node for its memory.
+void affinityApplySelf(affinityRole_t role, int index);
+
+//Fill in attr so a new thread starts on the role's CPU set. Returns NULL (use
+//	default attributes) if no set was configured for the role.
+pthread_attr_t *affinityThreadAttr(affinityRole_t role);
+
+//Note which CPU handled the receive side of a new connection compared to the
+//	CPU we're processing it on (for the stats).
+void affinityNoteConnection(int socket);
+
+#endif //AFFINITY_H
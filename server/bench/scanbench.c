@@ -0,0 +1,167 @@
+/***********************************************************************************
+ *	Microbenchmark for the newline scanner (make bench, then ./bench/scanbench)
+ *
+ *	Two cases the server actually sees:
+ *	  - One long line arriving a segment at a time. The old receive path ran
+ *	    memchr() over the whole buffer after every recv(), the new one only
+ *	    scans the bytes that just arrived.
+ *	  - A buffer full of short pipelined packets, where we want every '\n'.
+ *	  - A search command looking through stored records for a pattern that's
+ *	    rarely there.
+ **********************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../scan.h"
+
+#define LINE_LEN		(1 << 20)
+#define SEGMENT			1448		//A typical TCP segment
+#define PACKETS_LEN		(1 << 20)
+#define PACKET_LEN		48
+#define MAX_DELIMS		32
+
+static double now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef size_t (*scanFn_t)(const unsigned char *, size_t, unsigned char, uint32_t *, size_t);
+typedef const unsigned char *(*findFn_t)(const unsigned char *, size_t, const unsigned char *, size_t);
+
+static volatile size_t sink;
+
+
+/***********************************************************************************
+ *	The old way, look through everything we have after each segment
+ **********************************************************************************/
+static double longLineRescan(const unsigned char *buf){
+	double start = now();
+	for(size_t have = SEGMENT; ; have += SEGMENT){
+		if(have > LINE_LEN)
+			have = LINE_LEN;
+		const unsigned char *nl = memchr(buf, '\n', have);
+		if(nl){
+			sink = nl - buf;
+			break;
+		}
+	}
+	return now() - start;
+}
+
+
+/***********************************************************************************
+ *	Only look at what just arrived
+ **********************************************************************************/
+static double longLineIncremental(const unsigned char *buf, scanFn_t fn){
+	uint32_t offsets[MAX_DELIMS];
+	double start = now();
+	for(size_t pos = 0; pos < LINE_LEN; pos += SEGMENT){
+		size_t len = (LINE_LEN - pos < SEGMENT) ? LINE_LEN - pos : SEGMENT;
+		if(fn(buf + pos, len, '\n', offsets, MAX_DELIMS)){
+			sink = pos + offsets[0];
+			break;
+		}
+	}
+	return now() - start;
+}
+
+
+/***********************************************************************************
+ *	Every '\n' in a buffer of short packets, one memchr() per packet (the old way)
+ *	vs a batch at a time
+ **********************************************************************************/
+static double packetsMemchr(const unsigned char *buf){
+	double start = now();
+	size_t count = 0;
+	const unsigned char *p = buf, *end = buf + PACKETS_LEN;
+	while((p = memchr(p, '\n', end - p))){
+		count++;
+		p++;
+	}
+	sink = count;
+	return now() - start;
+}
+
+static double packetsBatch(const unsigned char *buf, scanFn_t fn){
+	uint32_t offsets[MAX_DELIMS];
+	double start = now();
+	size_t count = 0, pos = 0;
+	while(pos < PACKETS_LEN){
+		size_t found = fn(buf + pos, PACKETS_LEN - pos, '\n', offsets, MAX_DELIMS);
+		count += found;
+		pos = (found == MAX_DELIMS) ? pos + offsets[found - 1] + 1 : PACKETS_LEN;
+	}
+	sink = count;
+	return now() - start;
+}
+
+
+/***********************************************************************************
+ *	Look for a pattern that isn't there, through the packets buffer
+ **********************************************************************************/
+static double findMissing(const unsigned char *buf, findFn_t fn){
+	static const unsigned char pattern[] = "timestamp:";
+	double start = now();
+	for(int i = 0; i < 16; i++)
+		sink = (size_t)fn(buf, PACKETS_LEN, pattern, sizeof(pattern) - 1);
+	return (now() - start) / 16;
+}
+
+
+int main(void){
+	unsigned char *line = malloc(LINE_LEN);
+	unsigned char *packets = malloc(PACKETS_LEN);
+	if(!line || !packets)
+		return 1;
+
+	memset(line, 'x', LINE_LEN);
+	line[LINE_LEN - 1] = '\n';
+	for(size_t i = 0; i < PACKETS_LEN; i++)
+		packets[i] = (i % PACKET_LEN == PACKET_LEN - 1) ? '\n' : 'a' + i % 26;
+
+	struct {
+		const char *name;
+		scanFn_t fn;
+	} impls[] = {
+		{"scalar", scanDelimsScalar},
+#if defined(__x86_64__) || defined(__i386__)
+		{"sse2", scanDelimsSse2},
+		{"avx2", __builtin_cpu_supports("avx2") ? scanDelimsAvx2 : NULL},
+#endif
+	};
+
+	struct {
+		const char *name;
+		findFn_t fn;
+	} finds[] = {
+		{"memmem", scanFindScalar},
+#if defined(__x86_64__) || defined(__i386__)
+		{"sse2", scanFindSse2},
+		{"avx2", __builtin_cpu_supports("avx2") ? scanFindAvx2 : NULL},
+#endif
+	};
+
+	printf("scanDelims() is using %s\n\n", scanName());
+	printf("1MB line in %i byte segments\n", SEGMENT);
+	printf("  %-22s %10.3f ms\n", "memchr whole buffer", longLineRescan(line) * 1e3);
+	for(int i = 0; i < sizeof(impls)/sizeof(impls[0]); i++)
+		if(impls[i].fn)
+			printf("  %-22s %10.3f ms\n", impls[i].name, longLineIncremental(line, impls[i].fn) * 1e3);
+
+	printf("\n1MB of %i byte packets\n", PACKET_LEN);
+	printf("  %-22s %10.3f ms\n", "memchr per packet", packetsMemchr(packets) * 1e3);
+	for(int i = 0; i < sizeof(impls)/sizeof(impls[0]); i++)
+		if(impls[i].fn)
+			printf("  %-22s %10.3f ms\n", impls[i].name, packetsBatch(packets, impls[i].fn) * 1e3);
+
+	printf("\n1MB of packets searched for a missing pattern\n");
+	for(int i = 0; i < sizeof(finds)/sizeof(finds[0]); i++)
+		if(finds[i].fn)
+			printf("  %-22s %10.3f ms\n", finds[i].name, findMissing(packets, finds[i].fn) * 1e3);
+
+	free(line);
+	free(packets);
+	return 0;
+}
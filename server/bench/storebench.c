@@ -0,0 +1,173 @@
+/***********************************************************************************
+ *	Storage backend benchmark (make bench, then ./bench/storebench [backend...])
+ *
+ *	Every backend gets the same load: THREADS threads each storing RECORDS
+ *	packets and then reading back the reply, the way a connection does. The
+ *	reply comes from a snapshot if the backend has one, otherwise it's read
+ *	through storageRead(). With no arguments it runs file, mmap and ring.
+ *	aesdchar writes to the real device (whatever the driver holds gets our
+ *	records on the end), so it's only run when it's named.
+ *
+ *	The file and mmap backends use a scratch file of their own in SCRATCH_DIR
+ *	(deleted when they're done), never the server's data file, so it's safe to
+ *	run this alongside the server.
+ **********************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "../main.h"
+#include "../storage.h"
+
+#define THREADS			4
+#define RECORDS			2000		//Per thread
+#define RECORD_LEN		64
+#define READ_CHUNK		(64 * 1024)
+#define SCRATCH_DIR		"/var/tmp"
+
+static pthread_mutex_t fileAccessMutex = PTHREAD_MUTEX_INITIALIZER;
+static volatile size_t sink;
+
+static double now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef struct {
+	int id;
+	int failures;
+	unsigned long long replyBytes;
+	unsigned long snapReplies;
+} worker_t;
+
+
+/***********************************************************************************
+ *	Read the reply to an append, returning how many bytes it was. snap is the
+ *	one the append pinned, if it did.
+ **********************************************************************************/
+static size_t reply(worker_t *w, int fd, off_t end, storageSnap_t *snap, char *buf){
+	if(!snap)
+		snap = storageSnapshot(end);
+	if(snap){
+		size_t len = (end < 0) ? snap->len : end;
+		sink += snap->data[len - 1];
+		storageSnapRelease(snap);
+		w->snapReplies++;
+		return len;
+	}
+
+	//A backend without a length of its own (end is -1) reads until it runs out
+	size_t total = 0;
+	off_t off = (end < 0) ? -1 : 0;
+	while(end < 0 || total < end){
+		size_t want = READ_CHUNK;
+		if(end >= 0 && end - total < want)
+			want = end - total;
+		ssize_t got = storageRead(fd, buf, want, off);
+		if(got <= 0)
+			break;
+		sink += buf[got - 1];
+		total += got;
+		if(off >= 0)
+			off += got;
+	}
+	return total;
+}
+
+
+static void *work(void *arg){
+	worker_t *w = arg;
+	char record[RECORD_LEN];
+	char *buf = malloc(READ_CHUNK);
+	if(!buf){
+		w->failures++;
+		return NULL;
+	}
+
+	for(int i = 0; i < RECORDS; i++){
+		snprintf(record, sizeof(record), "thread %d record %d", w->id, i);
+		memset(record + strlen(record), '.', sizeof(record) - strlen(record) - 1);
+		record[RECORD_LEN - 1] = '\n';
+
+		int fd = storageAcquire();
+		off_t end;
+		storageSnap_t *snap;
+		if(fd == -1 || storageAppendStaged(&fileAccessMutex, fd, w->id, -1, 0, record, RECORD_LEN, &end, &snap)){
+			w->failures++;
+		}else{
+			w->replyBytes += reply(w, fd, end, snap, buf);
+		}
+		if(fd != -1)
+			storageRelease(fd);
+	}
+
+	free(buf);
+	return NULL;
+}
+
+
+/***********************************************************************************
+ *	Run the load against one backend and print what it managed
+ **********************************************************************************/
+static int run(const char *name){
+	pthread_t threads[THREADS];
+	worker_t workers[THREADS];
+
+	if(storageSelect(name) || storageOpen()){
+		fprintf(stderr, "%s: unable to open the backend\n", name);
+		return -1;
+	}
+
+	double start = now();
+	for(int i = 0; i < THREADS; i++){
+		workers[i] = (worker_t){.id = i};
+		pthread_create(&threads[i], NULL, work, &workers[i]);
+	}
+
+	int failures = 0;
+	unsigned long long replyBytes = 0;
+	unsigned long snapReplies = 0;
+	for(int i = 0; i < THREADS; i++){
+		pthread_join(threads[i], NULL);
+		failures += workers[i].failures;
+		replyBytes += workers[i].replyBytes;
+		snapReplies += workers[i].snapReplies;
+	}
+	double elapsed = now() - start;
+	storageClose();
+
+	int appends = THREADS * RECORDS - failures;
+	printf("  %-10s %10.0f appends/s %10.3f ms %8.1f MB replied (%lu from snapshots)",
+			name, appends / elapsed, elapsed * 1e3, replyBytes / 1e6, snapReplies);
+	if(failures)
+		printf(", %d failed", failures);
+	printf("\n");
+	return failures ? -1 : 0;
+}
+
+
+int main(int argc, char *argv[]){
+	int result = 0;
+
+	char scratch[64];
+	snprintf(scratch, sizeof(scratch), "%s/storebench.%d", SCRATCH_DIR, (int)getpid());
+	if(storageSetPath(scratch)){
+		fprintf(stderr, "%s: path too long\n", scratch);
+		return 1;
+	}
+
+	printf("%d threads x %d appends of %d bytes, each followed by its reply\n", THREADS, RECORDS, RECORD_LEN);
+	if(argc > 1){
+		for(int i = 1; i < argc; i++)
+			result |= run(argv[i]);
+		return result ? 1 : 0;
+	}
+
+	result |= run("file");
+	result |= run("mmap");
+	result |= run("ring");
+	return result ? 1 : 0;
+}
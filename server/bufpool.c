@@ -0,0 +1,227 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include "main.h"
+#include "stats.h"
+#include "bufpool.h"
+
+#define MIN_SHIFT		12			//log2(BUF_MIN_SIZE)
+#define CLASS_COUNT		(20 - MIN_SHIFT + 1)	//Up to log2(BUF_POOL_MAX)
+#define MAX_NODES		64			//NUMA nodes with a pool of their own, as for affinity
+#define BUF_HEADER		64			//In front of each buffer, keeps it cache line aligned
+
+_Static_assert(BUF_MIN_SIZE == 1 << MIN_SHIFT, "BUF_MIN_SIZE must match MIN_SHIFT");
+_Static_assert(BUF_POOL_MAX == BUF_MIN_SIZE << (CLASS_COUNT - 1), "BUF_POOL_MAX must match CLASS_COUNT");
+
+//Cached buffers of one size. The link to the next one is kept in the buffer itself.
+typedef struct {
+	pthread_mutex_t lock;
+	void *head;
+	int count;
+}bufClass_t;
+
+//The node a buffer was allocated on, in the header in front of it
+typedef struct {
+	int node;
+}bufHeader_t;
+
+_Static_assert(sizeof(bufHeader_t) <= BUF_HEADER, "bufHeader_t must fit in BUF_HEADER");
+
+//A set of size classes for each node, so a buffer always goes back to the node
+//	its memory is on, and one more for threads that aren't on a single node
+static bufClass_t classes[MAX_NODES + 1][CLASS_COUNT];
+static pthread_once_t initOnce = PTHREAD_ONCE_INIT;
+static __thread int myNode = MAX_NODES;
+
+static unsigned long statGets = 0;
+static unsigned long statReused = 0;
+static unsigned long statMallocs = 0;
+static unsigned long statMallocBytes = 0;
+static unsigned long statFrees = 0;
+static unsigned long statGrows = 0;
+static unsigned long statRequests = 0;
+static size_t inUse = 0;				//Bytes handed out and not back yet
+
+
+/***********************************************************************************
+ *	Log how the pool is doing (registered with the stats dump)
+ **********************************************************************************/
+static void bufStats(void){
+	unsigned long requests = __atomic_load_n(&statRequests, __ATOMIC_RELAXED);
+	unsigned long mallocs = __atomic_load_n(&statMallocs, __ATOMIC_RELAXED);
+	unsigned long bytes = __atomic_load_n(&statMallocBytes, __ATOMIC_RELAXED);
+
+	syslog(LOG_INFO, "buffers: %lu gets (%lu reused), %lu grows, %lu mallocs, %lu frees, %zu bytes in use",
+			__atomic_load_n(&statGets, __ATOMIC_RELAXED), __atomic_load_n(&statReused, __ATOMIC_RELAXED),
+			__atomic_load_n(&statGrows, __ATOMIC_RELAXED), mallocs, __atomic_load_n(&statFrees, __ATOMIC_RELAXED),
+			bufInUse());
+	syslog(LOG_INFO, "buffers: %lu requests, %lu bytes allocated (%lu bytes, %lu.%02lu mallocs per request)",
+			requests, bytes, requests ? bytes / requests : 0,
+			requests ? mallocs / requests : 0, requests ? mallocs * 100 / requests % 100 : 0);
+
+	for(int node = 0; node <= MAX_NODES; node++){
+		for(int i = 0; i < CLASS_COUNT; i++){
+			pthread_mutex_lock(&classes[node][i].lock);
+			int count = classes[node][i].count;
+			pthread_mutex_unlock(&classes[node][i].lock);
+			if(count && node < MAX_NODES)
+				syslog(LOG_INFO, "buffers: %i cached of %i bytes on node %i", count, BUF_MIN_SIZE << i, node);
+			else if(count)
+				syslog(LOG_INFO, "buffers: %i cached of %i bytes", count, BUF_MIN_SIZE << i);
+		}
+	}
+}
+
+
+/***********************************************************************************
+ *	Set up the size classes the first time anyone asks for a buffer
+ **********************************************************************************/
+static void bufInit(void){
+	for(int node = 0; node <= MAX_NODES; node++)
+		for(int i = 0; i < CLASS_COUNT; i++)
+			pthread_mutex_init(&classes[node][i].lock, NULL);
+	statsRegister(bufStats);
+}
+
+
+/***********************************************************************************
+ *	The calling thread's memory comes from node (-1 if it isn't kept to one)
+ **********************************************************************************/
+void bufSetNode(int node){
+	myNode = (node >= 0 && node < MAX_NODES) ? node : MAX_NODES;
+}
+
+
+/***********************************************************************************
+ *	The power of two size that holds minSize, and its class (-1 if too big to pool)
+ **********************************************************************************/
+static size_t bufSize(size_t minSize, int *class){
+	size_t size = BUF_MIN_SIZE;
+	int c = 0;
+	while(size < minSize){
+		size <<= 1;
+		c++;
+	}
+	*class = (c < CLASS_COUNT) ? c : -1;
+	return size;
+}
+
+
+/***********************************************************************************
+ *	Get a buffer, from the pool if there's one cached
+ **********************************************************************************/
+unsigned char *bufGet(size_t minSize, int *size){
+	pthread_once(&initOnce, bufInit);
+	__atomic_add_fetch(&statGets, 1, __ATOMIC_RELAXED);
+
+	int class;
+	size_t bytes = bufSize(minSize, &class);
+	if(bytes > INT_MAX){
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	//Only from our own node's pool, anything cached elsewhere is remote memory
+	unsigned char *buf = NULL;
+	if(class >= 0){
+		bufClass_t *bc = &classes[myNode][class];
+		pthread_mutex_lock(&bc->lock);
+		buf = bc->head;
+		if(buf){
+			memcpy(&bc->head, buf, sizeof(void *));
+			bc->count--;
+		}
+		pthread_mutex_unlock(&bc->lock);
+	}
+
+	if(buf)
+		__atomic_add_fetch(&statReused, 1, __ATOMIC_RELAXED);
+	else{
+		unsigned char *block = malloc(BUF_HEADER + bytes);
+		if(!block)
+			return NULL;
+		((bufHeader_t *)block)->node = myNode;
+		buf = block + BUF_HEADER;
+		__atomic_add_fetch(&statMallocs, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&statMallocBytes, bytes, __ATOMIC_RELAXED);
+	}
+
+	__atomic_add_fetch(&inUse, bytes, __ATOMIC_RELAXED);
+	*size = bytes;
+	return buf;
+}
+
+
+/***********************************************************************************
+ *	Give a buffer back, to the pool of the node it was allocated on (whichever
+ *	thread gives it back). We only keep up to BUF_POOL_BYTES of each size per
+ *	node so one burst of huge lines doesn't pin that memory forever.
+ **********************************************************************************/
+void bufPut(unsigned char *buf, int size){
+	if(!buf)
+		return;
+	__atomic_sub_fetch(&inUse, (size_t)size, __ATOMIC_RELAXED);
+
+	bufHeader_t *header = (bufHeader_t *)(buf - BUF_HEADER);
+	int class;
+	bufSize(size, &class);
+	if(class >= 0){
+		bufClass_t *bc = &classes[header->node][class];
+		pthread_mutex_lock(&bc->lock);
+		if((size_t)(bc->count + 1) * size <= BUF_POOL_BYTES){
+			memcpy(buf, &bc->head, sizeof(void *));
+			bc->head = buf;
+			bc->count++;
+			buf = NULL;
+		}
+		pthread_mutex_unlock(&bc->lock);
+	}
+
+	if(buf){
+		free(header);
+		__atomic_add_fetch(&statFrees, 1, __ATOMIC_RELAXED);
+	}
+}
+
+
+/***********************************************************************************
+ *	Move to a bigger buffer. Sizes double (at least), so a line of n bytes costs
+ *	O(log n) grows and O(n) copying in total.
+ **********************************************************************************/
+int bufGrow(unsigned char **buf, int *size, int keep, size_t minSize){
+	if(minSize < (size_t)*size * 2)
+		minSize = (size_t)*size * 2;
+
+	int newSize;
+	unsigned char *tmp = bufGet(minSize, &newSize);
+	if(!tmp)
+		return -1;
+	__atomic_add_fetch(&statGrows, 1, __ATOMIC_RELAXED);
+
+	memcpy(tmp, *buf, keep);
+	bufPut(*buf, *size);
+	*buf = tmp;
+	*size = newSize;
+	return 0;
+}
+
+
+/***********************************************************************************
+ *	Buffer bytes in use right now
+ **********************************************************************************/
+size_t bufInUse(void){
+	return __atomic_load_n(&inUse, __ATOMIC_RELAXED);
+}
+
+
+/***********************************************************************************
+ *	Count handled requests
+ **********************************************************************************/
+void bufCountRequests(unsigned long count){
+	__atomic_add_fetch(&statRequests, count, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,27 @@
+
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stddef.h>
+
+//Get a buffer of at least minSize bytes, the actual size is returned in size.
+unsigned char *bufGet(size_t minSize, int *size);
+
+//Swap buf for one of at least minSize bytes (always at least double the old
+//	size), keeping the first keep bytes. Returns -1 (buf untouched) on failure.
+int bufGrow(unsigned char **buf, int *size, int keep, size_t minSize);
+
+//Give a buffer back to the pool (or free it if the pool has enough)
+void bufPut(unsigned char *buf, int size);
+
+//The NUMA node the calling thread's memory comes from (-1 for none). Buffers
+//	are pooled per node, and the thread only reuses ones from its own.
+void bufSetNode(int node);
+
+//Bytes of buffers currently checked out of the pool (not counting cached ones)
+size_t bufInUse(void);
+
+//Count requests (packets) handled, for the allocation per request stats
+void bufCountRequests(unsigned long count);
+
+#endif //BUFPOOL_H
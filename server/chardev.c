@@ -0,0 +1,145 @@
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include "../aesd-char-driver/aesd_ioctl.h"
+#include "main.h"
+#include "storage.h"
+#include "chardev.h"
+
+#define FD_POOL_SIZE	64		//Char device descriptors we keep open for reuse
+
+static int fdPool[FD_POOL_SIZE];
+static int fdPoolCount = 0;
+static pthread_mutex_t fdPoolLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/***********************************************************************************
+ *	Nothing to do up front, each request opens the device (or reuses a
+ *	descriptor from the pool)
+ **********************************************************************************/
+static int charDevOpen(void){
+	return 0;
+}
+
+
+/***********************************************************************************
+ *	Close the descriptors in the pool
+ **********************************************************************************/
+static void charDevClose(void){
+	pthread_mutex_lock(&fdPoolLock);
+	while(fdPoolCount)
+		close(fdPool[--fdPoolCount]);
+	pthread_mutex_unlock(&fdPoolLock);
+}
+
+
+/***********************************************************************************
+ *	Get a descriptor of our own, the driver keeps the seek position in it
+ **********************************************************************************/
+static int charDevAcquire(void){
+	int fd = -1;
+	pthread_mutex_lock(&fdPoolLock);
+	if(fdPoolCount)
+		fd = fdPool[--fdPoolCount];
+	pthread_mutex_unlock(&fdPoolLock);
+	if(fd != -1)
+		return fd;
+
+	DEBUG_PRINT("--Opening the output file\n");
+	fd = open(CHAR_DEVICE_PATH, O_RDWR | O_CLOEXEC);
+	if(fd == -1)
+		syslog(LOG_ERR, "open %s: %s", CHAR_DEVICE_PATH, strerror(errno));
+	return fd;
+}
+
+
+/***********************************************************************************
+ *	Done with a descriptor, keep it for the next request if there's room
+ **********************************************************************************/
+static void charDevRelease(int fd){
+	pthread_mutex_lock(&fdPoolLock);
+	if(fdPoolCount < FD_POOL_SIZE){
+		fdPool[fdPoolCount++] = fd;
+		fd = -1;
+	}
+	pthread_mutex_unlock(&fdPoolLock);
+	if(fd != -1)
+		close(fd);
+}
+
+
+/***********************************************************************************
+ *	The driver does its own locking, and always appends. Then we rewind so the
+ *	reply reads the entire device.
+ **********************************************************************************/
+static int charDevAppend(pthread_mutex_t *mutex, int fd, uint32_t source, int stageFd, off_t stageLen,
+							const void *buf, size_t len, off_t *end, storageSnap_t **snap){
+	ssize_t byteCount = write(fd, buf, len);
+	if(byteCount < 0 || (size_t)byteCount != len){
+		syslog(LOG_ERR, "write to %s failed", CHAR_DEVICE_PATH);
+		return -1;
+	}
+
+	lseek(fd, 0, SEEK_SET);
+	if(end)
+		*end = -1;
+	return 0;
+}
+
+
+/***********************************************************************************
+ *	Read from an offset, or from wherever the last append or seek left us
+ **********************************************************************************/
+static ssize_t charDevRead(int fd, void *buf, size_t len, off_t off){
+	return (off >= 0) ? pread(fd, buf, len, off) : read(fd, buf, len);
+}
+
+
+/***********************************************************************************
+ *	The driver keeps its own length
+ **********************************************************************************/
+static off_t charDevSize(void){
+	return -1;
+}
+
+
+/***********************************************************************************
+ *	Have the driver move the descriptor, the reply is everything from there
+ **********************************************************************************/
+static int charDevSeekTo(int fd, uint32_t command, uint32_t offset, off_t *start, off_t *end, storageSnap_t **snap){
+	struct aesd_seekto st = {.write_cmd = command, .write_cmd_offset = offset};
+
+	DEBUG_PRINT("--Sending ioctl comamnd with st: %u, %u\n", st.write_cmd, st.write_cmd_offset);
+	if(ioctl(fd, AESDCHAR_IOCSEEKTO, &st)){
+		//In this case, we'll print an error to the screen, but not return anything to the client.
+		//This is the case where the command is properly formated, but the numbers are invalid, and
+		//	since we don't have a better way to let the remote client know, we'll just send back nothing.
+		perror("aesdchar_seekto");
+		return -1;
+	}
+	*start = -1;
+	*end = -1;
+	return 0;
+}
+
+
+const storageBackend_t charDevBackend = {
+	.name = "aesdchar",
+	.timestamps = false,
+	.descriptors = true,
+	.open = charDevOpen,
+	.close = charDevClose,
+	.acquire = charDevAcquire,
+	.release = charDevRelease,
+	.append = charDevAppend,
+	.read = charDevRead,
+	.size = charDevSize,
+	.seekTo = charDevSeekTo,
+};
@@ -0,0 +1,11 @@
+
+#ifndef CHARDEV_H
+#define CHARDEV_H
+
+#include "storage.h"
+
+//The aesdchar driver (CHAR_DEVICE_PATH). It does its own locking and keeps
+//	only the last few records, so there's no staging, snapshot or record index.
+extern const storageBackend_t charDevBackend;
+
+#endif //CHARDEV_H
@@ -1,244 +1,1080 @@
-
-#include <fcntl.h>
-#include <unistd.h>
-#include <string.h>
-#include <stdlib.h>
-#include <stdbool.h>
-#include <errno.h>
-#include <sys/socket.h>
-#include <stdio.h>
-#include <syslog.h>
-#include <signal.h> 
-#include <pthread.h>
-#include "../aesd-char-driver/aesd_ioctl.h"
-
-#include "linklist.h"
-#include "main.h"
-
-#define COMMAND_SEEKTO	"AESDCHAR_IOCSEEKTO:"
-
-
-/***********************************************************************************
- *	The function called when a new client is connected
- **********************************************************************************/
-void *processConnection(void *arg){
-	
-	//Extract the content we'll need for this connection
-	ll_t *connectionItem = (ll_t*) arg;
-	
-	DEBUG_PRINT("--Starting thread-per-connection\n");
-	
-	DEBUG_PRINT("--Allocating the first memory block\n");
-	//Assume a memory size, and we'll keep reading that amount until we get to the \n
-	unsigned char *recvData = malloc(BLOCK_SIZE);
-	if(!recvData){
-		syslog(LOG_ERR, "malloc: %s", strerror(errno));
-		close(connectionItem->socket);
-		return NULL;
-	}
-	int dataSize = BLOCK_SIZE;
-	int dataLen = 0;
-	int outf = -1;
-	ssize_t byteCount;
-	
-	DEBUG_PRINT("--Starting data receive loop\n");
-	while(1){
-		//Receive some data from the client
-		DEBUG_PRINT("--recieving the next block of data @ offset %i, (buffer size: %i)\n", dataLen, dataSize);
-		byteCount = recv(connectionItem->socket, recvData + dataLen, dataSize - dataLen, 0);
-		if(byteCount == -1){
-			if(errno == EAGAIN || errno == EINTR)
-				continue;
-			
-			//All other errors are terminal,
-			goto cleanupFail;
-		}
-		
-		dataLen += byteCount;
-		
-		//Find the \n, it is there yet
-		DEBUG_PRINT("--Searching for the '\\n' character\n");
-		char* nl = memchr(recvData, '\n', dataLen);
-		if(!nl){
-			DEBUG_PRINT("--'\\n' not found, we need to receive more data\n");
-			
-			//If we received a 0 (EOF), we're done without a full packet, so we'll ignore it
-			if(!byteCount){
-				syslog(LOG_ERR, "We did not receive a full packet from the client, dropping");
-				goto cleanupFail;
-			}
-			
-			//We need more data, check if there is any room left.
-			if(dataSize > dataLen)
-				continue;
-			
-			
-			//We need more room. Realloc and copy the existing data to the new memblock
-			DEBUG_PRINT("--Realloc'ing the buffer to store more data\n");
-			unsigned char *tmp = malloc(dataSize + BLOCK_SIZE);
-			if(!tmp){
-				syslog(LOG_ERR, "malloc: %s", strerror(errno));
-				goto cleanupFail;
-			}
-			dataSize += BLOCK_SIZE;
-			
-			
-			//Copy the data we want to keep to the newly allocated larger memory, and free
-			//	the original buffer.
-			DEBUG_PRINT("--Moving the data to the new buffer\n");
-			memcpy(tmp, recvData, dataLen);
-			free(recvData);
-			recvData = tmp;
-			
-			//We're ready to try reading more data now, so we'll go back to the top of the while.
-			continue;
-		}
-		
-			
-		
-		//We want to get the length we're concerned with (might not be the full data length)
-		DEBUG_PRINT("--Received a full packet (found '\\n' char)\n");
-		dataLen = (unsigned long)nl - (unsigned long)recvData + 1;
-		
-
-		
-		
-		//Open the output file since we're ready to write a full line
-		DEBUG_PRINT("--Opening the output file\n");
-		outf = open(FILE_PATH, O_APPEND | O_RDWR | O_CREAT, 0644);
-		if(outf == -1){
-			syslog(LOG_ERR, "open %s: %s", FILE_PATH, strerror(errno));
-			goto cleanupFail;
-		}
-	
-		
-#if !USE_AESD_CHAR_DEVICE
-		//Obtain the mutex used to maintain file write integrety.
-		DEBUG_PRINT("--Locking the mutex for file write access\n");
-		int rc=pthread_mutex_lock(connectionItem->mutex);
-		if(rc){
-			errno = rc;
-			perror("pthread_mutex_lock");
-			goto cleanupFail;
-		}
-		
-#else	// meaning USE_AESD_CHAR_DEVICE == 1
-		DEBUG_PRINT("--Checking if packet is a defined command\n");
-		if(!memcmp(recvData, COMMAND_SEEKTO, sizeof(COMMAND_SEEKTO)-1)){
-			struct aesd_seekto st;
-			if(sscanf((char*)recvData + sizeof(COMMAND_SEEKTO) - 1, "%u,%u", &st.write_cmd, &st.write_cmd_offset) != 2){
-				//Overwrite the \n with a \0 so we can include it in the error log entry.
-				recvData[dataLen-1] = '\0';
-				syslog(LOG_ERR, "seekto command format invalid: %s", recvData);
-				goto cleanupFailInLock;
-			}
-			
-			DEBUG_PRINT("--Sending ioctl comamnd with st: %u, %u\n", st.write_cmd, st.write_cmd_offset);
-			if(ioctl(outf, AESDCHAR_IOCSEEKTO, &st)){
-				//In this case, we'll print an error to the screen, but not return anything to the client. 
-				//This is the case where the command is properly formated, but the numbers are invalid, and
-				//	since we don't have a better way to let the remote client know, we'll just send back nothing.
-				perror("aesdchar_seekto");
-				goto cleanupFailInLock;
-			}
-		}
-		else{
-
-#endif
-		
-		//Write the data to the file we opened above
-		DEBUG_PRINT("--Writing data to the output file %s\n", FILE_PATH);
-		byteCount = write(outf, recvData, dataLen);
-		if(byteCount != dataLen){
-			syslog(LOG_ERR, "write to %s failed", FILE_PATH);
-			goto cleanupFailInLock;
-		}
-		
-		//Now rewind and read the entire file so we can send it
-		lseek(outf, 0, SEEK_SET);
-		
-#if USE_AESD_CHAR_DEVICE
-		}
-#endif
-		
-		
-		//Loop until we get all the data in the file sent off to the client
-		//	We'll be re-using the buffer we malloc'd above since we have that
-		//	buffer already. We continually loop until we've read and sent each 
-		//	block.
-		do{
-			//Read as much data as we can based on the size of our recvData buffer.
-			DEBUG_PRINT("--Reading data back in from the file\n");
-			byteCount = read(outf, recvData, dataSize);
-			if(!byteCount)
-				break;
-			
-			//Handle error cases
-			if(byteCount < 0){
-				if(errno == EAGAIN || errno == EINTR)
-					continue;
-				
-				syslog(LOG_ERR, "read: %s", strerror(errno));
-				goto cleanupFailInLock;
-			}
-			
-			//Send the data we have in the buffer to the client
-			DEBUG_PRINT("--Sending file data to client\n");
-			ssize_t bytesSent = send(connectionItem->socket, recvData, byteCount, 0);
-			if(bytesSent != byteCount){
-				syslog(LOG_ERR, "error sending %li bytes to client", byteCount);
-				goto cleanupFailInLock;
-			}
-		}while(byteCount);
-		
-#if !USE_AESD_CHAR_DEVICE		
-		//Release the mutex
-		DEBUG_PRINT("--Unocking the mutex\n");
-		rc=pthread_mutex_unlock(connectionItem->mutex);
-		if(rc){
-			errno = rc;
-			perror("pthread_mutex_unlock");
-			goto cleanupFail;
-		}
-#endif
-		
-		
-		DEBUG_PRINT("--Closing file\n");
-		close(outf);
-		break;
-	}
-
-	//Ensure we shutdown the connection to properly before we close it (notifying the client 
-	//	we're done sending data)
-	if(shutdown(connectionItem->socket, SHUT_RDWR))
-		syslog(LOG_ERR, "shutdown: %s", strerror(errno));
-	
-	//Close our handle and log that we're done with this client
-	close(connectionItem->socket);
-	uint32_t clientIP = connectionItem->ip;
-	syslog(LOG_INFO, "Closed connection from %u.%u.%u.%u",
-				clientIP >> 24, (clientIP >> 16) & 0xFF, (clientIP >> 8) & 0xFF, clientIP & 0xFF);
-	
-	//Free our buffer and exit
-	free(recvData); 
-	return NULL;
-	
-
-//On fail inside the locked mutex area, we need to unlock that before we exit!
-cleanupFailInLock:
-#if !USE_AESD_CHAR_DEVICE
-	rc=pthread_mutex_unlock(connectionItem->mutex);
-	if(rc){
-		errno = rc;
-		perror("pthread_mutex_unlock");
-	}
-#endif
-
-//On fail, we need to complete cleanup
-cleanupFail:
-	if(outf != -1)
-		close(outf);
-	free(recvData);
-	close(connectionItem->socket);
-	return NULL;
-}
\ No newline at end of file
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <poll.h>
+#include <stdio.h>
+#include <syslog.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+
+#include "affinity.h"
+#include "admission.h"
+#include "bufpool.h"
+#include "logger.h"
+#include "ratelimit.h"
+#include "scan.h"
+#include "search.h"
+#include "storage.h"
+#include "stats.h"
+#include "conntable.h"
+#include "connection.h"
+#include "main.h"
+
+#define COMMAND_SEEKTO	"AESDCHAR_IOCSEEKTO:"
+#define COMMAND_SINCE	"AESD_SINCE:"		//Everything after a cursor, and the new cursor
+#define COMMAND_RANGE	"AESD_RANGE:"		//A byte or record range
+#define COMMAND_STAT	"AESD_STAT\n"		//Size and record count
+#define COMMAND_SEARCH	"AESD_SEARCH:"		//Records containing a pattern
+#define COMMAND_SEARCH_IN	"AESD_SEARCH_IN:"	//The same within a range
+
+static connEcho_t echoPolicy = CONN_ECHO_ONCE;
+
+//Slow client policy (highWater of 0 turns it off)
+static size_t slowHighWater = 0;
+static int slowGraceMs = 0;
+static unsigned long statSlowDrops = 0;
+
+
+/***********************************************************************************
+ *	Choose when clients get the content echoed back (set once, before any
+ *	connections are made)
+ **********************************************************************************/
+void connSetEchoPolicy(connEcho_t policy){
+	echoPolicy = policy;
+}
+
+connEcho_t connEchoPolicy(void){
+	return echoPolicy;
+}
+
+
+/***********************************************************************************
+ *	Log how many clients we've dropped for being too slow (registered with the
+ *	stats dump)
+ **********************************************************************************/
+static void connStats(void){
+	syslog(LOG_INFO, "slow clients: %lu dropped (high-water %zu bytes, %i ms grace)",
+			__atomic_load_n(&statSlowDrops, __ATOMIC_RELAXED), slowHighWater, slowGraceMs);
+}
+
+
+/***********************************************************************************
+ *	Set the slow client policy (once, before any connections are made)
+ **********************************************************************************/
+void connSetSlowPolicy(size_t highWater, int graceMs){
+	slowHighWater = highWater;
+	slowGraceMs = graceMs;
+	if(highWater)
+		statsRegister(connStats);
+}
+
+int connSlowSweepMs(void){
+	return slowHighWater ? SLOW_SWEEP_MS : -1;
+}
+
+
+/***********************************************************************************
+ *	Check the client is keeping up with its reply. It's behind while more than
+ *	the high-water mark is still waiting for it, pending (what we haven't handed
+ *	to the socket yet) plus whatever is sitting in the socket's send queue. One
+ *	that stays behind for the whole grace period is too slow, and gets dropped
+ *	so it isn't holding on to a worker, a buffer or a snapshot forever. How fast
+ *	a client reads never changes how long any lock is held, this is only about
+ *	what the client itself is tying up.
+ *
+ *	Returns true if the connection should be dropped.
+ **********************************************************************************/
+bool connTooSlow(conn_t *conn, off_t pending){
+	if(!slowHighWater)
+		return false;
+
+	int unsent = 0;
+	if(!ioctl(conn->socket, SIOCOUTQ, &unsent) && unsent > 0)
+		pending += unsent;
+	if(pending <= (off_t)slowHighWater){
+		conn->behindSince = 0;
+		return false;
+	}
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	uint64_t now = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000 + 1;		//Never 0
+	if(!conn->behindSince){
+		conn->behindSince = now;
+		return false;
+	}
+	if(now - conn->behindSince < (uint64_t)slowGraceMs)
+		return false;
+
+	uint32_t clientIP = conn->ip;
+	syslog(LOG_INFO, "Dropping slow client %u.%u.%u.%u, %lld bytes behind for %llu ms",
+			clientIP >> 24, (clientIP >> 16) & 0xFF, (clientIP >> 8) & 0xFF, clientIP & 0xFF,
+			(long long)pending, (unsigned long long)(now - conn->behindSince));
+	__atomic_add_fetch(&statSlowDrops, 1, __ATOMIC_RELAXED);
+
+	//Reset rather than close, so the kernel throws away what's queued instead of
+	//	trying to deliver it to a client that isn't reading
+	struct linger lin = {.l_onoff = 1, .l_linger = 0};
+	setsockopt(conn->socket, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+	return true;
+}
+
+
+/***********************************************************************************
+ *	Get the output descriptor since we're ready to write a full line. We hang on
+ *	to it for the rest of the connection.
+ **********************************************************************************/
+int connOpenOutput(conn_t *conn){
+	if(conn->outf == -1)
+		conn->outf = storageAcquire();
+	return (conn->outf == -1) ? -1 : 0;
+}
+
+
+/***********************************************************************************
+ *	Check if the packet starts with a command, and where its arguments are
+ **********************************************************************************/
+static bool connIsCommand(conn_t *conn, const char *command, size_t len, const char **args){
+	if((size_t)conn->packetLen < len || memcmp(conn->recvData, command, len))
+		return false;
+	*args = (const char *)conn->recvData + len;
+	return true;
+}
+
+/***********************************************************************************
+ *	Parse a position for the cursor/range commands, a byte offset or a record
+ *	number with a leading '#'.
+ **********************************************************************************/
+static int connParsePos(const char **p, long long *value, bool *record){
+	char *end;
+	*record = (**p == '#');
+	if(*record)
+		(*p)++;
+	if(**p < '0' || **p > '9')
+		return -1;
+
+	*value = strtoll(*p, &end, 10);
+	*p = end;
+	return 0;
+}
+
+/***********************************************************************************
+ *	Turn a parsed position into a byte offset, clipped to the committed length
+ *	(a record number past the end just means the end). A length of -1 (the
+ *	char device) doesn't clip.
+ **********************************************************************************/
+static off_t connPosOffset(long long value, bool record, long records, off_t length){
+	off_t off = record ? storageRecordOffset(value < records ? value : records) : value;
+	return (length >= 0 && off > length) ? length : off;
+}
+
+/***********************************************************************************
+ *	Log a bad command (the packet's '\n' is overwritten to end the string)
+ **********************************************************************************/
+static int connBadCommand(conn_t *conn, const char *why){
+	conn->recvData[conn->packetLen-1] = '\0';
+	syslog(LOG_ERR, "%s: %s", why, conn->recvData);
+	return -1;
+}
+
+/***********************************************************************************
+ *	Reply with [start, end) of the store (after the header line). -1 for start
+ *	is the descriptor's position, and for end its end (the char device).
+ **********************************************************************************/
+static void connReplyRange(conn_t *conn, off_t start, off_t end){
+	conn->sendOff = start;
+	conn->sendRemain = (end < 0) ? -1 : (end > start) ? end - start : 0;
+}
+
+
+/***********************************************************************************
+ *	The cursor, range and stat commands. Clients that keep a cursor only get
+ *	what's new each time, rather than the whole store. Every answer comes from
+ *	what storage has published, so none of them take a lock, and STAT (and
+ *	finding a record) is O(1).
+ *
+ *		AESD_SINCE:<pos>			CURSOR:<bytes>,#<records>\n then [pos, end)
+ *		AESD_RANGE:<pos>,<pos>		RANGE:<start>,<end>\n then [start, end)
+ *		AESD_STAT					STAT:<bytes>,<records>\n
+ *
+ *	A <pos> is a byte offset, or a record number with a leading '#' (the first
+ *	record is #0). Ranges are clipped to what's been committed, and SINCE by
+ *	record only returns whole records. The cursor is where to pick up from
+ *	next time, by either count.
+ *
+ *	Returns 1 if it was one of these, 0 if not and -1 if it failed.
+ **********************************************************************************/
+static int connRunCursorCommand(conn_t *conn){
+	const char *p;
+	bool since = connIsCommand(conn, COMMAND_SINCE, sizeof(COMMAND_SINCE)-1, &p);
+	bool range = !since && connIsCommand(conn, COMMAND_RANGE, sizeof(COMMAND_RANGE)-1, &p);
+	bool stat = !since && !range && connIsCommand(conn, COMMAND_STAT, sizeof(COMMAND_STAT)-1, &p);
+	if(!since && !range && !stat)
+		return 0;
+
+	//Records first, so the length we read afterwards covers all of them
+	long records = storageRecordCount();
+	off_t length = storageCommitted();
+	if(records < 0 || length < 0)
+		return connBadCommand(conn, "command needs the data file (not the char device)");
+
+	if(stat){
+		conn->headLen = snprintf(conn->head, sizeof(conn->head), "STAT:%lld,%ld\n", (long long)length, records);
+		connReplyRange(conn, 0, 0);
+		return 1;
+	}
+
+	long long first = 0, last = 0;
+	bool firstRecord = false, lastRecord = false;
+	if(connParsePos(&p, &first, &firstRecord))
+		return connBadCommand(conn, "command format invalid");
+	if(range && (*p++ != ',' || connParsePos(&p, &last, &lastRecord)))
+		return connBadCommand(conn, "command format invalid");
+	if(*p != '\n')
+		return connBadCommand(conn, "command format invalid");
+
+	off_t start = connPosOffset(first, firstRecord, records, length);
+	if(since){
+		off_t end = firstRecord ? storageRecordOffset(records) : length;
+		conn->headLen = snprintf(conn->head, sizeof(conn->head), "CURSOR:%lld,#%ld\n", (long long)end, records);
+		connReplyRange(conn, start, end);
+		return 1;
+	}
+
+	off_t end = connPosOffset(last, lastRecord, records, length);
+	if(end < start)
+		end = start;
+	conn->headLen = snprintf(conn->head, sizeof(conn->head), "RANGE:%lld,%lld\n", (long long)start, (long long)end);
+	connReplyRange(conn, start, end);
+	return 1;
+}
+
+
+/***********************************************************************************
+ *	Search the store for the records containing a literal pattern, so nobody has
+ *	to download all of it to grep for a few lines.
+ *
+ *		AESD_SEARCH:<pattern>					SEARCH:<matches>,<next>\n then the records
+ *		AESD_SEARCH_IN:<pos>,<pos>:<pattern>	the same, within a range
+ *
+ *	A <pos> is as for AESD_RANGE. next is the byte offset the search got up to,
+ *	the end of the range unless the reply filled up (carry on from there with
+ *	AESD_SEARCH_IN). The char device is searched by reading through it, and
+ *	only takes byte ranges.
+ *
+ *	Returns 1 if it was a search, 0 if not and -1 if it failed.
+ **********************************************************************************/
+static int connRunSearchCommand(conn_t *conn){
+	const char *p;
+	bool in = connIsCommand(conn, COMMAND_SEARCH_IN, sizeof(COMMAND_SEARCH_IN)-1, &p);
+	if(!in && !connIsCommand(conn, COMMAND_SEARCH, sizeof(COMMAND_SEARCH)-1, &p))
+		return 0;
+
+	long records = storageRecordCount();
+	off_t length = storageCommitted();
+	off_t start = 0;
+	off_t end = length;
+	if(in){
+		long long first, last;
+		bool firstRecord, lastRecord;
+		if(connParsePos(&p, &first, &firstRecord) || *p++ != ',' || connParsePos(&p, &last, &lastRecord) || *p++ != ':')
+			return connBadCommand(conn, "search format invalid");
+		if((firstRecord || lastRecord) && records < 0)
+			return connBadCommand(conn, "record numbers need the data file (not the char device)");
+
+		start = connPosOffset(first, firstRecord, records, length);
+		end = connPosOffset(last, lastRecord, records, length);
+		if(end < start)
+			end = start;
+	}
+
+	const unsigned char *pattern = (const unsigned char *)p;
+	size_t patternLen = conn->recvData + conn->packetLen - 1 - pattern;
+	if(!patternLen)
+		return connBadCommand(conn, "search pattern empty");
+
+	searchResult_t result;
+	if(searchRun(conn->outf, start, end, pattern, patternLen, &result))
+		return -1;
+
+	//The matches are the reply, straight out of memory
+	conn->headLen = snprintf(conn->head, sizeof(conn->head), "SEARCH:%ld,%lld\n", result.matches, (long long)result.next);
+	conn->sendBuf = result.buf;
+	conn->sendSize = result.size;
+	conn->sendLen = result.len;
+	conn->sendPos = 0;
+	conn->sendOff = 0;
+	conn->sendRemain = 0;
+	conn->reply = REPLY_BUFFERED;
+	return 1;
+}
+
+
+/***********************************************************************************
+ *	Check if the packet is a command rather than data, and run it if it is.
+ *
+ *	Returns 1 if it was a command (the reply is set up, or for the char device
+ *	outf is left where it should be read from), 0 if it is regular data and -1
+ *	if the command failed. The seekto command is only one for a backend that
+ *	can seek by record (the char device and the ring), in the file it's data.
+ **********************************************************************************/
+int connRunCommand(conn_t *conn){
+	int cmd = connRunCursorCommand(conn);
+	if(!cmd)
+		cmd = connRunSearchCommand(conn);
+	if(cmd)
+		return cmd;
+
+	DEBUG_PRINT("--Checking if packet is a defined command\n");
+	const char *p;
+	if(storageBackend()->seekTo && connIsCommand(conn, COMMAND_SEEKTO, sizeof(COMMAND_SEEKTO)-1, &p)){
+		unsigned int command, offset;
+		if(sscanf(p, "%u,%u", &command, &offset) != 2)
+			return connBadCommand(conn, "seekto command format invalid");
+
+		off_t start, end;
+		if(storageSeekTo(conn->outf, command, offset, &start, &end, &conn->snap))
+			return -1;
+		connReplyRange(conn, start, end);
+		return 1;
+	}
+	return 0;
+}
+
+
+/***********************************************************************************
+ *	Answer a packet with just reply (and throw away any of it that was staged)
+ **********************************************************************************/
+static int connRefuse(conn_t *conn, const char *reply){
+	storageStageDrop(&conn->stageFd, &conn->stageLen);
+	conn->headLen = snprintf(conn->head, sizeof(conn->head), "%s", reply);
+	conn->sendOff = 0;
+	conn->sendRemain = 0;
+	conn->refused = true;
+	return 0;
+}
+
+
+/***********************************************************************************
+ *	Store a full packet (recvData[0..packetLen-1]) and note where the reply is
+ *	read from so the content can be sent back to the client.
+ *
+ *	In file mode the store only holds the mutex long enough to write and note the
+ *	new length. We'll send back exactly that many bytes from offset 0, so later
+ *	writers (or the timestamp timer) can't change what this client receives.
+ *	The char device reply reads from the descriptor's own position instead.
+ **********************************************************************************/
+int connStore(conn_t *conn){
+
+	if(connOpenOutput(conn))
+		return -1;
+
+	//With -k last only one reply ever goes out, so once a packet has been
+	//	refused that's it. The rest are read and thrown away until the client
+	//	half-closes, then it gets the refusal.
+	if(conn->refused){
+		storageStageDrop(&conn->stageFd, &conn->stageLen);
+		return 0;
+	}
+
+	//Whatever an earlier packet set up for its reply (-k last) is replaced
+	connReplyDone(conn);
+
+	//One too many requests in flight, or a client over its rate, is answered
+	//	and nothing is stored (the client can try again, on this connection
+	//	with -k). Admission goes first so a BUSY costs the client no tokens.
+	//	Staged bytes were paid for as they were staged.
+	if(!admitRequest())
+		return connRefuse(conn, ADMIT_BUSY_REPLY);
+	if(!rateAllow(conn->ip, conn->packetLen)){
+		admitRequestDone();
+		return connRefuse(conn, RATE_LIMITED_REPLY);
+	}
+	conn->inFlight = true;
+
+	//A staged packet is always data, no command is ever that long
+	if(!conn->stageLen){
+		int cmd = connRunCommand(conn);
+		if(cmd)
+			return cmd > 0 ? 0 : -1;
+	}
+
+	off_t end;
+	int rc = storageAppendStaged(conn->mutex, conn->outf, conn->ip, conn->stageFd, conn->stageLen,
+									conn->recvData, conn->packetLen, &end, &conn->snap);
+	storageStageDrop(&conn->stageFd, &conn->stageLen);
+	if(rc)
+		return -1;
+
+	//The char device has rewound the descriptor, so its reply is the entire device
+	connReplyRange(conn, (end < 0) ? -1 : 0, end);
+	return 0;
+}
+
+
+/***********************************************************************************
+ *	Check the received data for a full packet. Only the bytes we haven't looked at
+ *	yet are searched, and every '\n' in them is noted in one pass, so the packets
+ *	after this one don't need another scan. packetLen is set once we have one.
+ **********************************************************************************/
+bool connFindPacket(conn_t *conn){
+	if(conn->packetLen)
+		return true;
+
+	if(!conn->delimCount && conn->scanPos < conn->dataLen){
+		DEBUG_PRINT("--Searching for the '\\n' character\n");
+		int found = scanDelims(conn->recvData + conn->scanPos, conn->dataLen - conn->scanPos, '\n',
+								conn->delims, CONN_MAX_DELIMS);
+		for(int i = 0; i < found; i++)
+			conn->delims[i] += conn->scanPos;
+		conn->delimCount = found;
+
+		//If we ran out of room, carry on from the last one we have next time
+		conn->scanPos = (found == CONN_MAX_DELIMS) ? (int)conn->delims[found - 1] + 1 : conn->dataLen;
+	}
+	if(!conn->delimCount)
+		return false;
+
+	//We want to get the length we're concerned with (might not be the full data length)
+	DEBUG_PRINT("--Received a full packet (found '\\n' char)\n");
+	conn->packetLen = conn->delims[0] + 1;
+	conn->delimCount--;
+	memmove(conn->delims, conn->delims + 1, conn->delimCount * sizeof(conn->delims[0]));
+	return true;
+}
+
+
+/***********************************************************************************
+ *	Make room for at least minSize bytes of received data. Growing counts
+ *	against the buffered bytes limit, a connection that would take us over
+ *	it is told we're busy and dropped.
+ **********************************************************************************/
+int connGrow(conn_t *conn, size_t minSize){
+	size_t grown = (minSize > (size_t)conn->dataSize * 2) ? minSize : (size_t)conn->dataSize * 2;
+	if(!admitBuffer(grown - conn->dataSize)){
+		LOG_FAST(LOG_ERR, "Over the buffered bytes limit, dropping connection");
+		send(conn->socket, ADMIT_BUSY_REPLY, sizeof(ADMIT_BUSY_REPLY) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+		return -1;
+	}
+
+	DEBUG_PRINT("--Growing the buffer to store more data\n");
+	if(bufGrow(&conn->recvData, &conn->dataSize, conn->dataLen, minSize)){
+		syslog(LOG_ERR, "Unable to grow the buffer: %s", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+
+/***********************************************************************************
+ *	Called when the received data holds no '\n' (all of it is the front of a
+ *	packet). Once that's STREAM_WINDOW bytes, it goes out to the packet's
+ *	staging file and we start again at the front of the same buffer, so
+ *	memory stays bounded however long the packet is. A backend that can't
+ *	stage (the char device and the ring take each record whole) keeps
+ *	buffering until the '\n'.
+ *
+ *	Staged bytes are charged to the client's rate as they go, so a client over
+ *	its byte rate is told it's throttled and dropped here, rather than once
+ *	the whole packet is in.
+ **********************************************************************************/
+int connStage(conn_t *conn){
+	if(conn->dataLen < STREAM_WINDOW || !storageBackend()->stageWrite)
+		return 0;
+
+	if(!rateAllowBytes(conn->ip, conn->dataLen)){
+		LOG_FAST(LOG_ERR, "Client over its byte rate while staging, dropping connection");
+		send(conn->socket, RATE_LIMITED_REPLY, sizeof(RATE_LIMITED_REPLY) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+		storageStageDrop(&conn->stageFd, &conn->stageLen);
+		return -1;
+	}
+
+	DEBUG_PRINT("--Staging %i bytes of a long packet\n", conn->dataLen);
+	if(storageStageWrite(&conn->stageFd, &conn->stageLen, conn->recvData, conn->dataLen))
+		return -1;
+	conn->dataLen = 0;
+	conn->scanPos = 0;
+	return 0;
+}
+
+
+/***********************************************************************************
+ *	Get a buffer for a reply that has to be read in and sent. It's a separate
+ *	(large) buffer from the pool, so the received data is never in the way.
+ **********************************************************************************/
+int connReplyBuffer(conn_t *conn){
+	if(conn->sendBuf)
+		return 0;
+
+	conn->sendBuf = bufGet(REPLY_BUF_SIZE, &conn->sendSize);
+	if(!conn->sendBuf){
+		syslog(LOG_ERR, "Unable to get a buffer: %s", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/***********************************************************************************
+ *	See if the reply can come straight out of the storage snapshot. That's only
+ *	when we know exactly which bytes we're sending (file mode), and the snapshot
+ *	already holds all of them. We keep a reference until the reply is done, so
+ *	appends that move the snapshot to a bigger buffer don't pull it out from
+ *	under us.
+ **********************************************************************************/
+bool connReplySnapshot(conn_t *conn){
+	if(conn->snap)
+		return true;
+	if(conn->sendOff < 0 || conn->sendRemain <= 0)
+		return false;
+
+	conn->snap = storageSnapshot(conn->sendOff + conn->sendRemain);
+	return conn->snap != NULL;
+}
+
+/***********************************************************************************
+ *	The reply has been sent, the buffer goes back to the pool until next time
+ **********************************************************************************/
+void connReplyDone(conn_t *conn){
+	bufPut(conn->sendBuf, conn->sendSize);
+	conn->sendBuf = NULL;
+	conn->sendSize = 0;
+	storageSnapRelease(conn->snap);
+	conn->snap = NULL;
+	conn->sendLen = conn->sendPos = 0;
+	conn->headLen = conn->headPos = 0;
+	conn->reply = REPLY_NONE;
+	conn->behindSince = 0;
+	if(conn->inFlight)
+		admitRequestDone();
+	conn->inFlight = false;
+	conn->refused = false;
+}
+
+
+/***********************************************************************************
+ *	Done with the packet at the front of the buffer, move whatever came in after
+ *	it to the front so it becomes the start of the next one.
+ **********************************************************************************/
+void connNextPacket(conn_t *conn){
+	int leftover = conn->dataLen - conn->packetLen;
+	if(leftover)
+		memmove(conn->recvData, conn->recvData + conn->packetLen, leftover);
+	conn->dataLen = leftover;
+
+	//What we've already scanned (and found) moves down with it
+	for(int i = 0; i < conn->delimCount; i++)
+		conn->delims[i] -= conn->packetLen;
+	conn->scanPos -= conn->packetLen;
+	conn->packetLen = 0;
+}
+
+
+/***********************************************************************************
+ *	The client has half-closed. Any partial packet is dropped, and depending on
+ *	the echo policy we either send the content one last time or we're done.
+ **********************************************************************************/
+int connPeerClosed(conn_t *conn){
+	conn->peerClosed = true;
+
+	if(conn->dataLen || conn->stageLen){
+		LOG_FAST(LOG_ERR, "We did not receive a full packet from the client, dropping");
+		conn->dataLen = 0;
+		conn->scanPos = 0;
+		conn->delimCount = 0;
+		storageStageDrop(&conn->stageFd, &conn->stageLen);
+	}
+
+	if(echoPolicy == CONN_ECHO_LAST && conn->packets)
+		conn->state = CONN_SEND;
+	else
+		conn->state = CONN_DONE;
+	return 1;
+}
+
+
+/***********************************************************************************
+ *	Receive data until we have a full packet, and store it once we do. Packets
+ *	carried over from an earlier receive are handled before we read any more.
+ *
+ *	Returns 1 when the state changed, 0 if the socket has nothing for us right
+ *	now (non-blocking sockets only) and -1 on failure.
+ **********************************************************************************/
+static int connReceive(conn_t *conn){
+	ssize_t byteCount;
+
+	while(1){
+		if(connFindPacket(conn)){
+			//A single packet connection ignores anything sent after the '\n'
+			if(echoPolicy == CONN_ECHO_ONCE){
+				conn->dataLen = conn->packetLen;
+				conn->delimCount = 0;
+			}
+
+			if(connStore(conn))
+				return -1;
+			conn->packets++;
+
+			//Nothing goes back until the client is done, so keep going
+			if(echoPolicy == CONN_ECHO_LAST){
+				connNextPacket(conn);
+				continue;
+			}
+
+			conn->state = CONN_SEND;
+			return 1;
+		}
+
+		//A long packet moves out to its staging file rather than growing the buffer
+		if(connStage(conn))
+			return -1;
+
+		//We need more data, check if there is any room left.
+		if(conn->dataSize == conn->dataLen){
+
+			//We need more room. Swap to a buffer (at least) twice the size with the
+			//	existing data copied over, the old one goes back to the pool.
+			if(connGrow(conn, conn->dataLen + BLOCK_SIZE))
+				return -1;
+		}
+
+		//Receive some data from the client
+		DEBUG_PRINT("--recieving the next block of data @ offset %i, (buffer size: %i)\n", conn->dataLen, conn->dataSize);
+		byteCount = recv(conn->socket, conn->recvData + conn->dataLen, conn->dataSize - conn->dataLen, 0);
+		if(byteCount == -1){
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+
+			//All other errors are terminal,
+			return -1;
+		}
+
+		if(!byteCount){
+			//If we received a 0 (EOF) on a single packet connection, we're done without
+			//	a full packet, so we'll ignore it
+			if(echoPolicy == CONN_ECHO_ONCE){
+				LOG_FAST(LOG_ERR, "We did not receive a full packet from the client, dropping");
+				return -1;
+			}
+			return connPeerClosed(conn);
+		}
+
+		conn->dataLen += byteCount;
+	}
+}
+
+
+/***********************************************************************************
+ *	How much to ask for in one go (sendRemain of -1 means until EOF)
+ **********************************************************************************/
+static size_t connSendChunk(conn_t *conn, size_t max){
+	if(conn->sendRemain > 0 && conn->sendRemain < (off_t)max)
+		return conn->sendRemain;
+	return max;
+}
+
+/***********************************************************************************
+ *	Where to read the reply from, sendOff or (if it's -1) outf's own position
+ **********************************************************************************/
+static off_t *connSendOffset(conn_t *conn){
+	return (conn->sendOff >= 0) ? &conn->sendOff : NULL;
+}
+
+
+/***********************************************************************************
+ *	sendfile() the reply, the data never comes up to user space. The shared file
+ *	is read from our own offset, the char device from its descriptor's position
+ *	(so commands that seek still work).
+ *
+ *	Returns 1 when the reply is done, 0 if the socket is full, -1 on failure
+ *	and -2 if outf can't be used with sendfile() (nothing has been sent).
+ **********************************************************************************/
+static int connSendFile(conn_t *conn){
+	while(conn->sendRemain){
+		ssize_t byteCount = sendfile(conn->socket, conn->outf, connSendOffset(conn), connSendChunk(conn, 1 << 30));
+		if(byteCount == -1){
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN)
+				return 0;
+			if(errno == EINVAL || errno == ENOSYS)
+				return -2;
+
+			syslog(LOG_ERR, "sendfile: %s", strerror(errno));
+			return -1;
+		}
+		if(!byteCount)
+			break;
+
+		if(conn->sendRemain > 0)
+			conn->sendRemain -= byteCount;
+	}
+	return 1;
+}
+
+
+/***********************************************************************************
+ *	splice() the reply through a pipe, for sources sendfile() won't take. Data
+ *	can be left in the pipe if the socket fills up, so that goes first.
+ *
+ *	Returns the same as connSendFile().
+ **********************************************************************************/
+static int connSplice(conn_t *conn){
+	if(conn->pipeFds[0] == -1 && pipe2(conn->pipeFds, O_CLOEXEC | O_NONBLOCK)){
+		syslog(LOG_ERR, "pipe2: %s", strerror(errno));
+		return -1;
+	}
+
+	while(1){
+		if(conn->pipeLen){
+			ssize_t byteCount = splice(conn->pipeFds[0], NULL, conn->socket, NULL, conn->pipeLen,
+									SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if(byteCount == -1){
+				if(errno == EINTR)
+					continue;
+				if(errno == EAGAIN)
+					return 0;
+				syslog(LOG_ERR, "splice: %s", strerror(errno));
+				return -1;
+			}
+			conn->pipeLen -= byteCount;
+			continue;
+		}
+
+		if(!conn->sendRemain)
+			return 1;
+
+		ssize_t byteCount = splice(conn->outf, connSendOffset(conn), conn->pipeFds[1], NULL, connSendChunk(conn, REPLY_BUF_SIZE),
+								SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if(byteCount == -1){
+			if(errno == EINTR || errno == EAGAIN)
+				continue;
+			if(errno == EINVAL || errno == ENOSYS)
+				return -2;
+			syslog(LOG_ERR, "splice: %s", strerror(errno));
+			return -1;
+		}
+		if(!byteCount)
+			return 1;
+
+		conn->pipeLen = byteCount;
+		if(conn->sendRemain > 0)
+			conn->sendRemain -= byteCount;
+	}
+}
+
+
+/***********************************************************************************
+ *	The fallback, read into a large buffer and send it, one buffer at a time.
+ *
+ *	Returns the same as connSendFile() (except it's never unsupported).
+ **********************************************************************************/
+static int connSendBuffered(conn_t *conn){
+	ssize_t byteCount;
+
+	if(connReplyBuffer(conn))
+		return -1;
+
+	while(1){
+		//Read as much data as we can based on the size of our buffer.
+		if(conn->sendPos == conn->sendLen){
+			if(!conn->sendRemain)
+				break;
+
+			DEBUG_PRINT("--Reading data back in from the file\n");
+			byteCount = storageRead(conn->outf, conn->sendBuf, connSendChunk(conn, conn->sendSize), conn->sendOff);
+			if(byteCount > 0 && conn->sendOff >= 0)
+				conn->sendOff += byteCount;
+			if(!byteCount)
+				break;
+
+			//Handle error cases
+			if(byteCount < 0){
+				if(errno == EAGAIN || errno == EINTR)
+					continue;
+
+				syslog(LOG_ERR, "read: %s", strerror(errno));
+				return -1;
+			}
+
+			conn->sendLen = byteCount;
+			conn->sendPos = 0;
+			if(conn->sendRemain > 0)
+				conn->sendRemain -= byteCount;
+		}
+
+		//Send the data we have in the buffer to the client
+		DEBUG_PRINT("--Sending file data to client\n");
+		byteCount = send(conn->socket, conn->sendBuf + conn->sendPos, conn->sendLen - conn->sendPos, MSG_NOSIGNAL);
+		if(byteCount == -1){
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+
+			syslog(LOG_ERR, "error sending %i bytes to client", conn->sendLen - conn->sendPos);
+			return -1;
+		}
+		conn->sendPos += byteCount;
+	}
+	return 1;
+}
+
+
+/***********************************************************************************
+ *	Send the header line a command's reply starts with. MSG_MORE lets it go out
+ *	in the same segment as the start of the data.
+ *
+ *	Returns the same as connSendBuffered().
+ **********************************************************************************/
+static int connSendHead(conn_t *conn){
+	while(conn->headPos < conn->headLen){
+		ssize_t byteCount = send(conn->socket, conn->head + conn->headPos, conn->headLen - conn->headPos,
+								MSG_NOSIGNAL | (conn->sendRemain ? MSG_MORE : 0));
+		if(byteCount == -1){
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+
+			syslog(LOG_ERR, "error sending %i bytes to client", conn->headLen - conn->headPos);
+			return -1;
+		}
+		conn->headPos += byteCount;
+	}
+	return 1;
+}
+
+
+/***********************************************************************************
+ *	Send the reply from the snapshot, no system call to read it back at all.
+ *
+ *	Returns the same as connSendBuffered().
+ **********************************************************************************/
+static int connSendSnapshot(conn_t *conn){
+	while(conn->sendRemain){
+		ssize_t byteCount = send(conn->socket, conn->snap->data + conn->sendOff, conn->sendRemain, MSG_NOSIGNAL);
+		if(byteCount == -1){
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+
+			syslog(LOG_ERR, "error sending %lld bytes to client", (long long)conn->sendRemain);
+			return -1;
+		}
+		conn->sendOff += byteCount;
+		conn->sendRemain -= byteCount;
+	}
+	return 1;
+}
+
+
+/***********************************************************************************
+ *	Reply bytes we still have to hand to the socket
+ **********************************************************************************/
+static off_t connPending(conn_t *conn){
+	off_t pending = conn->headLen - conn->headPos + conn->sendLen - conn->sendPos + conn->pipeLen;
+	if(conn->sendRemain > 0)
+		pending += conn->sendRemain;
+	return pending;
+}
+
+
+/***********************************************************************************
+ *	Send the file content back to the client, zero copy if the output supports it.
+ *	Once a method turns out not to work we remember that, so later replies start
+ *	with the one that does. A backend without descriptors has nothing to
+ *	sendfile() or splice() from, so it's the snapshot or buffered.
+ *
+ *	Returns 1 when the state changed, 0 if the socket can't take more data right
+ *	now (non-blocking sockets only) and -1 on failure.
+ **********************************************************************************/
+static int connSend(conn_t *conn){
+	static connReply_t bestReply = REPLY_SENDFILE;
+	int rc;
+
+	if(conn->reply == REPLY_NONE)
+		conn->reply = connReplySnapshot(conn) ? REPLY_SNAPSHOT :
+						!storageBackend()->descriptors ? REPLY_BUFFERED : __atomic_load_n(&bestReply, __ATOMIC_RELAXED);
+
+	//A command's header line goes before anything else
+	rc = connSendHead(conn);
+	while(rc > 0){
+		if(conn->reply == REPLY_SNAPSHOT)
+			rc = connSendSnapshot(conn);
+		else if(conn->reply == REPLY_SENDFILE)
+			rc = connSendFile(conn);
+		else if(conn->reply == REPLY_SPLICE)
+			rc = connSplice(conn);
+		else
+			rc = connSendBuffered(conn);
+
+		if(rc != -2)
+			break;
+
+		DEBUG_PRINT("--Reply method %i unsupported, trying the next one\n", conn->reply);
+		conn->reply++;
+		__atomic_store_n(&bestReply, conn->reply, __ATOMIC_RELAXED);
+		rc = 1;
+	}
+
+	//The socket is full, make sure the client isn't too far behind
+	if(!rc && connTooSlow(conn, connPending(conn)))
+		return -1;
+	if(rc <= 0)
+		return rc;
+
+	connReplyDone(conn);
+
+	//Go back for the next packet unless this was the last reply
+	if(echoPolicy == CONN_ECHO_EACH){
+		connNextPacket(conn);
+		conn->state = CONN_RECV;
+		return 1;
+	}
+
+	conn->state = CONN_DONE;
+	return 1;
+}
+
+
+/***********************************************************************************
+ *	Get a connection ready to be processed.
+ **********************************************************************************/
+int connInit(conn_t *conn, int socket, uint32_t ip, pthread_mutex_t *mutex){
+
+	memset(conn, 0, sizeof(*conn));
+	conn->socket = socket;
+	conn->ip = ip;
+	conn->mutex = mutex;
+	conn->outf = -1;
+	conn->stageFd = -1;
+	conn->pipeFds[0] = conn->pipeFds[1] = -1;
+	conn->state = CONN_RECV;
+
+	affinityNoteConnection(socket);
+
+	DEBUG_PRINT("--Getting the first memory block\n");
+	//Start with the smallest pooled buffer, it doubles as needed until we get to the \n
+	conn->recvData = bufGet(BUF_MIN_SIZE, &conn->dataSize);
+	if(!conn->recvData){
+		syslog(LOG_ERR, "Unable to get a buffer: %s", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+
+/***********************************************************************************
+ *	Move the connection along as far as it can go. With a blocking socket this
+ *	runs the whole exchange, with a non-blocking socket it returns the state we're
+ *	waiting in (CONN_RECV wants readable, CONN_SEND wants writable).
+ **********************************************************************************/
+connState_t connProcess(conn_t *conn){
+	int rc = 1;
+
+	while(rc > 0 && conn->state != CONN_DONE){
+		if(conn->state == CONN_RECV)
+			rc = connReceive(conn);
+		else
+			rc = connSend(conn);
+	}
+
+	if(rc < 0){
+		conn->failed = true;
+		conn->state = CONN_DONE;
+	}
+	return conn->state;
+}
+
+
+/***********************************************************************************
+ *	Run the whole exchange on this thread. Blocking sockets never stop part way,
+ *	a non-blocking socket (from accept4) is waited on with poll() when it isn't
+ *	ready for us. While sending we wake up now and then even if the socket
+ *	stays full, so a client that stops reading is still checked for being
+ *	too slow.
+ **********************************************************************************/
+void connRun(conn_t *conn){
+	connState_t state;
+
+	while((state = connProcess(conn)) != CONN_DONE){
+		struct pollfd pfd = {.fd = conn->socket, .events = (state == CONN_RECV) ? POLLIN : POLLOUT};
+		int timeout = (state == CONN_SEND) ? connSlowSweepMs() : -1;
+		if(poll(&pfd, 1, timeout) == -1 && errno != EINTR){
+			syslog(LOG_ERR, "poll: %s", strerror(errno));
+			conn->failed = true;
+			return;
+		}
+	}
+}
+
+
+/***********************************************************************************
+ *	Close the client connection and release everything the connection holds.
+ **********************************************************************************/
+void connClose(conn_t *conn){
+
+	if(!conn->failed){
+		//Ensure we shutdown the connection to properly before we close it (notifying the client
+		//	we're done sending data)
+		if(shutdown(conn->socket, SHUT_RDWR))
+			syslog(LOG_ERR, "shutdown: %s", strerror(errno));
+	}
+
+	//Close our handle and log that we're done with this client
+	close(conn->socket);
+	if(!conn->failed){
+		uint32_t clientIP = conn->ip;
+		LOG_FAST(LOG_INFO, "Closed connection from %u.%u.%u.%u",
+					clientIP >> 24, (clientIP >> 16) & 0xFF, (clientIP >> 8) & 0xFF, clientIP & 0xFF);
+	}
+
+	storageRelease(conn->outf);
+	storageStageDrop(&conn->stageFd, &conn->stageLen);
+	if(conn->pipeFds[0] != -1){
+		close(conn->pipeFds[0]);
+		close(conn->pipeFds[1]);
+	}
+	connReplyDone(conn);
+
+	//Our buffer goes back to the pool for the next connection
+	bufPut(conn->recvData, conn->dataSize);
+	conn->recvData = NULL;
+	bufCountRequests(conn->packets);
+	admitRelease();
+}
+
+
+/***********************************************************************************
+ *	The function called when a new client is connected (thread-per-connection)
+ **********************************************************************************/
+void *processConnection(void *arg){
+
+	//Extract the content we'll need for this connection
+	ct_t *slot = (ct_t*) arg;
+	conn_t conn;
+
+	DEBUG_PRINT("--Starting thread-per-connection\n");
+	if(!connInit(&conn, slot->socket, slot->ip, slot->mutex)){
+		connRun(&conn);
+		connClose(&conn);
+	}
+	else
+		admitShed(slot->socket);
+
+	//Let the reaper know we're done, the slot isn't ours after this
+	ct_complete(slot);
+	return NULL;
+}
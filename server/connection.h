@@ -1,10 +1,111 @@
-
-#ifndef CONNECTION_H
-#define CONNECTION_H
-
-#include <pthread.h>
-
-//External function that handles connections
-void *processConnection(void *arg);
-
-#endif //CONNECTION_H
\ No newline at end of file
+
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "storage.h"
+
+//Where a connection is in its lifetime. connProcess() moves a connection through
+//	these states, and stops early if the (non-blocking) socket isn't ready.
+typedef enum {
+	CONN_RECV,		//Receiving until we have a full '\n' terminated packet
+	CONN_SEND,		//Echoing the stored content back to the client
+	CONN_DONE		//Complete (or failed), ready to be closed
+} connState_t;
+
+//How the reply is getting to the client. We start with the cheapest and drop
+//	down a level whenever the source can't do it.
+typedef enum {
+	REPLY_NONE,			//Not replying (or not picked yet)
+	REPLY_SENDFILE,		//sendfile() straight from outf to the socket
+	REPLY_SPLICE,		//splice() through a pipe
+	REPLY_BUFFERED,		//read() into sendBuf and send()
+	REPLY_SNAPSHOT		//send() from the storage snapshot (tried first, not part of the fallbacks)
+} connReply_t;
+
+//How many '\n' positions we remember from one scan (so a chunk full of packets
+//	is only looked through once)
+#define CONN_MAX_DELIMS		32
+
+//When the client gets the content echoed back
+typedef enum {
+	CONN_ECHO_ONCE,		//After the first packet, then the connection is closed (default)
+	CONN_ECHO_EACH,		//After every packet, the connection stays open until the client closes
+	CONN_ECHO_LAST		//Once, after the last packet before the client half-closes
+} connEcho_t;
+
+/////////////////////////////////////////////////////////////
+typedef struct {
+	int socket;
+	uint32_t ip;
+	pthread_mutex_t *mutex;
+	connState_t state;
+	bool failed;
+
+	unsigned char *recvData;
+	int dataSize;
+	int dataLen;			//Bytes received, the current packet and anything after it
+	int packetLen;			//Length of the packet at the front of recvData (0 until we have one)
+	int scanPos;			//How far we've already looked for the '\n'
+	uint32_t delims[CONN_MAX_DELIMS];	//Positions of the '\n's found but not used yet
+	int delimCount;
+	int stageFd;			//Staging file holding the front of a packet too big to keep in memory (-1 if none)
+	off_t stageLen;			//Bytes of the current packet in it, they come before recvData
+	unsigned long packets;	//Packets stored on this connection
+	bool peerClosed;		//The client has half-closed, nothing more is coming
+
+	bool inFlight;			//Counted as a request in flight until the reply is done
+	bool refused;			//The reply is a refusal (BUSY or THROTTLED), nothing was stored
+	connReply_t reply;
+	char head[64];			//A command reply's header line, sent before the data
+	int headLen;
+	int headPos;
+	int pipeFds[2];			//For splice (-1 until we need one)
+	int pipeLen;			//Bytes sitting in the pipe waiting to go to the socket
+	unsigned char *sendBuf;	//Where a buffered reply is read into (from the buffer pool)
+	int sendSize;
+	storageSnap_t *snap;	//Our reference to the snapshot the reply comes from (if there is one)
+
+	int outf;
+	off_t sendOff;			//Where in outf the reply continues from (-1 means outf's own position)
+	off_t sendRemain;		//Bytes left to read back from outf (-1 means until EOF)
+	int sendLen;			//Bytes currently in sendBuf waiting to be sent
+	int sendPos;			//How many of those have been sent already
+	uint64_t behindSince;	//When (monotonic ms) the client fell behind, 0 if it's keeping up
+}conn_t;
+
+
+void connSetEchoPolicy(connEcho_t policy);
+connEcho_t connEchoPolicy(void);
+
+//A client with more than highWater bytes of reply waiting for it (ours and the
+//	socket's) for longer than graceMs is too slow and is dropped. highWater of 0
+//	turns this off. connSlowSweepMs() is how often anything waiting on a full
+//	socket should look again (-1 when off).
+void connSetSlowPolicy(size_t highWater, int graceMs);
+int connSlowSweepMs(void);
+bool connTooSlow(conn_t *conn, off_t pending);
+
+int connInit(conn_t *conn, int socket, uint32_t ip, pthread_mutex_t *mutex);
+int connOpenOutput(conn_t *conn);
+int connRunCommand(conn_t *conn);
+int connStore(conn_t *conn);
+bool connFindPacket(conn_t *conn);
+int connStage(conn_t *conn);
+int connGrow(conn_t *conn, size_t minSize);
+int connReplyBuffer(conn_t *conn);
+bool connReplySnapshot(conn_t *conn);
+void connReplyDone(conn_t *conn);
+void connNextPacket(conn_t *conn);
+int connPeerClosed(conn_t *conn);
+connState_t connProcess(conn_t *conn);
+void connRun(conn_t *conn);
+void connClose(conn_t *conn);
+
+//External function that handles connections
+void *processConnection(void *arg);
+
+#endif //CONNECTION_H
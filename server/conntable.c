@@ -0,0 +1,194 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/eventfd.h>
+#include "stats.h"
+#include "affinity.h"
+#include "conntable.h"
+
+#define CT_NONE		UINT32_MAX
+
+
+/////////////////////////////////////////////////////////////
+static ct_t *slots = NULL;
+static uint32_t slotCount = 0;
+
+//Free list head. The low 32 bits are the slot index, the high 32 bits are a tag
+//	bumped on every change so a pop can't be fooled by ABA.
+static uint64_t freeHead = CT_NONE;
+
+//Completed (but not yet joined) threads. Only the reaper ever takes from this,
+//	so a plain index is enough.
+static uint32_t doneHead = CT_NONE;
+
+static int reapFd = -1;
+static pthread_t reaper;
+static volatile bool stopping = false;
+
+static uint32_t active = 0;
+static uint32_t peak = 0;
+static unsigned long reaped = 0;
+static unsigned long full = 0;
+
+
+/////////////////////////////////////////////////////////////
+static void freePush(ct_t *slot){
+	uint64_t head = __atomic_load_n(&freeHead, __ATOMIC_ACQUIRE);
+	uint64_t newHead;
+	do{
+		slot->next = (uint32_t)head;
+		newHead = ((head >> 32) + 1) << 32 | slot->index;
+	}while(!__atomic_compare_exchange_n(&freeHead, &head, newHead, true, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+}
+
+/////////////////////////////////////////////////////////////
+static ct_t *freePop(){
+	uint64_t head = __atomic_load_n(&freeHead, __ATOMIC_ACQUIRE);
+	uint64_t newHead;
+	do{
+		if((uint32_t)head == CT_NONE)
+			return NULL;
+		uint32_t next = __atomic_load_n(&slots[(uint32_t)head].next, __ATOMIC_RELAXED);
+		newHead = ((head >> 32) + 1) << 32 | next;
+	}while(!__atomic_compare_exchange_n(&freeHead, &head, newHead, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	return &slots[(uint32_t)head];
+}
+
+
+/////////////////////////////////////////////////////////////
+ct_t *ct_alloc(){
+	ct_t *slot = freePop();
+	if(!slot){
+		__atomic_add_fetch(&full, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	uint32_t now = __atomic_add_fetch(&active, 1, __ATOMIC_RELAXED);
+	uint32_t prev = __atomic_load_n(&peak, __ATOMIC_RELAXED);
+	while(now > prev && !__atomic_compare_exchange_n(&peak, &prev, now, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return slot;
+}
+
+/////////////////////////////////////////////////////////////
+void ct_free(ct_t *slot){
+	freePush(slot);
+	__atomic_sub_fetch(&active, 1, __ATOMIC_RELEASE);
+}
+
+
+/////////////////////////////////////////////////////////////
+void ct_complete(ct_t *slot){
+	uint32_t head = __atomic_load_n(&doneHead, __ATOMIC_RELAXED);
+	do{
+		slot->next = head;
+	}while(!__atomic_compare_exchange_n(&doneHead, &head, slot->index, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	//Wake the reaper
+	eventfd_write(reapFd, 1);
+}
+
+
+/////////////////////////////////////////////////////////////
+//	Join every thread that has completed since we last looked,
+//	and put their slots back on the free list.
+static void reapCompleted(){
+	uint32_t index = __atomic_exchange_n(&doneHead, CT_NONE, __ATOMIC_ACQUIRE);
+
+	while(index != CT_NONE){
+		ct_t *slot = &slots[index];
+		index = slot->next;
+
+		DEBUG_PRINT("Joining child 0x%08x\n", (unsigned int)slot->thread);
+		pthread_join(slot->thread, NULL);
+		ct_free(slot);
+		reaped++;
+	}
+}
+
+/////////////////////////////////////////////////////////////
+static void *reaperRun(void *arg){
+	eventfd_t count;
+
+	while(1){
+		if(eventfd_read(reapFd, &count) && errno != EINTR){
+			syslog(LOG_ERR, "eventfd_read: %s", strerror(errno));
+			return NULL;
+		}
+		reapCompleted();
+
+		if(stopping && !__atomic_load_n(&active, __ATOMIC_ACQUIRE))
+			return NULL;
+	}
+}
+
+
+/////////////////////////////////////////////////////////////
+static void ct_stats(){
+	syslog(LOG_INFO, "conntable: %u/%u active, peak %u, %lu reaped, %lu refused (table full)",
+			__atomic_load_n(&active, __ATOMIC_RELAXED), slotCount,
+			__atomic_load_n(&peak, __ATOMIC_RELAXED), reaped,
+			__atomic_load_n(&full, __ATOMIC_RELAXED));
+}
+
+
+/////////////////////////////////////////////////////////////
+int ct_init(uint32_t capacity){
+	slots = calloc(capacity, sizeof(ct_t));
+	if(!slots){
+		perror("calloc");
+		return -1;
+	}
+	slotCount = capacity;
+
+	//Chain every slot onto the free list
+	for(uint32_t i = 0; i < capacity; i++){
+		slots[i].index = i;
+		slots[i].next = (i + 1 < capacity) ? i + 1 : CT_NONE;
+	}
+	freeHead = capacity ? 0 : CT_NONE;
+
+	reapFd = eventfd(0, EFD_CLOEXEC);
+	if(reapFd == -1){
+		perror("eventfd");
+		free(slots);
+		slots = NULL;
+		return -1;
+	}
+
+	//The reaper must never be the thread that takes our signals
+	sigset_t oldSet;
+	blockSignals(&oldSet);
+	int rc = pthread_create(&reaper, affinityThreadAttr(AFFINITY_ACCEPT), reaperRun, NULL);
+	pthread_sigmask(SIG_SETMASK, &oldSet, NULL);
+	if(rc){
+		errno = rc;
+		perror("pthread_create");
+		close(reapFd);
+		free(slots);
+		slots = NULL;
+		return -1;
+	}
+
+	statsRegister(ct_stats);
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////
+//	Wait for every client thread to complete and be joined
+void ct_shutdown(){
+	if(!slots)
+		return;
+
+	stopping = true;
+	eventfd_write(reapFd, 1);
+	pthread_join(reaper, NULL);
+
+	close(reapFd);
+	free(slots);
+	slots = NULL;
+}
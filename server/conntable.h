@@ -0,0 +1,36 @@
+
+#ifndef CONNTABLE_H
+#define CONNTABLE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "main.h"
+
+/////////////////////////////////////////////////////////////
+//	A slot in the connection table, one per client thread.
+//	Slots are pre-allocated and linked by index, so taking and
+//	returning one is O(1) and lock free.
+typedef struct {
+	pthread_t thread;
+	pthread_mutex_t *mutex;
+	int socket;
+	uint32_t ip;
+
+	uint32_t index;		//Our own slot number
+	uint32_t next;		//Link for the free and completed stacks
+}ct_t;
+
+
+int ct_init(uint32_t capacity);
+void ct_shutdown();
+
+ct_t *ct_alloc();
+void ct_free(ct_t *slot);
+
+//Called by a client thread as the very last thing it does. The reaper joins
+//	the thread and returns the slot to the free list.
+void ct_complete(ct_t *slot);
+
+
+#endif
@@ -0,0 +1,152 @@
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "crc32c.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#if defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#define CRC32C_POLY		0x82f63b78		//Castagnoli, reflected
+
+typedef uint32_t (*crcFn_t)(uint32_t, const void *, size_t);
+
+static crcFn_t crcFn = NULL;
+static const char *crcFnName = "table";
+static uint32_t crcTable[256];
+
+
+/***********************************************************************************
+ *	A byte at a time from a table, for CPUs without a CRC32C instruction. The
+ *	table is filled in before any version is picked.
+ **********************************************************************************/
+static uint32_t crc32cTable(uint32_t crc, const void *buf, size_t len){
+	const unsigned char *p = buf;
+
+	crc = ~crc;
+	while(len--)
+		crc = crcTable[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static void crc32cTableInit(void){
+	for(uint32_t i = 0; i < 256; i++){
+		uint32_t crc = i;
+		for(int bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+		crcTable[i] = crc;
+	}
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+/***********************************************************************************
+ *	SSE4.2's crc32 instruction, 8 bytes at a time (4 on 32 bit builds) once
+ *	we're aligned
+ **********************************************************************************/
+__attribute__((target("sse4.2")))
+static uint32_t crc32cSse42(uint32_t crc, const void *buf, size_t len){
+	const unsigned char *p = buf;
+
+	crc = ~crc;
+	while(len && ((uintptr_t)p & 7)){
+		crc = _mm_crc32_u8(crc, *p++);
+		len--;
+	}
+#if defined(__x86_64__)
+	uint64_t crc64 = crc;
+	for(; len >= 8; p += 8, len -= 8){
+		uint64_t word;
+		memcpy(&word, p, 8);
+		crc64 = _mm_crc32_u64(crc64, word);
+	}
+	crc = crc64;
+#else
+	for(; len >= 4; p += 4, len -= 4){
+		uint32_t word;
+		memcpy(&word, p, 4);
+		crc = _mm_crc32_u32(crc, word);
+	}
+#endif
+	while(len--)
+		crc = _mm_crc32_u8(crc, *p++);
+	return ~crc;
+}
+#endif
+
+
+#if defined(__aarch64__)
+/***********************************************************************************
+ *	The ARMv8 CRC32 extension's crc32c instructions, 8 bytes at a time
+ **********************************************************************************/
+__attribute__((target("+crc")))
+static uint32_t crc32cArm(uint32_t crc, const void *buf, size_t len){
+	const unsigned char *p = buf;
+
+	crc = ~crc;
+	while(len && ((uintptr_t)p & 7)){
+		crc = __crc32cb(crc, *p++);
+		len--;
+	}
+	for(; len >= 8; p += 8, len -= 8){
+		uint64_t word;
+		memcpy(&word, p, 8);
+		crc = __crc32cd(crc, word);
+	}
+	while(len--)
+		crc = __crc32cb(crc, *p++);
+	return ~crc;
+}
+#endif
+
+
+/***********************************************************************************
+ *	Pick the best version for this CPU. Every thread picks the same one, so it
+ *	doesn't matter if a few race through here at the start.
+ **********************************************************************************/
+static crcFn_t crc32cPick(void){
+	crcFn_t fn = crc32cTable;
+	const char *name = "table";
+
+	crc32cTableInit();
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse4.2")){
+		fn = crc32cSse42;
+		name = "sse4.2";
+	}
+#endif
+#if defined(__aarch64__)
+	if(getauxval(AT_HWCAP) & HWCAP_CRC32){
+		fn = crc32cArm;
+		name = "armv8 crc";
+	}
+#endif
+
+	crcFnName = name;
+	__atomic_store_n(&crcFn, fn, __ATOMIC_RELEASE);
+	return fn;
+}
+
+
+/***********************************************************************************
+ *	Checksum some bytes
+ **********************************************************************************/
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len){
+	crcFn_t fn = __atomic_load_n(&crcFn, __ATOMIC_ACQUIRE);
+	if(!fn)
+		fn = crc32cPick();
+	return fn(crc, buf, len);
+}
+
+const char *crc32cName(void){
+	if(!__atomic_load_n(&crcFn, __ATOMIC_ACQUIRE))
+		crc32cPick();
+	return crcFnName;
+}
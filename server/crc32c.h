@@ -0,0 +1,16 @@
+
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+//CRC32C (Castagnoli) of buf[0..len), carrying on from crc (0 to start), so
+//	crc32c(crc32c(0, a), b) is the checksum of a then b. Uses the CPU's CRC32C
+//	instruction if it has one (picked on the first call).
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+//Which version crc32c() is using
+const char *crc32cName(void);
+
+#endif //CRC32C_H
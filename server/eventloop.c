@@ -0,0 +1,376 @@
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <time.h>
+#include "main.h"
+#include "connection.h"
+#include "stats.h"
+#include "affinity.h"
+#include "admission.h"
+#include "logger.h"
+#include "interval.h"
+#include "eventloop.h"
+
+#define MAX_EVENTS		64
+
+//Connections owned by a loop. We keep them in a list so anything still open
+//	when we're told to exit can be closed.
+typedef struct _evConn_t {
+	conn_t conn;
+	uint32_t events;		//What we're currently registered with epoll for
+
+	struct _evConn_t *prev;
+	struct _evConn_t *next;
+}evConn_t;
+
+typedef struct {
+	int epollFd;
+	int listenSocket;
+	int stopFd;
+	int timerFd;				//The timestamp timer, only loop 0 has it (-1 otherwise)
+	pthread_mutex_t *fileMutex;
+	pthread_t thread;
+	int index;
+	evConn_t *conns;
+	uint64_t lastSweep;			//When (monotonic ms) we last looked at the connections stuck sending
+	bool *closeFlag;
+	const sigset_t *waitMask;	//Signal mask while waiting (only loop 0 takes signals)
+}evLoop_t;
+
+
+/***********************************************************************************
+ *	Drop a connection from the loop, close it and free it.
+ **********************************************************************************/
+static void loopDropConn(evLoop_t *loop, evConn_t *ec){
+	epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, ec->conn.socket, NULL);
+
+	if(ec->prev)
+		ec->prev->next = ec->next;
+	else
+		loop->conns = ec->next;
+	if(ec->next)
+		ec->next->prev = ec->prev;
+
+	connClose(&ec->conn);
+	free(ec);
+}
+
+
+/***********************************************************************************
+ *	Run the connection state machine, and re-arm epoll for whatever it's waiting on.
+ **********************************************************************************/
+static void loopServiceConn(evLoop_t *loop, evConn_t *ec){
+
+	connState_t state = connProcess(&ec->conn);
+	if(state == CONN_DONE){
+		loopDropConn(loop, ec);
+		return;
+	}
+
+	uint32_t events = (state == CONN_RECV) ? EPOLLIN : EPOLLOUT;
+	if(events == ec->events)
+		return;
+
+	struct epoll_event ev = {.events = events, .data.ptr = ec};
+	if(epoll_ctl(loop->epollFd, EPOLL_CTL_MOD, ec->conn.socket, &ev)){
+		syslog(LOG_ERR, "epoll_ctl: %s", strerror(errno));
+		ec->conn.failed = true;
+		loopDropConn(loop, ec);
+		return;
+	}
+	ec->events = events;
+}
+
+
+/***********************************************************************************
+ *	Accept every connection that is waiting on the listening socket.
+ **********************************************************************************/
+static void loopAccept(evLoop_t *loop){
+	struct sockaddr addr;
+
+	while(1){
+		socklen_t addrLen = sizeof(addr);
+		int clientSocket = accept4(loop->listenSocket, &addr, &addrLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if(clientSocket == -1){
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+
+			//EAGAIN means we've emptied the queue (or another loop got there first).
+			//	Out of descriptors, we turn the client away and try again.
+			if(errno != EAGAIN && errno != EWOULDBLOCK && admitAcceptFailed(loop->listenSocket, errno))
+				continue;
+			return;
+		}
+
+		//Save the IP address of the connecting client
+		uint32_t ip = ntohl(*(uint32_t *)&addr.sa_data[2]);
+		LOG_FAST(LOG_INFO, "Accepted connection from %u.%u.%u.%u",
+				ip >> 24, (ip >> 16) & 0xFF, (ip >> 8) & 0xFF, ip & 0xFF);
+		if(!admitConnection(clientSocket))
+			continue;
+
+		evConn_t *ec = malloc(sizeof(evConn_t));
+		if(!ec){
+			syslog(LOG_ERR, "Unable to allocate content for new client connection");
+			admitShed(clientSocket);
+			continue;
+		}
+
+		if(connInit(&ec->conn, clientSocket, ip, loop->fileMutex)){
+			free(ec);
+			admitShed(clientSocket);
+			continue;
+		}
+
+		ec->events = EPOLLIN;
+		struct epoll_event ev = {.events = EPOLLIN, .data.ptr = ec};
+		if(epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, clientSocket, &ev)){
+			syslog(LOG_ERR, "epoll_ctl: %s", strerror(errno));
+			ec->conn.failed = true;
+			connClose(&ec->conn);
+			free(ec);
+			continue;
+		}
+
+		ec->prev = NULL;
+		ec->next = loop->conns;
+		if(loop->conns)
+			loop->conns->prev = ec;
+		loop->conns = ec;
+	}
+}
+
+
+/***********************************************************************************
+ *	Give every connection waiting on a full socket another go, so one whose
+ *	client has stopped reading (and will never make the socket writable) is
+ *	still checked for being too slow.
+ **********************************************************************************/
+static void loopSweep(evLoop_t *loop, int sweepMs){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	uint64_t now = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	if(now - loop->lastSweep < (uint64_t)sweepMs)
+		return;
+	loop->lastSweep = now;
+
+	evConn_t *next;
+	for(evConn_t *ec = loop->conns; ec; ec = next){
+		next = ec->next;
+		if(ec->events == EPOLLOUT)
+			loopServiceConn(loop, ec);
+	}
+}
+
+
+/***********************************************************************************
+ *	A single event loop. Each loop has its own epoll instance, and they all share
+ *	the listening socket (EPOLLEXCLUSIVE so only one is woken per connection) or
+ *	has a SO_REUSEPORT listener of its own.
+ **********************************************************************************/
+static void *loopRun(void *arg){
+	evLoop_t *loop = arg;
+	struct epoll_event events[MAX_EVENTS];
+	int sweepMs = connSlowSweepMs();
+
+	while(1){
+		//Our signals are only unblocked inside epoll_pwait(), so one can't slip in
+		//	between checking the flag and going to sleep.
+		if(*loop->closeFlag)
+			return NULL;
+
+		int count = epoll_pwait(loop->epollFd, events, MAX_EVENTS, sweepMs, loop->waitMask);
+		if(count == -1){
+			//The main loop checks the close flag itself, so all we need to do is return
+			if(errno == EINTR)
+				return NULL;
+
+			syslog(LOG_ERR, "epoll_wait: %s", strerror(errno));
+			return NULL;
+		}
+
+		for(int i = 0; i < count; i++){
+			if(events[i].data.ptr == &loop->stopFd)
+				return NULL;
+
+			if(events[i].data.ptr == &loop->listenSocket){
+				loopAccept(loop);
+				continue;
+			}
+
+			if(events[i].data.ptr == &loop->timerFd){
+				intervalFire(loop->timerFd);
+				continue;
+			}
+
+			loopServiceConn(loop, events[i].data.ptr);
+		}
+
+		if(sweepMs > 0)
+			loopSweep(loop, sweepMs);
+	}
+}
+
+
+/***********************************************************************************
+ *	Entry point for the loops that get their own thread
+ **********************************************************************************/
+static void *loopThread(void *arg){
+	evLoop_t *loop = arg;
+	affinityApplySelf(AFFINITY_WORKER, loop->index);
+	return loopRun(loop);
+}
+
+
+/***********************************************************************************
+ *	Setup a loop's epoll instance with the listening socket, the stop event and
+ *	(for loop 0) the timestamp timer.
+ **********************************************************************************/
+static int loopInit(evLoop_t *loop, int listenSocket, bool shared, int stopFd, int timerFd, pthread_mutex_t *fileMutex, bool *closeFlag){
+
+	memset(loop, 0, sizeof(*loop));
+	loop->closeFlag = closeFlag;
+	loop->listenSocket = listenSocket;
+	loop->stopFd = stopFd;
+	loop->timerFd = timerFd;
+	loop->fileMutex = fileMutex;
+
+	loop->epollFd = epoll_create1(EPOLL_CLOEXEC);
+	if(loop->epollFd == -1){
+		syslog(LOG_ERR, "epoll_create1: %s", strerror(errno));
+		return -1;
+	}
+
+	struct epoll_event ev = {.events = EPOLLIN | (shared ? EPOLLEXCLUSIVE : 0), .data.ptr = &loop->listenSocket};
+	if(epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, listenSocket, &ev)){
+		syslog(LOG_ERR, "epoll_ctl: %s", strerror(errno));
+		close(loop->epollFd);
+		return -1;
+	}
+
+	ev = (struct epoll_event){.events = EPOLLIN, .data.ptr = &loop->stopFd};
+	if(epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, stopFd, &ev)){
+		syslog(LOG_ERR, "epoll_ctl: %s", strerror(errno));
+		close(loop->epollFd);
+		return -1;
+	}
+
+	ev = (struct epoll_event){.events = EPOLLIN, .data.ptr = &loop->timerFd};
+	if(timerFd != -1 && epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, timerFd, &ev)){
+		syslog(LOG_ERR, "epoll_ctl: %s", strerror(errno));
+		close(loop->epollFd);
+		return -1;
+	}
+	return 0;
+}
+
+
+/***********************************************************************************
+ *	Close anything a loop still owns.
+ **********************************************************************************/
+static void loopCleanup(evLoop_t *loop){
+	while(loop->conns){
+		loop->conns->conn.failed = true;
+		loopDropConn(loop, loop->conns);
+	}
+	close(loop->epollFd);
+}
+
+
+/***********************************************************************************
+ *	Run the event driven server until we're told to close
+ **********************************************************************************/
+int eventLoopRun(int *listenSockets, int listenCount, int timerFd, pthread_mutex_t *fileMutex, int loopCount, bool *closeFlag){
+
+	if(loopCount < 1)
+		loopCount = 1;
+
+	//We drain the accept queue until EAGAIN (and loops may share a socket), so
+	//	accept must never block
+	for(int i = 0; i < listenCount; i++){
+		int flags = fcntl(listenSockets[i], F_GETFL);
+		if(flags == -1 || fcntl(listenSockets[i], F_SETFL, flags | O_NONBLOCK)){
+			syslog(LOG_ERR, "fcntl: %s", strerror(errno));
+			return -1;
+		}
+	}
+
+	//Once written, this stays readable and wakes every loop so they can exit
+	int stopFd = eventfd(0, EFD_CLOEXEC);
+	if(stopFd == -1){
+		syslog(LOG_ERR, "eventfd: %s", strerror(errno));
+		return -1;
+	}
+
+	evLoop_t *loops = calloc(loopCount, sizeof(evLoop_t));
+	if(!loops){
+		syslog(LOG_ERR, "calloc: %s", strerror(errno));
+		close(stopFd);
+		return -1;
+	}
+
+	//Only the calling thread should see our signals, and only while it's waiting
+	//	in epoll_pwait() (so it's interrupted), so block them everywhere else.
+	sigset_t oldSet;
+	blockSignals(&oldSet);
+
+	int started = 0;
+	int ret = 0;
+	for(; started < loopCount; started++){
+		//Either every loop has its own SO_REUSEPORT listener, or they all share one
+		bool shared = (listenCount < loopCount);
+		int listenSocket = listenSockets[shared ? 0 : started];
+		if(loopInit(&loops[started], listenSocket, shared, stopFd, started ? -1 : timerFd, fileMutex, closeFlag)){
+			ret = -1;
+			break;
+		}
+		loops[started].index = started;
+
+		//Loop 0 runs on this thread
+		if(!started){
+			loops[0].waitMask = &oldSet;
+			continue;
+		}
+
+		int rc = pthread_create(&loops[started].thread, NULL, loopThread, &loops[started]);
+		if(rc){
+			errno = rc;
+			perror("pthread_create");
+			close(loops[started].epollFd);
+			ret = -1;
+			break;
+		}
+	}
+
+	syslog(LOG_INFO, "Running %i event loop(s)", started);
+	affinityApplySelf(AFFINITY_WORKER, 0);
+	while(!ret && !*closeFlag){
+		loopRun(&loops[0]);
+		statsPoll();
+	}
+	pthread_sigmask(SIG_SETMASK, &oldSet, NULL);
+
+	//Wake up every other loop and wait for them to exit
+	eventfd_write(stopFd, 1);
+	for(int i = 1; i < started; i++)
+		pthread_join(loops[i].thread, NULL);
+	for(int i = 0; i < started; i++)
+		loopCleanup(&loops[i]);
+
+	free(loops);
+	close(stopFd);
+	return ret;
+}
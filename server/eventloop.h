@@ -0,0 +1,14 @@
+
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+//Run the epoll based server using loopCount threads (the calling thread is one of
+//	them). listenCount is either 1 (shared by every loop) or loopCount (one each).
+//	The timestamp timer (timerFd, -1 for none) is handled by the calling thread's
+//	loop. Returns once *closeFlag is set.
+int eventLoopRun(int *listenSockets, int listenCount, int timerFd, pthread_mutex_t *fileMutex, int loopCount, bool *closeFlag);
+
+#endif //EVENTLOOP_H
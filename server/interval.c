@@ -1,131 +1,123 @@
-#include <stdio.h>
-#include <time.h>
-#include <string.h>
-#include <signal.h>
-#include <errno.h>
-#include <fcntl.h>
-#include <stdlib.h>
-#include <unistd.h>
-#include <pthread.h>
-#include <syslog.h>
-#include "main.h"
-
-//Structure used to pass data to the timer IRQ handler.
-struct timerData{
-        int eventNumber;
-		pthread_mutex_t *fileAccessMutex;
-};
-
-/**************************************************************************************/
-// Periodic timer (every 10 seconds) allowing us to add timestamps to our output file.
-//
-//	Runs from interval timer call
-void onInterval(union sigval arg){
-	
-	int rc;
-	struct timerData *td = arg.sival_ptr;
-	int outf;
-	char timeStr[128];
-	
-	//Increment the number of calls we've handled
-	td->eventNumber++;
-	DEBUG_PRINT("---Handling event %i\n", td->eventNumber);
-	
-	time_t rawTime;
-	time(&rawTime);
-	struct tm *locTime = localtime(&rawTime);	//Returns static struct, no need to free
-	size_t timeStrLen = strftime(timeStr, sizeof(timeStr), "timestamp:%Y-%m-%d %H:%M:%S\n", locTime);
-	if(!timeStrLen){
-		printf("Error generating time string\n");
-		exit(EXIT_FAILURE);
-	}
-
-	//Open the output file
-	DEBUG_PRINT("---Opening the output file\n");
-	outf = open(FILE_PATH, O_APPEND | O_RDWR | O_CREAT, 0644);
-	if(outf == -1){
-		syslog(LOG_ERR, "open %s: %s", FILE_PATH, strerror(errno));
-		goto cleanupFail;
-	}
-
-	//Obtain mutex for file writes
-	DEBUG_PRINT("---Locking the write file\n");
-	rc=pthread_mutex_lock(td->fileAccessMutex);
-	if(rc){
-		errno = rc;
-		perror("pthread_mutex_lock");
-		goto cleanupFail;
-	}
-	
-	//Write the data to the file we opened above
-	DEBUG_PRINT("---Writing timestamp to the output file %s\n", FILE_PATH);
-	ssize_t byteCount = write(outf, timeStr, timeStrLen);
-	if(byteCount != timeStrLen){
-		syslog(LOG_ERR, "write to %s failed", FILE_PATH);
-		goto cleanupFailInLock;
-	}
-	
-	DEBUG_PRINT("---Unlocking the write file\n");
-	rc=pthread_mutex_unlock(td->fileAccessMutex);
-	if(rc){
-		errno = rc;
-		perror("pthread_mutex_unlock");
-		goto cleanupFail;
-	}
-	
-	close(outf);
-	return;
-	
-//On fail inside the locked mutex area, we need to unlock that before we exit!
-cleanupFailInLock:
-	rc=pthread_mutex_unlock(td->fileAccessMutex);
-	if(rc){
-		errno = rc;
-		perror("pthread_mutex_unlock");
-	}	
-cleanupFail:
-	if(outf != -1)
-		close(outf);
-	exit(EXIT_FAILURE);
-}
-
-
-
-
-/**************************************************************************************/
-// Function to setup the interval timer that will place timestamps in the output file
-timer_t *intervalTimerStart(pthread_mutex_t *fileAccessMutex){
-	
-	//Configure the timer we'll be using to interrupt at our time slice (10ms)
-	timer_t timerId = 0;
-	//Initially start eventNumber negative so the timer has time to even out before we
-	//      actually start the scheduler period.
-	static struct timerData tData = {0};
-	tData.eventNumber = 0;
-	tData.fileAccessMutex = fileAccessMutex;
-	
-	struct sigevent sev = {0};
-	struct itimerspec ts = {.it_value.tv_sec = 0,
-							.it_value.tv_nsec = 1000000,	//1ms initially so we'll have a start of file timestamp
-							.it_interval.tv_sec = TIMESTAMP_INTERVAL_S,
-							.it_interval.tv_nsec = 0};
-
-	sev.sigev_notify = SIGEV_THREAD;
-	sev.sigev_notify_function = onInterval;
-	sev.sigev_value.sival_ptr = &tData;
-
-	//Create the timer.
-	int rc=timer_create(CLOCK_REALTIME, &sev, &timerId);
-	if(rc){
-			perror("timer_create");
-			exit(EXIT_FAILURE);
-	}
-	//Start the timer as configured. It will now call our scheduler() function every 10ms
-	rc=timer_settime(timerId, 0, &ts, NULL);
-	if(rc){
-			perror("timer_settime");
-			exit(EXIT_FAILURE);
-	}
-
-	return timerId;
-}
\ No newline at end of file
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/timerfd.h>
+#include "main.h"
+#include "stats.h"
+#include "storage.h"
+#include "interval.h"
+
+//What the timestamps look like and where they go
+static char timeFormat[128];
+static pthread_mutex_t *fileMutex;
+
+static unsigned long statWritten = 0;
+static unsigned long statMissed = 0;		//Expiries that were folded into a later timestamp
+static unsigned long statFailed = 0;
+
+
+/**************************************************************************************/
+// Log how the timestamps are going (registered with the stats dump)
+static void intervalStats(void){
+	syslog(LOG_INFO, "timestamps: %lu written, %lu expiries coalesced, %lu failed",
+			__atomic_load_n(&statWritten, __ATOMIC_RELAXED), __atomic_load_n(&statMissed, __ATOMIC_RELAXED),
+			__atomic_load_n(&statFailed, __ATOMIC_RELAXED));
+}
+
+
+/**************************************************************************************/
+// Add a timestamp to our output file.
+//
+//	The record is queued with storageAppendQueued(), so if a batch is being
+//	written it goes out with the next one, and we never wait for it (this runs
+//	on the accept or event loop). A failure is logged and we carry on, there'll
+//	be another timestamp along soon.
+static void intervalWrite(void){
+	char timeStr[256];
+
+	time_t rawTime;
+	time(&rawTime);
+	struct tm locTime;
+	localtime_r(&rawTime, &locTime);
+	size_t timeStrLen = strftime(timeStr, sizeof(timeStr) - 1, timeFormat, &locTime);
+	if(!timeStrLen){
+		syslog(LOG_ERR, "Error generating time string");
+		__atomic_add_fetch(&statFailed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	if(timeStr[timeStrLen - 1] != '\n')
+		timeStr[timeStrLen++] = '\n';
+	DEBUG_PRINT("---Writing %.*s", (int)timeStrLen, timeStr);
+
+	int outf = storageAcquire();
+	if(outf == -1 || storageAppendQueued(fileMutex, outf, timeStr, timeStrLen)){
+		syslog(LOG_ERR, "Unable to write a timestamp");
+		__atomic_add_fetch(&statFailed, 1, __ATOMIC_RELAXED);
+	}
+	else
+		__atomic_add_fetch(&statWritten, 1, __ATOMIC_RELAXED);
+	storageRelease(outf);
+}
+
+
+/**************************************************************************************/
+// The timer fd is readable, take the expiries and write one timestamp for them
+void intervalFire(int timerFd){
+	uint64_t expiries;
+	if(read(timerFd, &expiries, sizeof(expiries)) != sizeof(expiries))
+		return;		//EAGAIN, someone beat us to it (or the clock was set)
+
+	if(expiries > 1)
+		__atomic_add_fetch(&statMissed, expiries - 1, __ATOMIC_RELAXED);
+	intervalWrite();
+}
+
+
+/**************************************************************************************/
+// Function to setup the timer that will place timestamps in the output file
+int intervalStart(long seconds, const char *format, pthread_mutex_t *fileAccessMutex){
+
+	if(seconds <= 0)
+		return -1;
+	if(strlen(format) >= sizeof(timeFormat)){
+		syslog(LOG_ERR, "Timestamp format is too long");
+		return -1;
+	}
+	strcpy(timeFormat, format);
+	fileMutex = fileAccessMutex;
+
+	//Non-blocking, so a loop that's woken for it along with something else can't
+	//	get stuck if the expiry has already been taken
+	int timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(timerFd == -1){
+		syslog(LOG_ERR, "timerfd_create: %s", strerror(errno));
+		return -1;
+	}
+
+	struct itimerspec ts = {.it_value.tv_sec = 0,
+							.it_value.tv_nsec = 1000000,	//1ms initially so we'll have a start of file timestamp
+							.it_interval.tv_sec = seconds,
+							.it_interval.tv_nsec = 0};
+	if(timerfd_settime(timerFd, 0, &ts, NULL)){
+		syslog(LOG_ERR, "timerfd_settime: %s", strerror(errno));
+		close(timerFd);
+		return -1;
+	}
+
+	statsRegister(intervalStats);
+	return timerFd;
+}
+
+
+/**************************************************************************************/
+// Stop the timer
+void intervalStop(int timerFd){
+	if(timerFd != -1)
+		close(timerFd);
+}
@@ -0,0 +1,20 @@
+
+#ifndef INTERVAL_H
+#define INTERVAL_H
+
+#include <pthread.h>
+
+//Create the timestamp timer, a timerfd for the main loop (whichever mode it is)
+//	to wait on alongside its sockets. It first fires straight away, for a start
+//	of file timestamp, then every seconds. format is for strftime (a newline is
+//	added if it doesn't end in one). Returns the fd, or -1 if seconds is 0 or
+//	the timer couldn't be set up.
+int intervalStart(long seconds, const char *format, pthread_mutex_t *fileAccessMutex);
+
+//The timer fd is readable. However many expiries there have been since the
+//	last time, only one timestamp is written.
+void intervalFire(int timerFd);
+
+void intervalStop(int timerFd);
+
+#endif //INTERVAL_H
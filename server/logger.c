@@ -0,0 +1,411 @@
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include "main.h"
+#include "stats.h"
+#include "affinity.h"
+#include "logger.h"
+
+#define RING_RECORDS	1024	//Messages each thread can have waiting (a power of two)
+#define MAX_RINGS		256		//Threads that get a ring, any more log directly
+#define MAX_BATCH		1024	//Messages written out per pass
+#define FLUSH_MS		10		//How often the logger looks for messages
+
+_Static_assert(!(RING_RECORDS & (RING_RECORDS - 1)), "RING_RECORDS must be a power of two");
+
+//One message, as the producer left it. 64 bytes.
+typedef struct {
+	uint64_t time;			//Monotonic ns, so a batch from several rings goes out in order
+	const char *fmt;
+	int level;
+	int argc;
+	uint64_t args[LOG_MAX_ARGS];
+}logRecord_t;
+
+//A single producer, single consumer ring. Only the owning thread moves head,
+//	only the logger moves tail, so neither side takes a lock. When a thread
+//	exits its ring goes back on the free list (with anything still in it) for
+//	the next thread.
+typedef struct _logRing_t {
+	logRecord_t records[RING_RECORDS];
+	unsigned long head __attribute__((aligned(64)));
+	unsigned long dropped;			//Messages lost because the ring was full
+	unsigned long tail __attribute__((aligned(64)));
+	struct _logRing_t *next;		//Every ring, they're never freed
+	struct _logRing_t *nextFree;
+}logRing_t;
+
+int logLevel = LOG_INFO;
+
+static __thread logRing_t *myRing = NULL;
+static __thread bool noRing = false;		//We asked and there wasn't one
+static pthread_key_t ringKey;
+static pthread_once_t ringOnce = PTHREAD_ONCE_INIT;
+
+static pthread_mutex_t ringLock = PTHREAD_MUTEX_INITIALIZER;
+static logRing_t *rings = NULL;
+static logRing_t *freeRings = NULL;
+static int ringCount = 0;
+
+static pthread_t loggerThread;
+static logRecord_t *batch = NULL;
+static bool running = false;
+static bool stopping = false;
+static bool stopped = false;				//The last flush is done (under ringLock)
+
+static unsigned long statDirect = 0;		//Written straight to syslog (no ring, or no logger)
+static unsigned long statWritten = 0;
+static unsigned long statBatches = 0;
+static unsigned long statLargestBatch = 0;
+static unsigned long reportedDrops = 0;
+
+
+/***********************************************************************************
+ *	Log how the logger is keeping up (registered with the stats dump)
+ **********************************************************************************/
+static void logStats(void){
+	unsigned long posted = 0;
+	unsigned long dropped = 0;
+
+	pthread_mutex_lock(&ringLock);
+	int count = ringCount;
+	for(logRing_t *r = rings; r; r = r->next){
+		posted += __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+		dropped += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&ringLock);
+
+	syslog(LOG_INFO, "log: %lu queued in %i rings, %lu dropped, %lu direct, %lu written in %lu batches (largest %lu), level %i",
+			posted, count, dropped, __atomic_load_n(&statDirect, __ATOMIC_RELAXED),
+			__atomic_load_n(&statWritten, __ATOMIC_RELAXED), __atomic_load_n(&statBatches, __ATOMIC_RELAXED),
+			__atomic_load_n(&statLargestBatch, __ATOMIC_RELAXED), logLevel);
+}
+
+
+/***********************************************************************************
+ *	A thread with a ring has exited, the ring can go to the next one
+ **********************************************************************************/
+static void logRingRelease(void *arg){
+	logRing_t *r = arg;
+	pthread_mutex_lock(&ringLock);
+	r->nextFree = freeRings;
+	freeRings = r;
+	pthread_mutex_unlock(&ringLock);
+}
+
+static void logRingInit(void){
+	pthread_key_create(&ringKey, logRingRelease);
+}
+
+
+/***********************************************************************************
+ *	Get the calling thread a ring, a free one or a new one while we're under
+ *	MAX_RINGS. This is the only time a producer takes a lock.
+ **********************************************************************************/
+static logRing_t *logRingGet(void){
+	pthread_once(&ringOnce, logRingInit);
+
+	pthread_mutex_lock(&ringLock);
+	logRing_t *r = freeRings;
+	if(r)
+		freeRings = r->nextFree;
+	else if(ringCount < MAX_RINGS && (r = aligned_alloc(64, sizeof(logRing_t)))){
+		memset(r, 0, sizeof(*r));
+		r->next = rings;
+		rings = r;
+		ringCount++;
+	}
+	pthread_mutex_unlock(&ringLock);
+
+	if(!r){
+		noRing = true;
+		return NULL;
+	}
+	pthread_setspecific(ringKey, r);
+	myRing = r;
+	return r;
+}
+
+
+/***********************************************************************************
+ *	Format a message. Only integer conversions are supported (that's all a
+ *	record can carry), each argument is cast back to what its conversion
+ *	expects before it goes to snprintf.
+ **********************************************************************************/
+static void logFormat(char *out, size_t size, const char *fmt, int argc, const uint64_t *args){
+	size_t len = 0;
+	int arg = 0;
+
+	while(*fmt && len + 1 < size){
+		if(*fmt != '%'){
+			out[len++] = *fmt++;
+			continue;
+		}
+		if(fmt[1] == '%'){
+			out[len++] = '%';
+			fmt += 2;
+			continue;
+		}
+
+		//Copy the spec (flags, width, precision, length) and find the conversion
+		char spec[16];
+		size_t specLen = 0;
+		const char *p = fmt + 1;
+		while(*p && strchr("-+ #0123456789.", *p))
+			p++;
+		int longs = 0;
+		bool sizeT = false;
+		const char *lengthStart = p;
+		while(*p == 'l' || *p == 'z' || *p == 'h'){
+			longs += (*p == 'l');
+			sizeT |= (*p == 'z');
+			p++;
+		}
+		char conv = *p;
+		if(!conv)
+			break;
+
+		specLen = lengthStart - fmt;
+		if(specLen > sizeof(spec) - 4){
+			fmt = p + 1;
+			continue;
+		}
+		memcpy(spec, fmt, specLen);
+		fmt = p + 1;
+
+		uint64_t v = (arg < argc) ? args[arg++] : 0;
+		int n;
+		switch(conv){
+		case 'd':
+		case 'i':
+			memcpy(spec + specLen, "lli", 4);
+			n = snprintf(out + len, size - len, spec,
+					longs > 1 ? (long long)v : longs || sizeT ? (long long)(long)v : (long long)(int)v);
+			break;
+		case 'u':
+		case 'x':
+		case 'X':
+		case 'o':
+			memcpy(spec + specLen, "ll", 2);
+			spec[specLen + 2] = conv;
+			spec[specLen + 3] = '\0';
+			n = snprintf(out + len, size - len, spec,
+					longs > 1 ? (unsigned long long)v : longs || sizeT ? (unsigned long long)(unsigned long)v :
+					(unsigned long long)(unsigned int)v);
+			break;
+		case 'c':
+			n = snprintf(out + len, size - len, "%c", (int)v);
+			break;
+		default:
+			n = snprintf(out + len, size - len, "?");
+			break;
+		}
+		if(n > 0)
+			len += n;
+	}
+	if(len >= size)
+		len = size - 1;
+	out[len] = '\0';
+}
+
+
+/***********************************************************************************
+ *	Write out what's waiting on one ring, once the logger thread is gone (so
+ *	the caller holds ringLock instead)
+ **********************************************************************************/
+static void logRingWrite(logRing_t *r){
+	unsigned long head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	for(; r->tail != head; r->tail++){
+		logRecord_t *rec = &r->records[r->tail & (RING_RECORDS - 1)];
+		char line[256];
+		logFormat(line, sizeof(line), rec->fmt, rec->argc, rec->args);
+		syslog(rec->level, "%s", line);
+		__atomic_add_fetch(&statDirect, 1, __ATOMIC_RELAXED);
+	}
+}
+
+
+/***********************************************************************************
+ *	Queue a message on our ring (or write it now, if there's no logger)
+ **********************************************************************************/
+void logPost(int level, const char *fmt, int argc, const uint64_t *args){
+	logRing_t *r = myRing;
+	if(!r && !noRing && __atomic_load_n(&running, __ATOMIC_ACQUIRE))
+		r = logRingGet();
+
+	if(!r || !__atomic_load_n(&running, __ATOMIC_ACQUIRE)){
+		char line[256];
+		logFormat(line, sizeof(line), fmt, argc, args);
+		syslog(level, "%s", line);
+		__atomic_add_fetch(&statDirect, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	//Full, the logger hasn't caught up. We never wait for it.
+	unsigned long head = r->head;
+	if(head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == RING_RECORDS){
+		__atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	logRecord_t *rec = &r->records[head & (RING_RECORDS - 1)];
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	rec->time = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	rec->fmt = fmt;
+	rec->level = level;
+	rec->argc = argc;
+	memcpy(rec->args, args, argc * sizeof(args[0]));
+
+	//The release store makes the record visible before the head that covers it
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+
+	//The logger was stopped while we were at it. If its last flush has been
+	//	and gone we write out our own ring, if not it'll find our record there.
+	if(!__atomic_load_n(&running, __ATOMIC_ACQUIRE)){
+		pthread_mutex_lock(&ringLock);
+		if(stopped)
+			logRingWrite(r);
+		pthread_mutex_unlock(&ringLock);
+	}
+}
+
+
+static int logCompare(const void *a, const void *b){
+	const logRecord_t *ra = a;
+	const logRecord_t *rb = b;
+	return (ra->time > rb->time) - (ra->time < rb->time);
+}
+
+
+/***********************************************************************************
+ *	Take what's waiting on every ring in all, and write it out in the order it
+ *	was logged. Returns how many messages there were.
+ **********************************************************************************/
+static int logFlush(logRing_t *all){
+	int count = 0;
+	unsigned long dropped = 0;
+
+	//Rings are only ever added at the front, so the list from here on is stable
+	for(logRing_t *r = all; r; r = r->next){
+		unsigned long tail = r->tail;
+		unsigned long head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		while(tail != head && count < MAX_BATCH)
+			batch[count++] = r->records[tail++ & (RING_RECORDS - 1)];
+		__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+		dropped += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+	}
+
+	qsort(batch, count, sizeof(batch[0]), logCompare);
+	for(int i = 0; i < count; i++){
+		char line[256];
+		logFormat(line, sizeof(line), batch[i].fmt, batch[i].argc, batch[i].args);
+		syslog(batch[i].level, "%s", line);
+	}
+
+	if(dropped != reportedDrops){
+		syslog(LOG_WARNING, "log: %lu messages dropped (rings full)", dropped - reportedDrops);
+		reportedDrops = dropped;
+	}
+
+	if(count){
+		__atomic_add_fetch(&statWritten, count, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&statBatches, 1, __ATOMIC_RELAXED);
+		if((unsigned long)count > statLargestBatch)
+			__atomic_store_n(&statLargestBatch, count, __ATOMIC_RELAXED);
+	}
+	return count;
+}
+
+
+/***********************************************************************************
+ *	The logger thread. A full batch means there's likely more, so we go
+ *	straight round again, otherwise we sleep until the next flush.
+ **********************************************************************************/
+static void *logRun(void *arg){
+	(void)arg;
+	affinityApplySelf(AFFINITY_ACCEPT, -1);
+
+	while(!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)){
+		pthread_mutex_lock(&ringLock);
+		logRing_t *all = rings;
+		pthread_mutex_unlock(&ringLock);
+
+		if(logFlush(all) < MAX_BATCH)
+			nanosleep(&(struct timespec){.tv_nsec = FLUSH_MS * 1000000}, NULL);
+	}
+	return NULL;
+}
+
+
+/***********************************************************************************
+ *	Start the logger thread
+ **********************************************************************************/
+int logStart(void){
+	batch = malloc(MAX_BATCH * sizeof(logRecord_t));
+	if(!batch){
+		syslog(LOG_ERR, "Unable to start the logger: %s", strerror(errno));
+		return -1;
+	}
+
+	//Never the thread that takes our signals
+	sigset_t oldSet;
+	blockSignals(&oldSet);
+	int rc = pthread_create(&loggerThread, NULL, logRun, NULL);
+	pthread_sigmask(SIG_SETMASK, &oldSet, NULL);
+	if(rc){
+		syslog(LOG_ERR, "Unable to start the logger: %s", strerror(rc));
+		free(batch);
+		batch = NULL;
+		return -1;
+	}
+
+	__atomic_store_n(&running, true, __ATOMIC_RELEASE);
+	statsRegister(logStats);
+	return 0;
+}
+
+
+/***********************************************************************************
+ *	Stop the logger once it's written everything out. Anything logged after
+ *	this goes straight to syslog.
+ *
+ *	A thread can be part way through logPost() when running goes false, so the
+ *	last flush happens here, under ringLock, once the logger thread is gone.
+ *	A record published before that is written by the flush, one published
+ *	after is written by its own thread (logPost() checks running again).
+ **********************************************************************************/
+void logStop(void){
+	if(!__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+		return;
+
+	__atomic_store_n(&running, false, __ATOMIC_RELEASE);
+	__atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+	pthread_join(loggerThread, NULL);
+
+	pthread_mutex_lock(&ringLock);
+	while(logFlush(rings) == MAX_BATCH);
+	stopped = true;
+	pthread_mutex_unlock(&ringLock);
+
+	free(batch);
+	batch = NULL;
+}
+
+
+/***********************************************************************************
+ *	Level names, as for -v
+ **********************************************************************************/
+int logParseLevel(const char *name){
+	static const char *names[] = {"emerg", "alert", "crit", "err", "warning", "notice", "info", "debug"};
+	for(int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++)
+		if(!strcmp(name, names[i]))
+			return i;
+	return -1;
+}
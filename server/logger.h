@@ -0,0 +1,44 @@
+
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdint.h>
+#include <syslog.h>
+
+//Messages above this level are compiled out altogether
+#ifndef LOG_COMPILED_LEVEL
+#define LOG_COMPILED_LEVEL	LOG_DEBUG
+#endif
+
+//Messages above this level are skipped (set from -v), read without a lock
+extern int logLevel;
+
+//Log a message off the hot path. The calling thread only copies the format
+//	pointer and the arguments into its own ring, the logger thread formats them
+//	and hands them to syslog in batches. fmt must be a string literal (only
+//	the pointer is kept), and the arguments integers (%i %u %x with l, ll or z,
+//	at most LOG_MAX_ARGS of them). A message at a level that's filtered out
+//	doesn't even evaluate its arguments.
+#define LOG_MAX_ARGS		5
+#define LOG_ENABLED(level)	((level) <= LOG_COMPILED_LEVEL && (level) <= logLevel)
+#define LOG_FAST(level, fmt, ...) do{ \
+		if(LOG_ENABLED(level)){ \
+			const uint64_t logArgs_[] = {0, ##__VA_ARGS__}; \
+			_Static_assert(sizeof(logArgs_) / sizeof(logArgs_[0]) - 1 <= LOG_MAX_ARGS, "too many log arguments"); \
+			logPost(level, fmt, sizeof(logArgs_) / sizeof(logArgs_[0]) - 1, logArgs_ + 1); \
+		} \
+	}while(0)
+
+void logPost(int level, const char *fmt, int argc, const uint64_t *args);
+
+//Start the logger thread (after any fork). Until it's running, and once it's
+//	stopped, messages go straight to syslog.
+int logStart(void);
+
+//Write out everything still queued and stop the logger thread
+void logStop(void);
+
+//The syslog level for a name like "info" or "debug", -1 if it isn't one
+int logParseLevel(const char *name);
+
+#endif //LOGGER_H
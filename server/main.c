@@ -1,274 +1,598 @@
-
-#define _GNU_SOURCE
-#include <stdbool.h>
-#include <stdio.h>
-#include <unistd.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <signal.h>
-#include <syslog.h>
-#include <stdlib.h>
-#include <errno.h>
-#include <string.h>
-#include <sys/types.h>
-#include <sys/wait.h>
-#include <fcntl.h>
-#include <time.h>
-#include "main.h"
-#include "linklist.h"
-
-#include "connection.h"
-static bool closeApplication = false;
-static pthread_mutex_t fileAccessMutex;
-
-/***********************************************************************************
- *	The signal callback handler. 
- * 
- * 	Since we're ONLY writing, and the main code ONLY reads, we don't have to worry
- *	about data race conditions (so no critical section)
- **********************************************************************************/
-static void onSignal(int signum){
-	closeApplication = true;
-}
-
-
-/***********************************************************************************
- *	Wait for all the child processes to complete and exit
- **********************************************************************************/
-static void waitForChildren(){
-	//Wait for any child processes that are still processing	
-	ll_t *li = ll_getFirst();
-	while(li){
-		pthread_join(li->thread, NULL);
-		ll_dropItem(li);
-		li = ll_getFirst();
-	}
-}
-
-/***********************************************************************************
- *	Configure the code in preperation for switching to daemon mode.
- **********************************************************************************/
-static int makeDaemon(){
-	
-	if(chdir("/")){
-		syslog(LOG_ERR, "chdir: %s", strerror(errno));
-		exit(EXIT_FAILURE);
-	}
-	
-	int devNull = open("/dev/null", O_WRONLY);
-	dup2(devNull, STDOUT_FILENO);
-	dup2(devNull, STDERR_FILENO);
-	
-	return fork();
-}
-
-
-/***********************************************************************************
- *	Main server application code
- **********************************************************************************/
-int main(int argc, char* argv[]){
-	
-	
-	//Check arguments to see if we're supposed to run in daemon mode.
-	bool runDaemon = false;
-	if(argc == 2 && !strcmp("-d" , argv[1]))
-		runDaemon = true;
-	else if(argc != 1){
-		printf("Usage: %s [-d]\nAdding -d will run the app as a daemon\n", argv[0]);
-		exit(EXIT_FAILURE);
-	}
-	
-	//Setup the syslog system so we can write to the syslog
-	setlogmask (LOG_UPTO (LOG_INFO));
-	openlog(argv[0], LOG_CONS | LOG_PID | LOG_NDELAY | LOG_PERROR ,LOG_USER);
-	syslog(LOG_INFO, "Starting aesdsocket server");
-	
-	//Register the two signal handlers we need to listen for
-	DEBUG_PRINT("Registering signal handlers\n");
-	struct sigaction act = {.sa_handler = onSignal};
-	if(sigaction(SIGINT, &act, NULL)){
-		syslog(LOG_ERR, "sigaction: %s", strerror(errno));
-		exit(EXIT_FAILURE);
-	}
-	if(sigaction(SIGTERM, &act, NULL)){
-		syslog(LOG_ERR, "sigaction: %s", strerror(errno));
-		exit(EXIT_FAILURE);
-	}
-
-	//Create the socket we'll be using to receive client connections
-	DEBUG_PRINT("Creating socket\n");
-	int socketHandle;
-	socketHandle = socket(PF_INET, SOCK_STREAM, 0);
-	if(socketHandle == -1){
-		syslog(LOG_ERR, "socket: %s", strerror(errno));
-		exit(EXIT_FAILURE);
-	}
-	
-	//Ensure we can immediatly reuse the port as soon as we exit (for future program invocations)
-	//	I was running into issues with the socket-test.sh since it invokes it multiple times. 
-	int ret = setsockopt(socketHandle, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int));
-	if(ret < 0){
-		syslog(LOG_ERR, "setsockopt: %s", strerror(errno));
-		exit(EXIT_FAILURE);
-	}
-	
-	//Bind our socket to the desired LISTEN_PORT
-	struct sockaddr_in addr_in = {
-						.sin_family = AF_INET, 
-						.sin_addr = {.s_addr = INADDR_ANY}, 
-						.sin_port = htons(LISTEN_PORT)
-						};
-	
-	DEBUG_PRINT("Binding socket\n");
-	ret = bind(socketHandle, (struct sockaddr*)&addr_in, sizeof(addr_in));
-	if(ret < 0){
-		syslog(LOG_ERR, "bind: %s", strerror(errno));
-		close(socketHandle);
-		exit(EXIT_FAILURE);
-	}
-	
-	//Inialize the mutex we'll be using for file access cohesion
-	ret = pthread_mutex_init(&fileAccessMutex, NULL);
-	if(ret){
-		perror("pthread_mutex_init");
-		close(socketHandle);
-		exit(EXIT_FAILURE);
-	}
-	
-	//We have bound to the requested port, we can fork at this point if we're running as a daemon
-	if(runDaemon){
-		DEBUG_PRINT("Shifting to daemon\n");
-		//setup and fork. If a pid is returned (!= 0), we're the parent, and need to return.
-		if(makeDaemon())
-			return EXIT_SUCCESS;
-	}
-	
-#if !USE_AESD_CHAR_DEVICE
-	//Start the periodic timer to handle the 10second timestamp writes
-	timer_t *timerId = intervalTimerStart(&fileAccessMutex);
-#endif
-
-	//Begin listening for client connections
-	DEBUG_PRINT("Listening\n");
-	ret = listen(socketHandle, MAX_BACKLOG);
-	if(ret){
-		syslog(LOG_ERR, "listen: %s", strerror(errno));
-		close(socketHandle);
-		exit(EXIT_FAILURE);
-	}
-
-	//Loop until we've been told to exit (by a signal)
-	struct sockaddr addr;
-	while(!closeApplication){
-		
-		//Potential "livelock" situation between the !closeApplication check and
-		//	the accept() call below. If we receive a SIGINT/SIGTERM between these two
-		//	lines, we'll be stuck in accept until a client connects to us...
-		//	but i'm not sure how to fix that....
-	
-		//We can now block until an incomming connection is received. 
-		DEBUG_PRINT("Waiting for new connection...\n");
-		socklen_t addrLen = sizeof(addr);
-		int clientSocket = accept(socketHandle, &addr, &addrLen);
-		if(clientSocket == -1){
-
-			//Recoverable error or signal request to close
-			if(errno == EAGAIN || errno == ECONNABORTED || errno == EINTR)
-				continue;
-			
-			//We'll get here if any unrecoverable error occurs
-			syslog(LOG_ERR, "accept: %s", strerror(errno));
-			
-			close(socketHandle);
-			
-#if !USE_AESD_CHAR_DEVICE	
-			//Delete the data file
-			unlink(FILE_PATH);
-#endif
-
-			
-			waitForChildren();
-			exit(EXIT_FAILURE);
-		}
-		
-		//Save the IP address of the connecting client
-		uint32_t ip = ntohl(*(uint32_t *)&addr.sa_data[2]);
-		
-		DEBUG_PRINT("Connection accepted\n");
-		//We have a connection, Log who we are connected to
-		syslog(LOG_INFO, "Accepted connection from %u.%u.%u.%u", 
-				ip >> 24, (ip >> 16) & 0xFF, (ip >> 8) & 0xFF, ip & 0xFF);
-				
-				
-		
-				
-		//We will now create a child process to handle the connection we just made.
-		//	This allows us to wait for more connections while we're still processing
-		//	a previous one. 
-		DEBUG_PRINT("Spawning child to handle request\n");
-		ll_t *li = ll_addItem();
-		if(!li){
-			syslog(LOG_ERR, "Unable to allocate arg content for new client thread");
-			close(clientSocket);
-		}
-		else{
-			li->ip = ip;
-			li->socket = clientSocket;
-			li->mutex = &fileAccessMutex;
-			
-			ret = pthread_create(&li->thread, NULL, processConnection, li);
-			if(ret){
-				perror("pthread_create");
-				ll_dropItem(li);
-				close(clientSocket);
-				syslog(LOG_ERR, "Unable to create child thread for client connection");
-			}
-		}
-
-		
-		
-		//Wait on any child threads that are complete. We don't actually wait, we
-		//	just collect any that are complete already (to de-zombie them). In other
-		//	words we'll be ignoring the return values.
-		//
-		//	By checking for complete children after every new child, we ensure we don't 
-		//	hold as large of list of threads that need joined, and frees their resources
-		//	sooner. 
-		//
-		li = ll_getFirst();
-		while(li){
-			DEBUG_PRINT("Waiting for child 0x%08x\n", (unsigned int)li->thread);
-			if(!pthread_tryjoin_np(li->thread, NULL)){
-				DEBUG_PRINT("Child 0x%08x has completed\n", (unsigned int)li->thread);
-				
-				//The thread has exited, so we'll drop (free) the link list item
-				ll_dropItem(li);
-			}
-
-			li = ll_getNext();
-		}
-		
-		
-		//As the parent we continue processing more connections
-	}
-	
-	//We must have received a signal (where we set the closeApplication), so we're ready to exit.
-	syslog(LOG_INFO, "Caught signal, exiting");
-	printf("\nWaiting for connections to complete, and exiting...\n");
-	
-#if !USE_AESD_CHAR_DEVICE
-	//Cancel the timer
-	timer_delete(timerId);
-#endif
-	
-	waitForChildren();
-	close(socketHandle);
-	
-#if !USE_AESD_CHAR_DEVICE	
-	//Delete the data file
-	unlink(FILE_PATH);
-#endif 
-	
-	closelog();
-	exit(EXIT_SUCCESS);
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <syslog.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
+#include <poll.h>
+#include "main.h"
+#include "conntable.h"
+
+#include "connection.h"
+#include "eventloop.h"
+#include "threadpool.h"
+#include "uring.h"
+#include "stats.h"
+#include "acceptor.h"
+#include "affinity.h"
+#include "admission.h"
+#include "ratelimit.h"
+#include "logger.h"
+#include "interval.h"
+#include "storage.h"
+
+static bool closeApplication = false;
+static pthread_mutex_t fileAccessMutex;
+static serverMode_t mode = MODE_THREAD;
+
+/***********************************************************************************
+ *	The signal callback handler. 
+ * 
+ * 	Since we're ONLY writing, and the main code ONLY reads, we don't have to worry
+ *	about data race conditions (so no critical section)
+ **********************************************************************************/
+static void onSignal(int signum){
+	closeApplication = true;
+}
+
+
+/***********************************************************************************
+ *	SIGUSR1 handler, asks for the stats to be logged (from the main loop)
+ **********************************************************************************/
+static void onStatsSignal(int signum){
+	statsRequest();
+}
+
+
+/***********************************************************************************
+ *	Block the signals we handle, so they are always delivered to the main thread.
+ *	Used before creating any long lived threads, the old mask is returned in
+ *	oldSet so the caller can restore it.
+ **********************************************************************************/
+void blockSignals(sigset_t *oldSet){
+	sigset_t blockSet;
+	sigemptyset(&blockSet);
+	sigaddset(&blockSet, SIGINT);
+	sigaddset(&blockSet, SIGTERM);
+	sigaddset(&blockSet, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &blockSet, oldSet);
+}
+
+
+/***********************************************************************************
+ *	Hand a newly accepted client connection off to whatever will process it.
+ **********************************************************************************/
+static void dispatchConnection(int clientSocket, uint32_t ip){
+	
+	DEBUG_PRINT("Connection accepted\n");
+	//We have a connection, Log who we are connected to
+	LOG_FAST(LOG_INFO, "Accepted connection from %u.%u.%u.%u",
+			ip >> 24, (ip >> 16) & 0xFF, (ip >> 8) & 0xFF, ip & 0xFF);
+
+	//Over a limit, the client has already been told we're busy
+	if(!admitConnection(clientSocket))
+		return;
+			
+	//The pool never blocks us, if every worker queue is full we turn the client away
+	if(mode == MODE_POOL){
+		if(poolSubmit(clientSocket, ip)){
+			syslog(LOG_ERR, "All worker queues are full, dropping connection");
+			admitShed(clientSocket);
+		}
+		return;
+	}
+			
+	//We will now create a child process to handle the connection we just made.
+	//	This allows us to wait for more connections while we're still processing
+	//	a previous one. 
+	//	The thread is joined by the connection table's reaper once it completes.
+	DEBUG_PRINT("Spawning child to handle request\n");
+	ct_t *slot = ct_alloc();
+	if(!slot){
+		syslog(LOG_ERR, "Connection table is full, dropping connection");
+		admitShed(clientSocket);
+		return;
+	}
+	
+	slot->ip = ip;
+	slot->socket = clientSocket;
+	slot->mutex = &fileAccessMutex;
+	
+	//Client threads can run on any of the worker CPUs
+	int ret = pthread_create(&slot->thread, affinityThreadAttr(AFFINITY_WORKER), processConnection, slot);
+	if(ret){
+		perror("pthread_create");
+		ct_free(slot);
+		admitShed(clientSocket);
+		syslog(LOG_ERR, "Unable to create child thread for client connection");
+	}
+}
+
+
+/***********************************************************************************
+ *	Create a socket bound to LISTEN_PORT. With reusePort set, several of these
+ *	can be bound at once and the kernel spreads new connections across them.
+ **********************************************************************************/
+static int createListener(bool reusePort){
+
+	//Create the socket we'll be using to receive client connections
+	DEBUG_PRINT("Creating socket\n");
+	int socketHandle;
+	socketHandle = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(socketHandle == -1){
+		syslog(LOG_ERR, "socket: %s", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	
+	//Ensure we can immediatly reuse the port as soon as we exit (for future program invocations)
+	//	I was running into issues with the socket-test.sh since it invokes it multiple times. 
+	int ret = setsockopt(socketHandle, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int));
+	if(ret < 0){
+		syslog(LOG_ERR, "setsockopt: %s", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	
+	if(reusePort){
+		ret = setsockopt(socketHandle, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int));
+		if(ret < 0){
+			syslog(LOG_ERR, "setsockopt: %s", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+	
+	//Bind our socket to the desired LISTEN_PORT
+	struct sockaddr_in addr_in = {
+						.sin_family = AF_INET, 
+						.sin_addr = {.s_addr = INADDR_ANY}, 
+						.sin_port = htons(LISTEN_PORT)
+						};
+	
+	DEBUG_PRINT("Binding socket\n");
+	ret = bind(socketHandle, (struct sockaddr*)&addr_in, sizeof(addr_in));
+	if(ret < 0){
+		syslog(LOG_ERR, "bind: %s", strerror(errno));
+		close(socketHandle);
+		exit(EXIT_FAILURE);
+	}
+	return socketHandle;
+}
+
+/***********************************************************************************
+ *	Configure the code in preperation for switching to daemon mode.
+ **********************************************************************************/
+static int makeDaemon(){
+	
+	if(chdir("/")){
+		syslog(LOG_ERR, "chdir: %s", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	
+	int devNull = open("/dev/null", O_WRONLY);
+	dup2(devNull, STDOUT_FILENO);
+	dup2(devNull, STDERR_FILENO);
+	
+	return fork();
+}
+
+
+/***********************************************************************************
+ *	Print how the app is meant to be called, and exit
+ **********************************************************************************/
+static void usage(const char *name){
+	printf("Usage: %s [-d] [-m thread|pool|epoll|uring] [-t threads] [-q depth] [-r] [-A cpus] [-W cpus] [-k each|last]\n"
+			"          [-o bytes] [-s seconds] [-c connections] [-b bytes] [-i requests] [-l backlog]\n"
+			"          [-R subnet=requests,bytes]... [-v level] [-T seconds] [-F format]\n"
+			"          [-S file|mmap|aesdchar|ring] [-P]\n"
+			"Adding -d will run the app as a daemon\n"
+			"-m selects thread-per-connection (default), a worker pool, the epoll event loop\n"
+			"   or io_uring (falls back to thread-per-connection if the kernel can't support it)\n"
+			"-t sets the number of pool workers or event loop threads (default: one per core)\n"
+			"-q sets how many connections each pool worker can have queued (default: %i)\n"
+			"-r binds one SO_REUSEPORT listener per thread, each with its own acceptor\n"
+			"-A pins the accept side (accept loop, acceptors) to a CPU list like 0-1,4\n"
+			"-W pins the workers to a CPU list, pool workers and event loops get one CPU each\n"
+			"-k keeps connections open for more packets, echoing after each one or only\n"
+			"   after the last one before the client half-closes (default: one packet)\n"
+			"-o sets the high-water mark for reply bytes waiting on a client, 0 for no limit\n"
+			"   (default: %i)\n"
+			"-s drops clients that stay over the high-water mark this long (default: %i)\n"
+			"-c, -b and -i limit the open connections, bytes of connection buffers and\n"
+			"   requests in flight (defaults: %i, %i, %i), 0 for no limit. Anything over\n"
+			"   a limit is answered BUSY and closed\n"
+			"-l sets the listen backlog, where clients wait to be accepted (default: %i)\n"
+			"-R limits each client in a subnet (like 10.0.0.0/8=50,1048576) to requests and\n"
+			"   bytes per second, 0 for no limit. Can be given more than once, the most\n"
+			"   specific subnet applies. Requests over the limit are answered THROTTLED\n"
+			"-v sets the most verbose level logged: err, warning, notice, info or debug\n"
+			"   (default: info)\n"
+			"-T sets how often a timestamp is added to the data file, 0 for never (default: %i)\n"
+			"-F sets the timestamp's strftime format (default: %s)\n"
+			"-S stores to %s (written, or memory mapped with mmap), %s or an in-process\n"
+			"   ring like the driver's (default: %s)\n"
+			"-P keeps the data file (file and mmap) across restarts, checksummed so a torn\n"
+			"   end is cut off at startup\n"
+			"Send SIGUSR1 to log the server stats\n", name, POOL_QUEUE_DEPTH, SLOW_HIGH_WATER, SLOW_GRACE_S,
+			ADMIT_CONNECTIONS, ADMIT_BUFFERED, ADMIT_REQUESTS, MAX_BACKLOG, TIMESTAMP_INTERVAL_S, TIMESTAMP_FORMAT,
+			FILE_PATH, CHAR_DEVICE_PATH, STORAGE_DEFAULT);
+	exit(EXIT_FAILURE);
+}
+
+
+/***********************************************************************************
+ *	Main server application code
+ **********************************************************************************/
+int main(int argc, char* argv[]){
+	
+	
+	//Check arguments to see if we're supposed to run in daemon mode, and which
+	//	server mode we'll be using to handle connections.
+	bool runDaemon = false;
+	bool reusePort = false;
+	long loopCount = sysconf(_SC_NPROCESSORS_ONLN);
+	long queueDepth = POOL_QUEUE_DEPTH;
+	long highWater = SLOW_HIGH_WATER;
+	long graceSeconds = SLOW_GRACE_S;
+	long backlog = MAX_BACKLOG;
+	long timestampSeconds = TIMESTAMP_INTERVAL_S;
+	const char *timestampFormat = TIMESTAMP_FORMAT;
+	admitLimits_t limits = {.connections = ADMIT_CONNECTIONS, .buffered = ADMIT_BUFFERED, .requests = ADMIT_REQUESTS};
+	long value;
+	int opt;
+	while((opt = getopt(argc, argv, "dm:t:q:rA:W:k:o:s:c:b:i:l:R:v:T:F:S:P")) != -1){
+		switch(opt){
+		case 'd':
+			runDaemon = true;
+			break;
+		case 'm':
+			if(!strcmp("thread", optarg))
+				mode = MODE_THREAD;
+			else if(!strcmp("pool", optarg))
+				mode = MODE_POOL;
+			else if(!strcmp("epoll", optarg))
+				mode = MODE_EPOLL;
+			else if(!strcmp("uring", optarg))
+				mode = MODE_URING;
+			else
+				usage(argv[0]);
+			break;
+		case 't':
+			loopCount = strtol(optarg, NULL, 0);
+			if(loopCount < 1)
+				usage(argv[0]);
+			break;
+		case 'r':
+			reusePort = true;
+			break;
+		case 'A':
+			if(affinityConfigure(AFFINITY_ACCEPT, optarg))
+				usage(argv[0]);
+			break;
+		case 'W':
+			if(affinityConfigure(AFFINITY_WORKER, optarg))
+				usage(argv[0]);
+			break;
+		case 'k':
+			if(!strcmp("each", optarg))
+				connSetEchoPolicy(CONN_ECHO_EACH);
+			else if(!strcmp("last", optarg))
+				connSetEchoPolicy(CONN_ECHO_LAST);
+			else
+				usage(argv[0]);
+			break;
+		case 'q':
+			queueDepth = strtol(optarg, NULL, 0);
+			if(queueDepth < 1)
+				usage(argv[0]);
+			break;
+		case 'o':
+			highWater = strtol(optarg, NULL, 0);
+			if(highWater < 0)
+				usage(argv[0]);
+			break;
+		case 's':
+			graceSeconds = strtol(optarg, NULL, 0);
+			if(graceSeconds < 0 || graceSeconds > INT_MAX / 1000)
+				usage(argv[0]);
+			break;
+		case 'c':
+			value = strtol(optarg, NULL, 0);
+			if(value < 0 || value > INT_MAX)
+				usage(argv[0]);
+			limits.connections = value;
+			break;
+		case 'b':
+			value = strtol(optarg, NULL, 0);
+			if(value < 0)
+				usage(argv[0]);
+			limits.buffered = value;
+			break;
+		case 'i':
+			value = strtol(optarg, NULL, 0);
+			if(value < 0 || value > INT_MAX)
+				usage(argv[0]);
+			limits.requests = value;
+			break;
+		case 'l':
+			backlog = strtol(optarg, NULL, 0);
+			if(backlog < 1 || backlog > INT_MAX)
+				usage(argv[0]);
+			break;
+		case 'R':
+			if(rateAddRule(optarg))
+				usage(argv[0]);
+			break;
+		case 'v':
+			logLevel = logParseLevel(optarg);
+			if(logLevel < LOG_ERR)
+				usage(argv[0]);
+			break;
+		case 'T':
+			timestampSeconds = strtol(optarg, NULL, 0);
+			if(timestampSeconds < 0 || timestampSeconds > INT_MAX)
+				usage(argv[0]);
+			break;
+		case 'F':
+			timestampFormat = optarg;
+			if(!*timestampFormat)
+				usage(argv[0]);
+			break;
+		case 'S':
+			if(storageSelect(optarg))
+				usage(argv[0]);
+			break;
+		case 'P':
+			storageSetPersistent(true);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if(optind != argc)
+		usage(argv[0]);
+	if(loopCount < 1)
+		loopCount = 1;
+	connSetSlowPolicy(highWater, graceSeconds * 1000);
+	
+	//Setup the syslog system so we can write to the syslog
+	setlogmask (LOG_UPTO (logLevel));
+	openlog(argv[0], LOG_CONS | LOG_PID | LOG_NDELAY | LOG_PERROR ,LOG_USER);
+	syslog(LOG_INFO, "Starting aesdsocket server");
+	
+	//Register the two signal handlers we need to listen for
+	DEBUG_PRINT("Registering signal handlers\n");
+	struct sigaction act = {.sa_handler = onSignal};
+	if(sigaction(SIGINT, &act, NULL)){
+		syslog(LOG_ERR, "sigaction: %s", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if(sigaction(SIGTERM, &act, NULL)){
+		syslog(LOG_ERR, "sigaction: %s", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	act.sa_handler = onStatsSignal;
+	if(sigaction(SIGUSR1, &act, NULL)){
+		syslog(LOG_ERR, "sigaction: %s", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	//Create the socket(s) we'll be using to receive client connections. The io_uring 
+	//	engine is a single thread, so it only ever gets one.
+	if(mode == MODE_URING)
+		reusePort = false;
+	int listenCount = reusePort ? loopCount : 1;
+	int listenSockets[listenCount];
+	for(int i = 0; i < listenCount; i++)
+		listenSockets[i] = createListener(reusePort);
+	int socketHandle = listenSockets[0];
+	int ret;
+	
+	//Inialize the mutex we'll be using for file access cohesion. Only writers take
+	//	it, readers go by the committed length storage publishes.
+	ret = pthread_mutex_init(&fileAccessMutex, NULL);
+	if(ret){
+		perror("pthread_mutex_init");
+		close(socketHandle);
+		exit(EXIT_FAILURE);
+	}
+	
+	//We have bound to the requested port, we can fork at this point if we're running as a daemon
+	if(runDaemon){
+		DEBUG_PRINT("Shifting to daemon\n");
+		//setup and fork. If a pid is returned (!= 0), we're the parent, and need to return.
+		if(makeDaemon())
+			return EXIT_SUCCESS;
+	}
+
+	//Connection messages are queued for the logger thread rather than each one
+	//	waiting on syslog (started after the fork, a thread wouldn't survive it)
+	if(logStart())
+		exit(EXIT_FAILURE);
+	
+	//The backing store is opened once and shared by everything that uses it
+	if(storageOpen()){
+		syslog(LOG_ERR, "Unable to open the backing store");
+		exit(EXIT_FAILURE);
+	}
+
+	//The timestamp timer is waited on by whichever loop we end up running, so the
+	//	timestamps are written from there rather than a thread of their own
+	int timerFd = -1;
+	if(timestampSeconds && storageBackend()->timestamps){
+		timerFd = intervalStart(timestampSeconds, timestampFormat, &fileAccessMutex);
+		if(timerFd == -1){
+			syslog(LOG_ERR, "Unable to start the timestamp timer");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	//This thread does the accepting (unless it becomes an event loop or the io_uring
+	//	thread, which pin themselves to a worker CPU)
+	affinityApplySelf(AFFINITY_ACCEPT, -1);
+
+	//Overload limits, and the spare descriptor for when we run out
+	if(admitStart(&limits, listenSockets, listenCount)){
+		syslog(LOG_ERR, "Unable to set up admission control");
+		exit(EXIT_FAILURE);
+	}
+
+	//Begin listening for client connections
+	DEBUG_PRINT("Listening\n");
+	for(int i = 0; i < listenCount; i++){
+		ret = listen(listenSockets[i], backlog);
+		if(ret){
+			syslog(LOG_ERR, "listen: %s", strerror(errno));
+			close(listenSockets[i]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	//The event loop mode handles accepting and all the client connections itself
+	if(mode == MODE_EPOLL){
+		if(eventLoopRun(listenSockets, listenCount, timerFd, &fileAccessMutex, loopCount, &closeApplication))
+			syslog(LOG_ERR, "Unable to run the event loop");
+	}
+
+	//io_uring does everything on this thread. If the kernel doesn't support what
+	//	we need, we'll fall back to the thread-per-connection loop below.
+	if(mode == MODE_URING){
+		ret = uringRun(socketHandle, timerFd, &fileAccessMutex, &closeApplication);
+		if(ret == URING_UNAVAILABLE){
+			syslog(LOG_INFO, "io_uring unavailable, using thread-per-connection");
+			mode = MODE_THREAD;
+		}
+		else if(ret)
+			syslog(LOG_ERR, "Unable to run the io_uring server");
+	}
+
+	//The connection table tracks our client threads, and reaps them as they complete
+	if(mode == MODE_THREAD && ct_init(MAX_CONNECTIONS)){
+		syslog(LOG_ERR, "Unable to create the connection table");
+		closeApplication = true;
+	}
+
+	//The pool workers are started up front, and we just hand them connections
+	if(mode == MODE_POOL && poolStart(loopCount, queueDepth, &fileAccessMutex)){
+		syslog(LOG_ERR, "Unable to start the worker pool");
+		closeApplication = true;
+	}
+
+	//With a listener per thread, each one gets its own acceptor and we just wait here
+	//	for a signal (or the timestamp timer). ppoll() only unblocks our signals while
+	//	it's waiting, so one can't be missed between the check and the wait.
+	if((mode == MODE_THREAD || mode == MODE_POOL) && reusePort && !closeApplication){
+		if(acceptorsStart(listenSockets, listenCount, dispatchConnection)){
+			syslog(LOG_ERR, "Unable to start the acceptors");
+			closeApplication = true;
+		}
+		
+		sigset_t oldSet;
+		blockSignals(&oldSet);
+		struct pollfd timerPoll = {.fd = timerFd, .events = POLLIN};
+		while(!closeApplication){
+			if(ppoll(&timerPoll, 1, NULL, &oldSet) > 0)
+				intervalFire(timerFd);
+			statsPoll();
+		}
+		pthread_sigmask(SIG_SETMASK, &oldSet, NULL);
+		acceptorsStop();
+	}
+
+	//We wait in ppoll() for a connection or the timestamp timer, so accept() should
+	//	never block (a client can give up between the two)
+	if(mode == MODE_THREAD || mode == MODE_POOL){
+		int flags = fcntl(socketHandle, F_GETFL);
+		if(flags == -1 || fcntl(socketHandle, F_SETFL, flags | O_NONBLOCK)){
+			syslog(LOG_ERR, "fcntl: %s", strerror(errno));
+			closeApplication = true;
+		}
+	}
+
+	//Loop until we've been told to exit (by a signal). As above, our signals are
+	//	only unblocked inside ppoll(), so one that arrives between the check and
+	//	the wait still wakes it (connection threads inherit the blocked mask, so
+	//	it's us that gets it).
+	struct sockaddr addr;
+	struct pollfd waitFds[2] = {{.fd = socketHandle, .events = POLLIN}, {.fd = timerFd, .events = POLLIN}};
+	sigset_t oldSet;
+	blockSignals(&oldSet);
+	while((mode == MODE_THREAD || mode == MODE_POOL) && !closeApplication){
+		statsPoll();
+	
+		//We can now block until an incomming connection (or a timestamp) is due.
+		//	A timerFd of -1 is skipped by ppoll().
+		DEBUG_PRINT("Waiting for new connection...\n");
+		if(ppoll(waitFds, 2, NULL, &oldSet) == -1)
+			continue;
+		if(waitFds[1].revents & POLLIN)
+			intervalFire(timerFd);
+		if(!(waitFds[0].revents & POLLIN))
+			continue;
+
+
+		socklen_t addrLen = sizeof(addr);
+		//Non-blocking, so a client that stops reading can't wedge its thread in send()
+		int clientSocket = accept4(socketHandle, &addr, &addrLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if(clientSocket == -1){
+
+			//Recoverable error or signal request to close
+			if(errno == EAGAIN || errno == ECONNABORTED || errno == EINTR)
+				continue;
+
+			//Out of descriptors. The waiting client is turned away and we carry on
+			//	(if there wasn't one, it's worth a short wait for some to free up)
+			if(errno == EMFILE || errno == ENFILE){
+				if(!admitAcceptFailed(socketHandle, errno))
+					nanosleep(&(struct timespec){.tv_nsec = 10000000}, NULL);
+				continue;
+			}
+			
+			//We'll get here if any unrecoverable error occurs
+			syslog(LOG_ERR, "accept: %s", strerror(errno));
+			
+			for(int i = 0; i < listenCount; i++)
+				close(listenSockets[i]);
+			
+			poolStop();
+			ct_shutdown();
+			storageClose();		//Deletes the data file (unless it persists)
+			exit(EXIT_FAILURE);
+		}
+		
+		//Save the IP address of the connecting client
+		uint32_t ip = ntohl(*(uint32_t *)&addr.sa_data[2]);
+		
+		dispatchConnection(clientSocket, ip);
+		
+		//As the parent we continue processing more connections
+	}
+	pthread_sigmask(SIG_SETMASK, &oldSet, NULL);
+	
+	//We must have received a signal (where we set the closeApplication), so we're ready to exit.
+	syslog(LOG_INFO, "Caught signal, exiting");
+	printf("\nWaiting for connections to complete, and exiting...\n");
+	
+	//Cancel the timer
+	intervalStop(timerFd);
+	
+	poolStop();
+	ct_shutdown();
+	storageClose();		//Deletes the data file (unless it persists)
+	admitStop();
+	logStop();
+	for(int i = 0; i < listenCount; i++)
+		close(listenSockets[i]);
+	
+	closelog();
+	exit(EXIT_SUCCESS);
 }
\ No newline at end of file
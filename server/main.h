@@ -1,40 +1,112 @@
-
-#ifndef MAIN_H
-#define MAIN_H
-
-#include <stdint.h>
-
-#define LISTEN_PORT		9000
-#define MAX_BACKLOG 	100
-
-#undef EXIT_FAILURE
-#define EXIT_FAILURE	-1
-
-#define BLOCK_SIZE		64
- 
-
-#define TIMESTAMP_INTERVAL_S	10
-
-//Switch between file and driver (1 = driver)
-#define USE_AESD_CHAR_DEVICE	1
-
-#if USE_AESD_CHAR_DEVICE
-#define FILE_PATH		"/dev/aesdchar" 
-#else
-#define FILE_PATH		"/var/tmp/aesdsocketdata" 
-#endif
-
-//Comment this to remove the verbose prints
-//#define DEBUG
-
-#ifdef DEBUG
-#define DEBUG_PRINT(a, ...) printf(a, ##__VA_ARGS__)
-#else
-#define DEBUG_PRINT(a, ...)
-#endif
-
-//Extern functions
-timer_t *intervalTimerStart(pthread_mutex_t *fileWriteMutex);
-
-
-#endif 	//#define MAIN_H
+
+#ifndef MAIN_H
+#define MAIN_H
+
+#include <stdint.h>
+#include <signal.h>
+
+#define LISTEN_PORT		9000
+#define MAX_BACKLOG 	100
+#define MAX_CONNECTIONS	4096
+
+//Default overload limits (-c, -b, -i). A client over a limit is told
+//	ADMIT_BUSY_REPLY straight away, rather than left waiting on a server that
+//	can't keep up. The listen backlog (-l, MAX_BACKLOG by default) is what
+//	queues clients we haven't got to yet.
+#define ADMIT_CONNECTIONS	MAX_CONNECTIONS
+#define ADMIT_BUFFERED		(256 << 20)
+#define ADMIT_REQUESTS		1024
+#define ADMIT_BUSY_REPLY	"BUSY\n"
+
+//Per client rate limits (-R) let a client burst this many seconds worth, a
+//	request over its rate is answered RATE_LIMITED_REPLY and not stored
+#define RATE_BURST_S		2
+#define RATE_LIMITED_REPLY	"THROTTLED\n"
+
+#undef EXIT_FAILURE
+#define EXIT_FAILURE	-1
+
+#define BLOCK_SIZE		64
+
+//In file mode a packet that gets to STREAM_WINDOW bytes without its '\n' is
+//	moved out to a staging file, so a connection never holds more than this
+//	(plus one receive) of it in memory however long the line is
+#define STREAM_WINDOW	(64 << 10)
+
+//Connection buffers are powers of two from BUF_MIN_SIZE, and the ones up to
+//	BUF_POOL_MAX are kept for reuse (up to BUF_POOL_BYTES worth of each size)
+#define BUF_MIN_SIZE	4096
+#define BUF_POOL_MAX	(1 << 20)
+#define BUF_POOL_BYTES	(4 << 20)
+
+//Replies that can't go zero copy are read and sent this much at a time
+#define REPLY_BUF_SIZE	(64 << 10)
+
+//Most a search reply holds, a search that finds more stops there (and says where)
+#define SEARCH_REPLY_MAX	(1 << 20)
+
+//Largest data file we keep an in-memory snapshot of for replies (0 turns it off)
+#define SNAPSHOT_MAX	(32 << 20)
+
+//The mmap backend maps the data file (and allocates its blocks) MAP_SEGMENT at
+//	a time, into address space reserved for MAPPED_MAX bytes up front
+#define MAP_SEGMENT		(4 << 20)
+#define MAPPED_MAX		((sizeof(void *) == 8) ? (64LL << 30) : (512LL << 20))
+
+#define POOL_QUEUE_DEPTH	64
+
+//A client with more than SLOW_HIGH_WATER bytes of reply queued up for it for
+//	SLOW_GRACE_S seconds is dropped. Anything waiting on a full socket checks
+//	again every SLOW_SWEEP_MS.
+#define SLOW_HIGH_WATER		(4 << 20)
+#define SLOW_GRACE_S		10
+#define SLOW_SWEEP_MS		1000
+ 
+
+//Timestamps (file mode only) are appended every TIMESTAMP_INTERVAL_S, formatted
+//	by strftime
+#define TIMESTAMP_INTERVAL_S	10
+#define TIMESTAMP_FORMAT		"timestamp:%Y-%m-%d %H:%M:%S"
+
+//The backend used unless -S picks another, file or driver (1 = driver)
+#ifndef USE_AESD_CHAR_DEVICE
+#define USE_AESD_CHAR_DEVICE	1
+#endif
+
+#if USE_AESD_CHAR_DEVICE
+#define STORAGE_DEFAULT		"aesdchar"
+#else
+#define STORAGE_DEFAULT		"file"
+#endif
+
+#define FILE_PATH			"/var/tmp/aesdsocketdata" 
+#define CHAR_DEVICE_PATH	"/dev/aesdchar"
+
+//Kept with the data file when it's persistent (-P), with a checkpoint written
+//	every CHECKPOINT_RECORDS records or CHECKPOINT_BYTES, whichever comes first
+#define LOG_INDEX_PATH		FILE_PATH ".index"
+#define CHECKPOINT_RECORDS	4096
+#define CHECKPOINT_BYTES	(16 << 20)
+
+//How client connections are handled
+typedef enum {
+	MODE_THREAD,		//A new thread for every connection
+	MODE_POOL,			//A fixed set of worker threads with work stealing queues
+	MODE_EPOLL,			//Non-blocking connections on epoll event loop(s)
+	MODE_URING			//Completion based io_uring engine on a single thread
+} serverMode_t;
+
+//Comment this to remove the verbose prints
+//#define DEBUG
+
+#ifdef DEBUG
+#define DEBUG_PRINT(a, ...) printf(a, ##__VA_ARGS__)
+#else
+#define DEBUG_PRINT(a, ...)
+#endif
+
+//Extern functions
+void blockSignals(sigset_t *oldSet);
+
+
+#endif 	//#define MAIN_H
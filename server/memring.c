@@ -0,0 +1,273 @@
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include "../aesd-char-driver/aesd-circular-buffer.h"
+#include "main.h"
+#include "stats.h"
+#include "storage.h"
+#include "memring.h"
+
+#define RING_HANDLE		0		//What every request gets from acquire(), there's nothing to open
+
+//The ring, and its length (the records it holds, end to end). Everything is
+//	done with ringLock held, like the driver's mutex, except reading ringSize.
+static struct aesd_circular_buffer ring;
+static pthread_mutex_t ringLock = PTHREAD_MUTEX_INITIALIZER;
+static off_t ringSize = 0;
+static unsigned long ringGeneration = 0;		//Bumped on every append
+
+//A copy of the ring at snapGeneration, built when a reply wants one and the
+//	ring has changed since. We hold a reference, each reply takes its own.
+//	Appends and seeks take theirs with ringLock still held, so their reply is
+//	the very ring their offsets are in.
+static storageSnap_t *ringSnap = NULL;
+static unsigned long snapGeneration = 0;
+
+static unsigned long statAppends = 0;
+static unsigned long long statBytes = 0;
+static unsigned long statDropped = 0;		//Records pushed off the front by newer ones
+static unsigned long statSnapBuilds = 0;
+static unsigned long statSnapHits = 0;
+
+
+/***********************************************************************************
+ *	Log what the ring holds and how it's been used (registered with the stats
+ *	dump)
+ **********************************************************************************/
+static void memRingStats(void){
+	syslog(LOG_INFO, "ring: %lld bytes held, %lu appends (%llu bytes), %lu records dropped off the front",
+			(long long)__atomic_load_n(&ringSize, __ATOMIC_RELAXED), __atomic_load_n(&statAppends, __ATOMIC_RELAXED),
+			__atomic_load_n(&statBytes, __ATOMIC_RELAXED), __atomic_load_n(&statDropped, __ATOMIC_RELAXED));
+	syslog(LOG_INFO, "ring: %lu snapshots built, %lu replies served",
+			__atomic_load_n(&statSnapBuilds, __ATOMIC_RELAXED), __atomic_load_n(&statSnapHits, __ATOMIC_RELAXED));
+}
+
+
+/***********************************************************************************
+ *	The entries in the order they were written (the driver walks them from
+ *	out_offs too)
+ **********************************************************************************/
+static int memRingEntries(void){
+	if(ring.full)
+		return AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+	return (ring.in_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - ring.out_offs) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+}
+
+static struct aesd_buffer_entry *memRingEntry(int index){
+	return &ring.entry[(ring.out_offs + index) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+}
+
+
+/***********************************************************************************
+ *	Start out empty
+ **********************************************************************************/
+static int memRingOpen(void){
+	aesd_circular_buffer_init(&ring);
+	statsRegister(memRingStats);
+	return 0;
+}
+
+
+/***********************************************************************************
+ *	Free every record, and our snapshot
+ **********************************************************************************/
+static void memRingClose(void){
+	uint8_t index;
+	struct aesd_buffer_entry *entry;
+
+	pthread_mutex_lock(&ringLock);
+	AESD_CIRCULAR_BUFFER_FOREACH(entry, &ring, index){
+		free((char *)entry->buffptr);
+	}
+	aesd_circular_buffer_init(&ring);
+	__atomic_store_n(&ringSize, 0, __ATOMIC_RELAXED);
+	storageSnapRelease(ringSnap);
+	ringSnap = NULL;
+	pthread_mutex_unlock(&ringLock);
+}
+
+
+static int memRingAcquire(void){
+	return RING_HANDLE;
+}
+
+static void memRingRelease(int fd){
+}
+
+
+/***********************************************************************************
+ *	Get a reference to a copy of the ring as it is now (ringLock held), making
+ *	a new copy if there have been appends since the last one. NULL if there's
+ *	no memory for one.
+ **********************************************************************************/
+static storageSnap_t *memRingSnapLocked(void){
+	if(!ringSnap || snapGeneration != ringGeneration){
+		storageSnap_t *copy = malloc(sizeof(storageSnap_t) + ringSize);
+		if(!copy)
+			return NULL;
+		copy->refs = 1;
+		copy->data = (unsigned char *)(copy + 1);
+		copy->size = ringSize;
+		copy->len = 0;
+		for(int i = 0, count = memRingEntries(); i < count; i++){
+			memcpy(copy->data + copy->len, memRingEntry(i)->buffptr, memRingEntry(i)->size);
+			copy->len += memRingEntry(i)->size;
+		}
+		storageSnapRelease(ringSnap);
+		ringSnap = copy;
+		snapGeneration = ringGeneration;
+		__atomic_add_fetch(&statSnapBuilds, 1, __ATOMIC_RELAXED);
+	}
+
+	__atomic_add_fetch(&ringSnap->refs, 1, __ATOMIC_RELAXED);
+	return ringSnap;
+}
+
+
+/***********************************************************************************
+ *	Copy the packet into a record of its own and add it, freeing whichever one
+ *	it pushes off the front. The reply covers everything the ring holds, and
+ *	comes from the snapshot taken before anyone else can append.
+ **********************************************************************************/
+static int memRingAppend(pthread_mutex_t *mutex, int fd, uint32_t source, int stageFd, off_t stageLen,
+							const void *buf, size_t len, off_t *end, storageSnap_t **snap){
+	char *copy = malloc(len);
+	if(!copy){
+		syslog(LOG_ERR, "Unable to allocate a ring record: %s", strerror(errno));
+		return -1;
+	}
+	memcpy(copy, buf, len);
+	struct aesd_buffer_entry add = {.buffptr = copy, .size = len};
+
+	pthread_mutex_lock(&ringLock);
+	size_t droppedSize = ring.full ? ring.entry[ring.out_offs].size : 0;
+	const char *dropped = aesd_circular_buffer_add_entry(&ring, &add);
+	off_t size = ringSize + len - droppedSize;
+	__atomic_store_n(&ringSize, size, __ATOMIC_RELAXED);
+	ringGeneration++;
+	if(snap)
+		*snap = memRingSnapLocked();
+	pthread_mutex_unlock(&ringLock);
+
+	if(snap && *snap)
+		__atomic_add_fetch(&statSnapHits, 1, __ATOMIC_RELAXED);
+	if(dropped){
+		free((char *)dropped);
+		__atomic_add_fetch(&statDropped, 1, __ATOMIC_RELAXED);
+	}
+	__atomic_add_fetch(&statAppends, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&statBytes, len, __ATOMIC_RELAXED);
+
+	if(end)
+		*end = size;
+	return 0;
+}
+
+
+/***********************************************************************************
+ *	Copy out what's at [off, off + len), for a reply that couldn't get a
+ *	snapshot
+ **********************************************************************************/
+static ssize_t memRingRead(int fd, void *buf, size_t len, off_t off){
+	if(off < 0){
+		errno = EINVAL;
+		return -1;
+	}
+
+	size_t done = 0;
+	pthread_mutex_lock(&ringLock);
+	size_t entryOff;
+	struct aesd_buffer_entry *entry = aesd_circular_buffer_find_entry_offset_for_fpos(&ring, off, &entryOff);
+	if(entry){
+		int index = (entry - ring.entry + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - ring.out_offs) %
+						AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+		for(int count = memRingEntries(); index < count && done < len; index++, entryOff = 0){
+			entry = memRingEntry(index);
+			size_t part = entry->size - entryOff;
+			if(part > len - done)
+				part = len - done;
+			memcpy((char *)buf + done, entry->buffptr + entryOff, part);
+			done += part;
+		}
+	}
+	pthread_mutex_unlock(&ringLock);
+	return done;
+}
+
+
+static off_t memRingSize(void){
+	return __atomic_load_n(&ringSize, __ATOMIC_RELAXED);
+}
+
+
+/***********************************************************************************
+ *	Find offset bytes into the command'th record (counting from the oldest
+ *	one still held), the reply is from there to the end of the snapshot taken
+ *	along with it
+ **********************************************************************************/
+static int memRingSeekTo(int fd, uint32_t command, uint32_t offset, off_t *start, off_t *end, storageSnap_t **snap){
+	off_t pos = 0;
+
+	pthread_mutex_lock(&ringLock);
+	int count = memRingEntries();
+	bool valid = command < (uint32_t)count && offset < memRingEntry(command)->size;
+	if(valid){
+		for(uint32_t i = 0; i < command; i++)
+			pos += memRingEntry(i)->size;
+		*start = pos + offset;
+		*end = ringSize;
+		if(snap)
+			*snap = memRingSnapLocked();
+	}
+	pthread_mutex_unlock(&ringLock);
+
+	if(snap && *snap)
+		__atomic_add_fetch(&statSnapHits, 1, __ATOMIC_RELAXED);
+	if(!valid){
+		errno = EINVAL;
+		syslog(LOG_ERR, "ring seekto %u,%u: no such position", command, offset);
+		return -1;
+	}
+	return 0;
+}
+
+
+/***********************************************************************************
+ *	Get a reference to a copy of the ring as it is now, for a reader that
+ *	didn't get one with its append or seek (a search). It only has to hold
+ *	[0, end), which may not be the same bytes they were when end was read.
+ **********************************************************************************/
+static storageSnap_t *memRingSnapshot(off_t end){
+	pthread_mutex_lock(&ringLock);
+	storageSnap_t *s = memRingSnapLocked();
+	pthread_mutex_unlock(&ringLock);
+
+	if(s && s->len < end){
+		storageSnapRelease(s);
+		s = NULL;
+	}
+	if(s)
+		__atomic_add_fetch(&statSnapHits, 1, __ATOMIC_RELAXED);
+	return s;
+}
+
+
+const storageBackend_t memRingBackend = {
+	.name = "ring",
+	.timestamps = false,
+	.descriptors = false,
+	.open = memRingOpen,
+	.close = memRingClose,
+	.acquire = memRingAcquire,
+	.release = memRingRelease,
+	.append = memRingAppend,
+	.read = memRingRead,
+	.size = memRingSize,
+	.seekTo = memRingSeekTo,
+	.snapshot = memRingSnapshot,
+};
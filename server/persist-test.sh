@@ -0,0 +1,146 @@
+#!/bin/bash
+# Recovery test for the persistent data file (-P)
+#
+# Each case stores a few records, damages the data file or its log index the
+# way a crash (or a careless restore) would, restarts the server and checks
+# what it recovered: the length and record count from AESD_STAT, the data
+# file against what it should hold, and the recovery line it logged.
+#
+#	trusted torn entry	killed, last index entry torn: that record is cut
+#	missing index		index deleted: every record is reindexed and kept
+#	stale checkpoint	data file older than the checkpoint: it's not trusted,
+#						what's there is checked and kept
+#	unfinished tail		a line with no '\n' on the end: it's cut
+#
+# Usage: ./persist-test.sh [backend...]	(file and mmap by default)
+# Build first (make). It uses the server's data file and port, so don't run
+# it alongside the server.
+
+set -u
+
+DATAFILE=/var/tmp/aesdsocketdata
+INDEXFILE=${DATAFILE}.index
+PORT=9000
+LOG_HEADER=128		#Both checkpoint slots, the entries come after
+ENTRY_SIZE=16		#Each entry's end, crc and check
+
+#change directory to the location of this script
+cd `dirname $0`
+
+BACKENDS=${@:-file mmap}
+EXPECTED=$(mktemp)
+SERVERLOG=$(mktemp)
+trap 'rm -f "$EXPECTED" "$SERVERLOG"' EXIT
+failures=0
+pid=
+
+if [ ! -x ./aesdsocket ]
+then
+	echo "Build the server first (make)"
+	exit 1
+fi
+if (exec 3<>/dev/tcp/127.0.0.1/$PORT) 2>/dev/null
+then
+	echo "Something is already listening on port $PORT, stop the server first"
+	exit 1
+fi
+
+startServer(){
+	./aesdsocket -P -T 0 -S $1 > /dev/null 2> "$SERVERLOG" &
+	pid=$!
+	for i in $(seq 1 50)
+	do
+		(exec 3<>/dev/tcp/127.0.0.1/$PORT) 2>/dev/null && return 0
+		sleep 0.1
+	done
+	echo "The server didn't start"
+	cat "$SERVERLOG"
+	exit 1
+}
+
+#SIGTERM checkpoints everything on the way out, SIGKILL is a crash
+stopServer(){
+	kill -$1 $pid
+	wait $pid 2>/dev/null
+}
+
+send(){
+	exec 3<>/dev/tcp/127.0.0.1/$PORT
+	printf '%s\n' "$1" >&3
+	cat <&3
+	exec 3<&-
+}
+
+store(){
+	for record in "$@"
+	do
+		send "$record" > /dev/null
+		printf '%s\n' "$record" >> "$EXPECTED"
+	done
+}
+
+check(){
+	if [ "$2" = "$3" ]
+	then
+		echo "  PASS: $1"
+	else
+		echo "  FAIL: $1 (got '$2', expected '$3')"
+		failures=$((failures + 1))
+	fi
+}
+
+#Restart and check the length and records against EXPECTED, and the log
+checkRecovered(){
+	local records=$(wc -l < "$EXPECTED")
+	local bytes=$(wc -c < "$EXPECTED")
+
+	startServer $1
+	check "$2: stat" "$(send AESD_STAT)" "STAT:$bytes,$records"
+	stopServer TERM
+	check "$2: data file" "$(cmp -s "$EXPECTED" "$DATAFILE" && echo same)" "same"
+	check "$2: logged" "$(grep -o "Recovered [0-9]* records ([0-9]* bytes).*reindexed" "$SERVERLOG")" \
+		"Recovered $records records ($bytes bytes) from $DATAFILE, $3"
+}
+
+for backend in $BACKENDS
+do
+	echo "Backend $backend"
+	rm -f "$DATAFILE" "$INDEXFILE"
+	: > "$EXPECTED"
+
+	#Killed, so the checkpoint is still the one from startup, and the last
+	#	entry is torn. Checking stops there and its record is cut.
+	startServer $backend
+	store one two three four
+	stopServer KILL
+	printf '\xff' | dd of="$INDEXFILE" bs=1 seek=$((LOG_HEADER + 3 * ENTRY_SIZE + 8)) conv=notrunc 2>/dev/null
+	sed -i '$d' "$EXPECTED"
+	checkRecovered $backend "trusted torn entry" "3 of them checked past the checkpoint and 0 reindexed"
+
+	#No index at all, every record is reindexed from the data file
+	rm -f "$INDEXFILE"
+	checkRecovered $backend "missing index" "0 of them checked past the checkpoint and 3 reindexed"
+
+	#The data file is put back to an older copy, the checkpoint says it's longer
+	#	than it is so it isn't trusted. The entries that still match are kept.
+	startServer $backend
+	store five six
+	stopServer TERM
+	sed -i '$d' "$EXPECTED"
+	truncate -s $(wc -c < "$EXPECTED") "$DATAFILE"
+	checkRecovered $backend "stale checkpoint" "4 of them checked past the checkpoint and 0 reindexed"
+
+	#A line that never finished is cut, the whole ones before it are kept
+	printf 'unfinished' >> "$DATAFILE"
+	checkRecovered $backend "unfinished tail" "0 of them checked past the checkpoint and 0 reindexed"
+
+	rm -f "$DATAFILE" "$INDEXFILE"
+done
+
+if [ $failures -ne 0 ]
+then
+	echo "$failures checks failed"
+	exit 1
+fi
+echo "All recovery checks passed"
+exit 0
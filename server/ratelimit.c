@@ -0,0 +1,199 @@
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <time.h>
+#include "main.h"
+#include "stats.h"
+#include "ratelimit.h"
+
+#define MAX_RULES		16
+#define RATE_WAYS		8		//Clients per group, a new one pushes out the least recently seen
+#define RATE_GROUPS		1024	//Groups of clients, each with its own lock
+
+//A subnet and what each client in it is allowed
+typedef struct {
+	uint32_t net;
+	uint32_t mask;
+	int prefix;
+	double requests;		//Per second (0 for no limit)
+	double bytes;
+
+	unsigned long allowed;
+	unsigned long throttled;
+	unsigned long long throttledBytes;
+}rateRule_t;
+
+//One client's buckets. They start full, and are topped up (to the burst) by
+//	the time since we last saw it each time it asks.
+typedef struct {
+	uint32_t ip;
+	int rule;				//-1 for an unused slot
+	double requestTokens;
+	double byteTokens;		//Can go negative, a big request is paid off before the next
+	uint64_t last;			//When (monotonic ns) we last topped it up
+}rateClient_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	rateClient_t clients[RATE_WAYS];
+}rateGroup_t;
+
+static rateRule_t rules[MAX_RULES];
+static int ruleCount = 0;
+static rateGroup_t *groups = NULL;
+static unsigned long statEvicted = 0;
+
+
+/***********************************************************************************
+ *	Log each rule and what it's let through (registered with the stats dump)
+ **********************************************************************************/
+static void rateStats(void){
+	int tracked = 0;
+	for(int g = 0; g < RATE_GROUPS; g++){
+		pthread_mutex_lock(&groups[g].lock);
+		for(int i = 0; i < RATE_WAYS; i++)
+			tracked += (groups[g].clients[i].rule != -1);
+		pthread_mutex_unlock(&groups[g].lock);
+	}
+	syslog(LOG_INFO, "rate: %i clients tracked (of %i), %lu pushed out", tracked, RATE_GROUPS * RATE_WAYS,
+			__atomic_load_n(&statEvicted, __ATOMIC_RELAXED));
+
+	for(int i = 0; i < ruleCount; i++){
+		rateRule_t *r = &rules[i];
+		syslog(LOG_INFO, "rate %u.%u.%u.%u/%i: %.0f requests/s, %.0f bytes/s per client, %lu allowed, %lu throttled (%llu bytes)",
+				r->net >> 24, (r->net >> 16) & 0xFF, (r->net >> 8) & 0xFF, r->net & 0xFF, r->prefix,
+				r->requests, r->bytes, __atomic_load_n(&r->allowed, __ATOMIC_RELAXED),
+				__atomic_load_n(&r->throttled, __ATOMIC_RELAXED), __atomic_load_n(&r->throttledBytes, __ATOMIC_RELAXED));
+	}
+}
+
+
+/***********************************************************************************
+ *	Parse and add a rule. Rules are kept most specific first, so the first
+ *	match is the one that applies.
+ **********************************************************************************/
+int rateAddRule(const char *rule){
+	unsigned int a, b, c, d;
+	int prefix;
+	double requests, bytes;
+	char end;
+
+	if(ruleCount == MAX_RULES)
+		return -1;
+	if(sscanf(rule, "%u.%u.%u.%u/%i=%lf,%lf%c", &a, &b, &c, &d, &prefix, &requests, &bytes, &end) != 7)
+		return -1;
+	if(a > 255 || b > 255 || c > 255 || d > 255 || prefix < 0 || prefix > 32 || requests < 0 || bytes < 0)
+		return -1;
+
+	//The client table only exists once there's a rule to use it
+	if(!groups){
+		groups = calloc(RATE_GROUPS, sizeof(rateGroup_t));
+		if(!groups)
+			return -1;
+		for(int g = 0; g < RATE_GROUPS; g++){
+			pthread_mutex_init(&groups[g].lock, NULL);
+			for(int i = 0; i < RATE_WAYS; i++)
+				groups[g].clients[i].rule = -1;
+		}
+		statsRegister(rateStats);
+	}
+
+	uint32_t mask = prefix ? ~0u << (32 - prefix) : 0;
+	int pos = ruleCount;
+	while(pos && rules[pos - 1].prefix < prefix){
+		rules[pos] = rules[pos - 1];
+		pos--;
+	}
+	rules[pos] = (rateRule_t){.net = ((a << 24) | (b << 16) | (c << 8) | d) & mask, .mask = mask,
+								.prefix = prefix, .requests = requests, .bytes = bytes};
+	ruleCount++;
+	return 0;
+}
+
+
+/***********************************************************************************
+ *	Find a client's buckets in its group, or make room for them
+ **********************************************************************************/
+static rateClient_t *rateFind(rateGroup_t *g, uint32_t ip, int rule, uint64_t now){
+	rateClient_t *oldest = &g->clients[0];
+
+	for(int i = 0; i < RATE_WAYS; i++){
+		rateClient_t *c = &g->clients[i];
+		if(c->rule != -1 && c->ip == ip)
+			return c;
+		if(c->rule == -1 || (oldest->rule != -1 && c->last < oldest->last))
+			oldest = c;
+	}
+
+	//A client pushed out while its buckets weren't full gets a fresh start if
+	//	it comes back, so the groups are big enough that only idle ones go
+	if(oldest->rule != -1)
+		__atomic_add_fetch(&statEvicted, 1, __ATOMIC_RELAXED);
+	oldest->ip = ip;
+	oldest->rule = rule;
+	oldest->requestTokens = rules[rule].requests * RATE_BURST_S;
+	oldest->byteTokens = rules[rule].bytes * RATE_BURST_S;
+	oldest->last = now;
+	return oldest;
+}
+
+
+/***********************************************************************************
+ *	Charge a client for requests (1, or 0 for more bytes of one that's still
+ *	arriving) and bytes, if it has the tokens
+ **********************************************************************************/
+static bool rateCharge(uint32_t ip, int requests, size_t bytes){
+	if(!ruleCount)
+		return true;
+
+	int rule = 0;
+	while(rule < ruleCount && (ip & rules[rule].mask) != rules[rule].net)
+		rule++;
+	if(rule == ruleCount)
+		return true;
+	rateRule_t *r = &rules[rule];
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	uint64_t now = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+	rateGroup_t *g = &groups[((ip * 2654435761u) >> 16) % RATE_GROUPS];
+	pthread_mutex_lock(&g->lock);
+	rateClient_t *c = rateFind(g, ip, rule, now);
+
+	double elapsed = (now - c->last) / 1e9;
+	c->last = now;
+	c->requestTokens += r->requests * elapsed;
+	if(c->requestTokens > r->requests * RATE_BURST_S)
+		c->requestTokens = r->requests * RATE_BURST_S;
+	c->byteTokens += r->bytes * elapsed;
+	if(c->byteTokens > r->bytes * RATE_BURST_S)
+		c->byteTokens = r->bytes * RATE_BURST_S;
+
+	bool allow = (!requests || !r->requests || c->requestTokens >= requests) && (!r->bytes || c->byteTokens > 0);
+	if(allow){
+		c->requestTokens -= requests;
+		c->byteTokens -= bytes;
+	}
+	pthread_mutex_unlock(&g->lock);
+
+	if(allow)
+		__atomic_add_fetch(&r->allowed, requests, __ATOMIC_RELAXED);
+	else{
+		__atomic_add_fetch(&r->throttled, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&r->throttledBytes, bytes, __ATOMIC_RELAXED);
+	}
+	return allow;
+}
+
+bool rateAllow(uint32_t ip, size_t bytes){
+	return rateCharge(ip, 1, bytes);
+}
+
+bool rateAllowBytes(uint32_t ip, size_t bytes){
+	return rateCharge(ip, 0, bytes);
+}
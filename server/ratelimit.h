@@ -0,0 +1,25 @@
+
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//Add a limit for the clients in a subnet, from "a.b.c.d/len=requests,bytes".
+//	Both are per second for each client address in it (0 for no limit), and a
+//	client can burst to RATE_BURST_S seconds worth. The most specific subnet a
+//	client is in applies, clients in none aren't limited. Called at startup,
+//	returns -1 if the rule is invalid (or there are too many).
+int rateAddRule(const char *rule);
+
+//Charge a client for a request of bytes. Returns false (and charges nothing)
+//	if it's out of requests, or still paying off earlier bytes.
+bool rateAllow(uint32_t ip, size_t bytes);
+
+//Charge a client for bytes of a request that's still arriving (staged), so a
+//	long packet pays as it goes rather than all at the end. Returns false (and
+//	charges nothing) if it's still paying off earlier bytes.
+bool rateAllowBytes(uint32_t ip, size_t bytes);
+
+#endif //RATELIMIT_H
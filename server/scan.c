@@ -0,0 +1,254 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+typedef size_t (*scanFn_t)(const unsigned char *, size_t, unsigned char, uint32_t *, size_t);
+typedef const unsigned char *(*findFn_t)(const unsigned char *, size_t, const unsigned char *, size_t);
+
+static scanFn_t scanFn = NULL;
+static findFn_t findFn = NULL;
+static const char *scanFnName = "scalar";
+
+
+/***********************************************************************************
+ *	Plain C version, memchr() is already word-at-a-time (or better) in libc
+ **********************************************************************************/
+size_t scanDelimsScalar(const unsigned char *buf, size_t len, unsigned char delim, uint32_t *offsets, size_t maxCount){
+	size_t count = 0;
+	const unsigned char *p = buf;
+	const unsigned char *end = buf + len;
+
+	while(count < maxCount && p < end){
+		p = memchr(p, delim, end - p);
+		if(!p)
+			break;
+		offsets[count++] = p - buf;
+		p++;
+	}
+	return count;
+}
+
+
+/***********************************************************************************
+ *	Plain C substring search, memmem() from libc
+ **********************************************************************************/
+const unsigned char *scanFindScalar(const unsigned char *buf, size_t len, const unsigned char *needle, size_t needleLen){
+	return memmem(buf, len, needle, needleLen);
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+/***********************************************************************************
+ *	Turn a compare mask (bit n set = byte n matched) into offsets
+ **********************************************************************************/
+static inline size_t scanMask(uint32_t mask, size_t base, uint32_t *offsets, size_t count, size_t maxCount){
+	while(mask && count < maxCount){
+		offsets[count++] = base + __builtin_ctz(mask);
+		mask &= mask - 1;
+	}
+	return count;
+}
+
+
+/***********************************************************************************
+ *	16 bytes per compare. Every match in a block comes out of one movemask, so
+ *	a chunk full of short packets is still a single pass. Long stretches without
+ *	a match (the middle of a big line) are checked 64 bytes at a time.
+ **********************************************************************************/
+__attribute__((target("sse2")))
+size_t scanDelimsSse2(const unsigned char *buf, size_t len, unsigned char delim, uint32_t *offsets, size_t maxCount){
+	size_t count = 0;
+	size_t i = 0;
+	__m128i d = _mm_set1_epi8((char)delim);
+
+	for(; i + 64 <= len && count < maxCount; i += 64){
+		__m128i m0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i)), d);
+		__m128i m1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i + 16)), d);
+		__m128i m2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i + 32)), d);
+		__m128i m3 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i + 48)), d);
+		if(!_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(m0, m1), _mm_or_si128(m2, m3))))
+			continue;
+
+		count = scanMask(_mm_movemask_epi8(m0), i, offsets, count, maxCount);
+		count = scanMask(_mm_movemask_epi8(m1), i + 16, offsets, count, maxCount);
+		count = scanMask(_mm_movemask_epi8(m2), i + 32, offsets, count, maxCount);
+		count = scanMask(_mm_movemask_epi8(m3), i + 48, offsets, count, maxCount);
+	}
+
+	for(; i + 16 <= len && count < maxCount; i += 16){
+		__m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+		uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, d));
+		count = scanMask(mask, i, offsets, count, maxCount);
+	}
+
+	if(i < len && count < maxCount){
+		size_t tail = scanDelimsScalar(buf + i, len - i, delim, offsets + count, maxCount - count);
+		for(size_t t = 0; t < tail; t++)
+			offsets[count + t] += i;
+		count += tail;
+	}
+	return count;
+}
+
+
+/***********************************************************************************
+ *	Same again 32 bytes at a time (128 bytes per check when there's no match)
+ **********************************************************************************/
+__attribute__((target("avx2")))
+size_t scanDelimsAvx2(const unsigned char *buf, size_t len, unsigned char delim, uint32_t *offsets, size_t maxCount){
+	size_t count = 0;
+	size_t i = 0;
+	__m256i d = _mm256_set1_epi8((char)delim);
+
+	for(; i + 128 <= len && count < maxCount; i += 128){
+		__m256i m0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + i)), d);
+		__m256i m1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + i + 32)), d);
+		__m256i m2 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + i + 64)), d);
+		__m256i m3 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + i + 96)), d);
+		if(_mm256_testz_si256(_mm256_or_si256(m0, m1), _mm256_or_si256(m0, m1)) &&
+		   _mm256_testz_si256(_mm256_or_si256(m2, m3), _mm256_or_si256(m2, m3)))
+			continue;
+
+		count = scanMask(_mm256_movemask_epi8(m0), i, offsets, count, maxCount);
+		count = scanMask(_mm256_movemask_epi8(m1), i + 32, offsets, count, maxCount);
+		count = scanMask(_mm256_movemask_epi8(m2), i + 64, offsets, count, maxCount);
+		count = scanMask(_mm256_movemask_epi8(m3), i + 96, offsets, count, maxCount);
+	}
+
+	for(; i + 32 <= len && count < maxCount; i += 32){
+		__m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+		uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, d));
+		count = scanMask(mask, i, offsets, count, maxCount);
+	}
+
+	if(i < len && count < maxCount){
+		size_t tail = scanDelimsSse2(buf + i, len - i, delim, offsets + count, maxCount - count);
+		for(size_t t = 0; t < tail; t++)
+			offsets[count + t] += i;
+		count += tail;
+	}
+	return count;
+}
+
+
+/***********************************************************************************
+ *	Substring search a block at a time. We compare the needle's first byte at
+ *	every position in the block and its last byte needleLen-1 further on, and
+ *	only the positions where both match get a full compare. Text that doesn't
+ *	contain the needle almost never gets past the vector compares.
+ **********************************************************************************/
+__attribute__((target("sse2")))
+const unsigned char *scanFindSse2(const unsigned char *buf, size_t len, const unsigned char *needle, size_t needleLen){
+	if(needleLen < 2 || len < needleLen)
+		return memmem(buf, len, needle, needleLen);
+
+	__m128i first = _mm_set1_epi8((char)needle[0]);
+	__m128i last = _mm_set1_epi8((char)needle[needleLen - 1]);
+	size_t i = 0;
+
+	for(; i + needleLen - 1 + 16 <= len; i += 16){
+		__m128i blockFirst = _mm_loadu_si128((const __m128i *)(buf + i));
+		__m128i blockLast = _mm_loadu_si128((const __m128i *)(buf + i + needleLen - 1));
+		uint32_t mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(blockFirst, first),
+														 _mm_cmpeq_epi8(blockLast, last)));
+		while(mask){
+			size_t pos = i + __builtin_ctz(mask);
+			if(!memcmp(buf + pos + 1, needle + 1, needleLen - 2))
+				return buf + pos;
+			mask &= mask - 1;
+		}
+	}
+	return memmem(buf + i, len - i, needle, needleLen);
+}
+
+
+/***********************************************************************************
+ *	Same again 32 positions at a time
+ **********************************************************************************/
+__attribute__((target("avx2")))
+const unsigned char *scanFindAvx2(const unsigned char *buf, size_t len, const unsigned char *needle, size_t needleLen){
+	if(needleLen < 2 || len < needleLen)
+		return memmem(buf, len, needle, needleLen);
+
+	__m256i first = _mm256_set1_epi8((char)needle[0]);
+	__m256i last = _mm256_set1_epi8((char)needle[needleLen - 1]);
+	size_t i = 0;
+
+	for(; i + needleLen - 1 + 32 <= len; i += 32){
+		__m256i blockFirst = _mm256_loadu_si256((const __m256i *)(buf + i));
+		__m256i blockLast = _mm256_loadu_si256((const __m256i *)(buf + i + needleLen - 1));
+		uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(blockFirst, first),
+															  _mm256_cmpeq_epi8(blockLast, last)));
+		while(mask){
+			size_t pos = i + __builtin_ctz(mask);
+			if(!memcmp(buf + pos + 1, needle + 1, needleLen - 2))
+				return buf + pos;
+			mask &= mask - 1;
+		}
+	}
+	return scanFindSse2(buf + i, len - i, needle, needleLen);
+}
+#endif
+
+
+/***********************************************************************************
+ *	Pick the best version for this CPU. Every thread picks the same one, so it
+ *	doesn't matter if a few race through here at the start.
+ **********************************************************************************/
+static scanFn_t scanPick(void){
+	scanFn_t fn = scanDelimsScalar;
+	findFn_t find = scanFindScalar;
+	const char *name = "scalar";
+
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")){
+		fn = scanDelimsAvx2;
+		find = scanFindAvx2;
+		name = "avx2";
+	}
+	else if(__builtin_cpu_supports("sse2")){
+		fn = scanDelimsSse2;
+		find = scanFindSse2;
+		name = "sse2";
+	}
+#endif
+
+	scanFnName = name;
+	__atomic_store_n(&findFn, find, __ATOMIC_RELEASE);
+	__atomic_store_n(&scanFn, fn, __ATOMIC_RELEASE);
+	return fn;
+}
+
+
+/***********************************************************************************
+ *	Find the delimiters
+ **********************************************************************************/
+size_t scanDelims(const unsigned char *buf, size_t len, unsigned char delim, uint32_t *offsets, size_t maxCount){
+	scanFn_t fn = __atomic_load_n(&scanFn, __ATOMIC_ACQUIRE);
+	if(!fn)
+		fn = scanPick();
+	return fn(buf, len, delim, offsets, maxCount);
+}
+
+/***********************************************************************************
+ *	Find a substring
+ **********************************************************************************/
+const unsigned char *scanFind(const unsigned char *buf, size_t len, const unsigned char *needle, size_t needleLen){
+	findFn_t fn = __atomic_load_n(&findFn, __ATOMIC_ACQUIRE);
+	if(!fn){
+		scanPick();
+		fn = __atomic_load_n(&findFn, __ATOMIC_ACQUIRE);
+	}
+	return fn(buf, len, needle, needleLen);
+}
+
+const char *scanName(void){
+	if(!__atomic_load_n(&scanFn, __ATOMIC_ACQUIRE))
+		scanPick();
+	return scanFnName;
+}
@@ -0,0 +1,30 @@
+
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+//Find where delim occurs in buf[0..len), in order, stopping once maxCount have
+//	been found. Returns how many offsets were written. Uses the widest vector
+//	instructions the CPU has (picked on the first call).
+size_t scanDelims(const unsigned char *buf, size_t len, unsigned char delim, uint32_t *offsets, size_t maxCount);
+
+//Find the first place needle occurs in buf[0..len), NULL if it doesn't. Picks
+//	its version along with scanDelims().
+const unsigned char *scanFind(const unsigned char *buf, size_t len, const unsigned char *needle, size_t needleLen);
+
+//Which version scanDelims() (and scanFind()) is using
+const char *scanName(void);
+
+//The individual versions (for the benchmark)
+size_t scanDelimsScalar(const unsigned char *buf, size_t len, unsigned char delim, uint32_t *offsets, size_t maxCount);
+const unsigned char *scanFindScalar(const unsigned char *buf, size_t len, const unsigned char *needle, size_t needleLen);
+#if defined(__x86_64__) || defined(__i386__)
+size_t scanDelimsSse2(const unsigned char *buf, size_t len, unsigned char delim, uint32_t *offsets, size_t maxCount);
+size_t scanDelimsAvx2(const unsigned char *buf, size_t len, unsigned char delim, uint32_t *offsets, size_t maxCount);	//Only if the CPU has AVX2
+const unsigned char *scanFindSse2(const unsigned char *buf, size_t len, const unsigned char *needle, size_t needleLen);
+const unsigned char *scanFindAvx2(const unsigned char *buf, size_t len, const unsigned char *needle, size_t needleLen);	//Only if the CPU has AVX2
+#endif
+
+#endif //SCAN_H
@@ -0,0 +1,252 @@
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <pthread.h>
+#include "main.h"
+#include "bufpool.h"
+#include "scan.h"
+#include "stats.h"
+#include "storage.h"
+#include "search.h"
+
+static pthread_once_t statsOnce = PTHREAD_ONCE_INIT;
+static unsigned long statSearches = 0;
+static unsigned long statFromSnapshot = 0;
+static unsigned long statScanned = 0;
+static unsigned long statMatches = 0;
+static unsigned long statFull = 0;
+
+
+/***********************************************************************************
+ *	Log the search numbers (registered with the stats dump)
+ **********************************************************************************/
+static void searchStats(void){
+	syslog(LOG_INFO, "search: %lu searches (%lu from the snapshot, %lu stopped early), %lu bytes scanned, %lu matches (%s)",
+			__atomic_load_n(&statSearches, __ATOMIC_RELAXED), __atomic_load_n(&statFromSnapshot, __ATOMIC_RELAXED),
+			__atomic_load_n(&statFull, __ATOMIC_RELAXED), __atomic_load_n(&statScanned, __ATOMIC_RELAXED),
+			__atomic_load_n(&statMatches, __ATOMIC_RELAXED), scanName());
+}
+
+static void searchRegister(void){
+	statsRegister(searchStats);
+}
+
+
+/***********************************************************************************
+ *	Search a block of lines (that landed at base in the store). The pattern can't
+ *	hold a '\n', so a match never crosses lines, and we search the whole block in
+ *	one go rather than line by line. Only the lines with a match are looked at
+ *	any further.
+ *
+ *	Returns -1 once the result is full (next is the line that didn't fit).
+ **********************************************************************************/
+static int searchBlock(searchResult_t *r, const unsigned char *data, size_t len, off_t base,
+						const unsigned char *pattern, size_t patternLen){
+	size_t pos = 0;
+
+	while(pos < len){
+		const unsigned char *hit = scanFind(data + pos, len - pos, pattern, patternLen);
+		if(!hit)
+			break;
+
+		const unsigned char *lineStart = memrchr(data + pos, '\n', hit - (data + pos));
+		lineStart = lineStart ? lineStart + 1 : data + pos;
+		const unsigned char *lineEnd = memchr(hit, '\n', data + len - hit);
+		lineEnd = lineEnd ? lineEnd + 1 : data + len;
+
+		size_t lineLen = lineEnd - lineStart;
+		if(r->len + lineLen > SEARCH_REPLY_MAX){
+			r->next = base + (lineStart - data);
+			r->full = true;
+			return -1;
+		}
+		if(r->len + lineLen > (size_t)r->size && bufGrow(&r->buf, &r->size, r->len, r->len + lineLen)){
+			r->next = base + (lineStart - data);
+			r->full = true;
+			return -1;
+		}
+
+		memcpy(r->buf + r->len, lineStart, lineLen);
+		r->len += lineLen;
+		r->matches++;
+		pos = lineEnd - data;
+	}
+
+	r->next = base + len;
+	return 0;
+}
+
+
+/***********************************************************************************
+ *	Add the record [lineStart, lineEnd) to the result, read back from fd. This is
+ *	for a matching line that was too long to stay in the search buffer, so only
+ *	the reply (which SEARCH_REPLY_MAX caps) ever holds all of it.
+ *
+ *	Returns -1 once the result is full, or if the read failed (rc is set then).
+ **********************************************************************************/
+static int searchCopyLine(int fd, searchResult_t *r, off_t lineStart, off_t lineEnd, int *rc){
+	size_t lineLen = lineEnd - lineStart;
+	if(r->len + lineLen > SEARCH_REPLY_MAX ||
+			(r->len + lineLen > (size_t)r->size && bufGrow(&r->buf, &r->size, r->len, r->len + lineLen))){
+		r->next = lineStart;
+		r->full = true;
+		return -1;
+	}
+
+	size_t done = 0;
+	while(done < lineLen){
+		ssize_t byteCount = storageRead(fd, r->buf + r->len + done, lineLen - done, lineStart + done);
+		if(byteCount < 0 && errno == EINTR)
+			continue;
+		if(byteCount <= 0){
+			syslog(LOG_ERR, "search read: %s", byteCount ? strerror(errno) : "record is gone");
+			*rc = -1;
+			return -1;
+		}
+		done += byteCount;
+	}
+
+	r->len += lineLen;
+	r->matches++;
+	r->next = lineEnd;
+	return 0;
+}
+
+
+/***********************************************************************************
+ *	Search through fd a block at a time. A block is only searched up to its last
+ *	'\n', the partial line after that moves to the front and is finished off by
+ *	the next read. The buffer never grows: a line that fills it is searched as
+ *	it goes, keeping only its last patternLen - 1 bytes (so a match across two
+ *	reads is still found) and where it started. If it matched, it's read back
+ *	into the reply once its end turns up.
+ **********************************************************************************/
+static int searchFile(int fd, off_t start, off_t end, const unsigned char *pattern, size_t patternLen, searchResult_t *r){
+	int size;
+	unsigned char *buf = bufGet(REPLY_BUF_SIZE, &size);
+	if(!buf)
+		return -1;
+
+	//What's kept of a long line has to leave room to read more after it
+	if((size_t)size < patternLen * 2 && bufGrow(&buf, &size, 0, patternLen * 2)){
+		bufPut(buf, size);
+		return -1;
+	}
+
+	int have = 0;
+	off_t off = start;			//Where the next read comes from
+	off_t lineStart = start;	//Where the line at the front of buf started
+	bool longLine = false;		//Only the tail of that line is still in buf
+	bool lineHit = false;		//The part of it we've let go of held the pattern
+	bool eof = false;
+	int rc = 0;
+
+	while(!eof){
+		size_t want = size - have;
+		if(end >= 0 && (off_t)want > end - off)
+			want = end - off;
+
+		ssize_t byteCount = want ? storageRead(fd, buf + have, want, off) : 0;
+		if(byteCount < 0){
+			if(errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "search read: %s", strerror(errno));
+			rc = -1;
+			break;
+		}
+		eof = !byteCount;
+		off += byteCount;
+		have += byteCount;
+		__atomic_add_fetch(&statScanned, byteCount, __ATOMIC_RELAXED);
+		off_t base = off - have;
+
+		//Whole lines only, unless that's everything there is
+		const unsigned char *last = memrchr(buf, '\n', have);
+		int lines = eof ? have : (last ? last + 1 - buf : 0);
+		if(!lines && !eof){
+			if(have < size)
+				continue;
+
+			//One line fills the buffer, search it and let go of all but its tail
+			int keep = patternLen - 1;
+			if(!lineHit && scanFind(buf, have, pattern, patternLen))
+				lineHit = true;
+			memmove(buf, buf + have - keep, keep);
+			have = keep;
+			longLine = true;
+			continue;
+		}
+
+		//A long line ends at the first '\n' (the end of the range at the latest)
+		int done = 0;
+		if(longLine){
+			const unsigned char *nl = memchr(buf, '\n', lines);
+			done = nl ? nl + 1 - buf : lines;
+			if(!lineHit && scanFind(buf, done, pattern, patternLen))
+				lineHit = true;
+			if(lineHit && searchCopyLine(fd, r, lineStart, base + done, &rc))
+				break;
+			longLine = lineHit = false;
+		}
+
+		if(searchBlock(r, buf + done, lines - done, base + done, pattern, patternLen))
+			break;
+		memmove(buf, buf + lines, have - lines);
+		have -= lines;
+		lineStart = base + lines;
+	}
+
+	bufPut(buf, size);
+	return rc;
+}
+
+
+/***********************************************************************************
+ *	Run a search
+ **********************************************************************************/
+int searchRun(int fd, off_t start, off_t end, const unsigned char *pattern, size_t patternLen, searchResult_t *result){
+	pthread_once(&statsOnce, searchRegister);
+	__atomic_add_fetch(&statSearches, 1, __ATOMIC_RELAXED);
+
+	memset(result, 0, sizeof(*result));
+	result->next = start;
+	result->buf = bufGet(BUF_MIN_SIZE, &result->size);
+	if(!result->buf)
+		return -1;
+
+	//The snapshot has it all in memory already, so it's one pass over it
+	storageSnap_t *snap = (end >= 0) ? storageSnapshot(end) : NULL;
+	int rc = 0;
+	if(snap){
+		__atomic_add_fetch(&statFromSnapshot, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&statScanned, end - start, __ATOMIC_RELAXED);
+		searchBlock(result, snap->data + start, end - start, start, pattern, patternLen);
+		storageSnapRelease(snap);
+	}
+	else
+		rc = searchFile(fd, start, end, pattern, patternLen, result);
+
+	//A matching record bigger than a whole reply can't be sent, and carrying on
+	//	from next would only find it again
+	if(!rc && result->full && !result->len){
+		syslog(LOG_ERR, "search: the record at %lld is longer than a reply (%d bytes)", (long long)result->next, SEARCH_REPLY_MAX);
+		rc = -1;
+	}
+
+	if(rc){
+		bufPut(result->buf, result->size);
+		result->buf = NULL;
+		return -1;
+	}
+
+	__atomic_add_fetch(&statMatches, result->matches, __ATOMIC_RELAXED);
+	if(result->full)
+		__atomic_add_fetch(&statFull, 1, __ATOMIC_RELAXED);
+	return 0;
+}
@@ -0,0 +1,27 @@
+
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+//What a search found. buf (from the buffer pool) holds the matching records,
+//	and next is where the search stopped, the end of the range unless buf
+//	filled up first (a client carries on from there).
+typedef struct {
+	unsigned char *buf;
+	int size;
+	int len;
+	long matches;
+	off_t next;
+	bool full;
+}searchResult_t;
+
+//Find the records (lines) in [start, end) of the store that contain pattern.
+//	An end of -1 searches to the end of fd (the char device). The snapshot is
+//	searched when it covers the range, otherwise fd is read a block at a time.
+//	Returns -1 on failure (nothing is left for the caller to free).
+int searchRun(int fd, off_t start, off_t end, const unsigned char *pattern, size_t patternLen, searchResult_t *result);
+
+#endif //SEARCH_H
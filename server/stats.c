@@ -0,0 +1,53 @@
+
+#include <signal.h>
+#include <syslog.h>
+#include <pthread.h>
+#include "main.h"
+#include "stats.h"
+
+#define MAX_STATS_SOURCES	16
+
+static statsDump_t sources[MAX_STATS_SOURCES];
+static int sourceCount = 0;
+static pthread_mutex_t sourceMutex = PTHREAD_MUTEX_INITIALIZER;
+static volatile sig_atomic_t dumpRequested = 0;
+
+
+/***********************************************************************************
+ *	Add a function to be called when the stats are dumped
+ **********************************************************************************/
+int statsRegister(statsDump_t dump){
+	int ret = -1;
+
+	pthread_mutex_lock(&sourceMutex);
+	if(sourceCount < MAX_STATS_SOURCES){
+		sources[sourceCount++] = dump;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&sourceMutex);
+	return ret;
+}
+
+
+/***********************************************************************************
+ *	Signal safe, we just note that someone wants the stats.
+ **********************************************************************************/
+void statsRequest(void){
+	dumpRequested = 1;
+}
+
+
+/***********************************************************************************
+ *	Log every registered stats source if a dump was requested
+ **********************************************************************************/
+void statsPoll(void){
+	if(!dumpRequested)
+		return;
+	dumpRequested = 0;
+
+	syslog(LOG_INFO, "---- aesdsocket stats ----");
+	pthread_mutex_lock(&sourceMutex);
+	for(int i = 0; i < sourceCount; i++)
+		sources[i]();
+	pthread_mutex_unlock(&sourceMutex);
+}
@@ -0,0 +1,17 @@
+
+#ifndef STATS_H
+#define STATS_H
+
+//Each subsystem that has counters worth seeing registers a function that logs
+//	them. Sending SIGUSR1 to the server logs every registered set to the syslog.
+typedef void (*statsDump_t)(void);
+
+int statsRegister(statsDump_t dump);
+
+//Called from the signal handler, only sets a flag
+void statsRequest(void);
+
+//Called from the accept/event loops. Dumps everything if a request is pending.
+void statsPoll(void);
+
+#endif //STATS_H
@@ -0,0 +1,1632 @@
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <libgen.h>
+#include <limits.h>
+#include "main.h"
+#include "stats.h"
+#include "scan.h"
+#include "crc32c.h"
+#include "chardev.h"
+#include "memring.h"
+#include "storage.h"
+
+#define MAX_BATCH		64		//Appends one leader writes at once
+#define HIST_BUCKETS	8		//Batch sizes 1, 2, 3-4, 5-8 ... 65+
+#define INDEX_CHUNK		65536	//Record offsets in each chunk of the index
+#define INDEX_CHUNKS	4096	//Chunks we can have, so up to 256M records
+#define COMMIT_QUEUES	256		//Queues appends are hashed into by source
+#define COMMIT_QUANTUM	(64 << 10)	//Bytes each queue is credited per round
+#define BATCH_BYTES		(4 << 20)	//A batch stops taking appends once it's this big
+
+//An append waiting to be committed. These live on the appending thread's stack,
+//	except a queued one, which nobody waits for (the leader frees it).
+typedef struct _commitReq_t {
+	uint32_t source;		//Who it's for (the client's address), appends are fair queued by it
+	int stageFd;			//Staged bytes that go in front of buf (-1 if there are none)
+	off_t stageLen;
+	const void *buf;
+	size_t len;
+	off_t end;				//Set by the leader, where the file ended after this one
+	int rc;
+	bool done;
+	bool lead;				//Handed the lead, this thread writes the next batch
+	bool queued;			//storageAppendQueued(), the data follows it and there's no thread behind it
+	struct _commitReq_t *next;
+}commitReq_t;
+
+//A queue of appends from the sources that hash to it. While it has any it's in
+//	the round robin the leader builds batches from.
+typedef struct _commitQueue_t {
+	commitReq_t *head;
+	commitReq_t *tail;
+	long long deficit;		//Bytes it can still take this round (goes negative after a big one)
+	bool midTurn;			//A batch filled up part way through its turn
+	struct _commitQueue_t *next;
+}commitQueue_t;
+
+static int sharedFd = -1;
+static off_t storageEnd = 0;		//Only changed with the file mutex held, read with __atomic
+
+//Appends wait here until a leader writes them. Each source's appends land in
+//	the file in the order they arrived, but sources take turns (deficit round
+//	robin, by bytes), so one busy client can't fill every batch.
+static pthread_mutex_t commitLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commitCond = PTHREAD_COND_INITIALIZER;
+static commitQueue_t commitQueues[COMMIT_QUEUES];
+static commitQueue_t *activeHead = NULL;
+static commitQueue_t *activeTail = NULL;
+static int activeCount = 0;
+static bool commitLeader = false;
+
+//The current snapshot. Only the commit leader changes it (with the file mutex
+//	held), readers pick it up without any lock. snapPins counts readers between
+//	loading the pointer and taking their reference, and a replaced snapshot
+//	isn't let go of until that's back to 0 (so nobody can pin a freed one).
+static storageSnap_t *snap = NULL;
+static int snapPins = 0;
+static unsigned long snapGeneration = 0;		//Bumped on every append
+static bool snapOff = (SNAPSHOT_MAX == 0);
+
+static unsigned long statSnapHits = 0;
+static unsigned long statSnapShared = 0;		//Hits at the same generation as the last one
+static unsigned long statSnapMisses = 0;
+static unsigned long statSnapGrows = 0;
+static unsigned long lastHitGeneration = 0;
+
+//Where each record (line) ends. The chunks never move once they're allocated,
+//	so readers can look up any record below recordCount without a lock.
+static off_t *recordIndex[INDEX_CHUNKS];
+static long recordCount = 0;		//Only changed with the file mutex held, read with __atomic
+static bool indexOff = false;
+
+//A file mapped into MAPPED_MAX of address space reserved up front. Segments of
+//	the file are mapped in as it grows, so it's one contiguous run at base that
+//	never moves.
+typedef struct {
+	const char *path;
+	int fd;
+	unsigned char *base;
+	off_t mapped;			//File bytes mapped so far, a multiple of MAP_SEGMENT
+}storageMap_t;
+
+//Where the data file and its log index are (FILE_PATH, unless storageSetPath()
+//	moved them)
+static char dataPath[PATH_MAX] = FILE_PATH;
+static char indexPath[PATH_MAX] = LOG_INDEX_PATH;
+
+//The mmap backend's view of the data file. mapSnap covers it, and stands in for
+//	the snapshot.
+static storageMap_t dataMap = {.path = dataPath, .fd = -1};
+static storageSnap_t mapSnap;
+
+//Persistent (-P), the data file is kept across restarts. Beside it, the log
+//	index has two checkpoint slots and then an entry for each record: where it
+//	ends, and the CRC32C of its bytes. The commit leader writes the entries
+//	(through a mapping) right after the records, and they're the record index.
+//	Every CHECKPOINT_RECORDS records (or CHECKPOINT_BYTES) both files are
+//	synced and a checkpoint says how much of them is good, so startup only
+//	has to check the records written after it.
+typedef struct {
+	uint64_t end;			//Where the record ends in the data file
+	uint32_t crc;			//Of the record's bytes
+	uint32_t check;			//Of the two above, so a torn entry is caught too
+}logEntry_t;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t crc;			//Of the checkpoint with this set to 0
+	uint64_t sequence;		//They alternate slots, the higher of the good ones is current
+	uint64_t records;
+	uint64_t length;		//Of the data file
+	uint64_t valid;			//Where the last record ends (an unfinished line can go past it)
+}logCheckpoint_t;
+
+#define LOG_MAGIC		0x41455344		//"AESD"
+#define LOG_SLOT		64				//Bytes for each checkpoint
+#define LOG_HEADER		(2 * LOG_SLOT)	//The entries start after both slots
+
+static bool persistent = false;
+static storageMap_t logMap = {.path = indexPath, .fd = -1};
+static off_t logLength = 0;				//Of the log index file, past the last entry it's zeros
+static logCheckpoint_t checkpoint;		//The last one written
+static uint32_t lineCrc = 0;			//Of the unfinished line the data file ends in, if it does (leader only)
+
+static unsigned long statCheckpoints = 0;
+static long statRecovered = 0;			//Records found at startup
+static long statChecked = 0;			//Of those, the ones past the checkpoint
+static long statRebuilt = 0;			//And the ones the log index had no entry for
+static long long statTruncated = 0;		//Bytes of torn tail cut off
+
+static unsigned long statAppends = 0;
+static unsigned long statBatches = 0;
+static int statPeakSources = 0;				//Most queues waiting at once
+static unsigned long statStaged = 0;			//Appends that came in through a staging file
+static unsigned long long statStagedBytes = 0;
+static unsigned long statBatchHist[HIST_BUCKETS];
+
+static const storageBackend_t fileBackend;
+static const storageBackend_t *backend = NULL;		//STORAGE_DEFAULT unless storageSelect() is called
+
+static storageSnap_t *storageSnapPin(void);
+static logEntry_t *storageLogEntry(long n);
+
+
+/***********************************************************************************
+ *	Log the group commit numbers (registered with the stats dump)
+ **********************************************************************************/
+static void storageStats(void){
+	char line[160];
+	int len = 0;
+
+	pthread_mutex_lock(&commitLock);
+	unsigned long appends = statAppends;
+	unsigned long batches = statBatches;
+	for(int i = 0; i < HIST_BUCKETS; i++){
+		int low = i ? (1 << (i - 1)) + 1 : 1;
+		int high = 1 << i;
+		if(i == HIST_BUCKETS - 1)
+			len += snprintf(line + len, sizeof(line) - len, " %i+:%lu", low, statBatchHist[i]);
+		else if(low == high)
+			len += snprintf(line + len, sizeof(line) - len, " %i:%lu", low, statBatchHist[i]);
+		else
+			len += snprintf(line + len, sizeof(line) - len, " %i-%i:%lu", low, high, statBatchHist[i]);
+	}
+	pthread_mutex_unlock(&commitLock);
+
+	syslog(LOG_INFO, "storage: %lu appends in %lu batches, %lld bytes, %ld records",
+			appends, batches, (long long)storageCommitted(), storageRecordCount());
+	syslog(LOG_INFO, "storage batch sizes:%s", line);
+	pthread_mutex_lock(&commitLock);
+	syslog(LOG_INFO, "storage: %i source queues waiting (peak %i)", activeCount, statPeakSources);
+	pthread_mutex_unlock(&commitLock);
+	syslog(LOG_INFO, "storage: %lu staged appends, %llu bytes staged",
+			__atomic_load_n(&statStaged, __ATOMIC_RELAXED), __atomic_load_n(&statStagedBytes, __ATOMIC_RELAXED));
+	if(dataMap.base)
+		syslog(LOG_INFO, "storage: %lld bytes mapped in %lld segments", (long long)__atomic_load_n(&dataMap.mapped, __ATOMIC_RELAXED),
+				(long long)__atomic_load_n(&dataMap.mapped, __ATOMIC_RELAXED) / MAP_SEGMENT);
+	if(logMap.base){
+		syslog(LOG_INFO, "storage: persistent, checkpoint %llu at %llu records (%llu bytes), %lu written, crc32c is %s",
+				(unsigned long long)__atomic_load_n(&checkpoint.sequence, __ATOMIC_RELAXED),
+				(unsigned long long)__atomic_load_n(&checkpoint.records, __ATOMIC_RELAXED),
+				(unsigned long long)__atomic_load_n(&checkpoint.length, __ATOMIC_RELAXED),
+				__atomic_load_n(&statCheckpoints, __ATOMIC_RELAXED), crc32cName());
+		syslog(LOG_INFO, "storage: %ld records recovered at startup (%ld checked past the checkpoint, %ld reindexed), %lld bytes of torn tail cut off",
+				statRecovered, statChecked, statRebuilt, statTruncated);
+	}
+
+	storageSnap_t *s = storageSnapPin();
+	syslog(LOG_INFO, "snapshot: %s, generation %lu, %lld of %zu bytes, %lu grows",
+			__atomic_load_n(&snapOff, __ATOMIC_RELAXED) ? "off" : "on", __atomic_load_n(&snapGeneration, __ATOMIC_RELAXED),
+			s ? (long long)__atomic_load_n(&s->len, __ATOMIC_ACQUIRE) : 0LL, s ? s->size : 0,
+			__atomic_load_n(&statSnapGrows, __ATOMIC_RELAXED));
+	syslog(LOG_INFO, "snapshot: %lu replies served (%lu at an unchanged generation), %lu misses",
+			__atomic_load_n(&statSnapHits, __ATOMIC_RELAXED), __atomic_load_n(&statSnapShared, __ATOMIC_RELAXED),
+			__atomic_load_n(&statSnapMisses, __ATOMIC_RELAXED));
+	storageSnapRelease(s);
+}
+
+
+/***********************************************************************************
+ *	Drop a reference to a snapshot, the last one frees it
+ **********************************************************************************/
+void storageSnapRelease(storageSnap_t *s){
+	if(s && !__atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL))
+		free(s);
+}
+
+
+/***********************************************************************************
+ *	Take a reference to the current snapshot without a lock. We announce
+ *	ourselves in snapPins first, so whoever replaces the snapshot waits for us
+ *	before dropping it.
+ **********************************************************************************/
+static storageSnap_t *storageSnapPin(void){
+	__atomic_add_fetch(&snapPins, 1, __ATOMIC_SEQ_CST);
+	storageSnap_t *s = __atomic_load_n(&snap, __ATOMIC_SEQ_CST);
+	if(s)
+		__atomic_add_fetch(&s->refs, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&snapPins, 1, __ATOMIC_RELEASE);
+	return s;
+}
+
+
+/***********************************************************************************
+ *	Make s the current snapshot, and let go of the old one once no reader can
+ *	still be on its way to pinning it. That window is a couple of instructions
+ *	long, so we just spin.
+ **********************************************************************************/
+static void storageSnapPublish(storageSnap_t *s){
+	storageSnap_t *old = __atomic_exchange_n(&snap, s, __ATOMIC_SEQ_CST);
+	if(!old)
+		return;
+
+	while(__atomic_load_n(&snapPins, __ATOMIC_ACQUIRE))
+		sched_yield();
+	storageSnapRelease(old);
+}
+
+
+/***********************************************************************************
+ *	Stop keeping a snapshot (once the file is bigger than we're willing to hold)
+ **********************************************************************************/
+static void storageSnapDisable(void){
+	__atomic_store_n(&snapOff, true, __ATOMIC_RELAXED);
+	storageSnapPublish(NULL);
+	syslog(LOG_INFO, "Data file is over %i bytes, no longer keeping a snapshot", SNAPSHOT_MAX);
+}
+
+
+/***********************************************************************************
+ *	Copy a committed batch onto the end of the snapshot. Only the commit leader
+ *	calls this (with the file mutex held), so nobody else changes snap. The new
+ *	bytes go past len, where no reader looks, and only become visible when len
+ *	moves. When there isn't room we move to a buffer twice the size, and readers
+ *	of the old one keep it until they're done. Staged bytes are read straight
+ *	into place from their staging file.
+ **********************************************************************************/
+static void storageSnapExtend(const commitReq_t *batch, size_t total){
+	//Mapped, the batch is already in place and only the length moves
+	if(dataMap.base){
+		int count = 0;
+		for(const commitReq_t *r = batch; r; r = r->next)
+			count++;
+		__atomic_store_n(&mapSnap.len, mapSnap.len + total, __ATOMIC_RELEASE);
+		__atomic_add_fetch(&snapGeneration, count, __ATOMIC_RELEASE);
+		return;
+	}
+	if(snapOff)
+		return;
+
+	storageSnap_t *cur = snap;
+	off_t len = cur ? cur->len : 0;
+	bool grew = false;
+
+	if(!cur || len + total > cur->size){
+		if(len + total > SNAPSHOT_MAX){
+			storageSnapDisable();
+			return;
+		}
+
+		size_t size = cur ? cur->size : BUF_MIN_SIZE;
+		while(size < len + total)
+			size *= 2;
+		if(size > SNAPSHOT_MAX)
+			size = SNAPSHOT_MAX;
+
+		storageSnap_t *grown = malloc(sizeof(storageSnap_t) + size);
+		if(!grown){
+			storageSnapDisable();
+			return;
+		}
+		grown->refs = 1;
+		grown->size = size;
+		grown->data = (unsigned char *)(grown + 1);
+		if(len)
+			memcpy(grown->data, cur->data, len);
+		cur = grown;
+		grew = true;
+		__atomic_add_fetch(&statSnapGrows, 1, __ATOMIC_RELAXED);
+	}
+
+	int count = 0;
+	for(const commitReq_t *r = batch; r; r = r->next, count++){
+		for(off_t done = 0; done < r->stageLen;){
+			ssize_t byteCount = pread(r->stageFd, cur->data + len, r->stageLen - done, done);
+			if(byteCount <= 0){
+				if(byteCount < 0 && errno == EINTR)
+					continue;
+				if(grew)
+					free(cur);
+				storageSnapDisable();
+				return;
+			}
+			done += byteCount;
+			len += byteCount;
+		}
+		memcpy(cur->data + len, r->buf, r->len);
+		len += r->len;
+	}
+
+	//The release store makes the bytes visible before the length that covers them
+	__atomic_store_n(&cur->len, len, __ATOMIC_RELEASE);
+	if(grew)
+		storageSnapPublish(cur);
+	__atomic_add_fetch(&snapGeneration, count, __ATOMIC_RELEASE);
+}
+
+
+/***********************************************************************************
+ *	Get the snapshot for a reply covering [0, end). The leader extends the
+ *	snapshot before the append it's for completes, so any end a caller got from
+ *	storageAppend() (or storageCommitted()) is already covered unless it's off.
+ **********************************************************************************/
+static storageSnap_t *fileSnapshot(off_t end){
+	storageSnap_t *s = storageSnapPin();
+	if(s && __atomic_load_n(&s->len, __ATOMIC_ACQUIRE) < end){
+		storageSnapRelease(s);
+		s = NULL;
+	}
+
+	if(!s){
+		__atomic_add_fetch(&statSnapMisses, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	__atomic_add_fetch(&statSnapHits, 1, __ATOMIC_RELAXED);
+	unsigned long generation = __atomic_load_n(&snapGeneration, __ATOMIC_RELAXED);
+	if(__atomic_exchange_n(&lastHitGeneration, generation, __ATOMIC_RELAXED) == generation)
+		__atomic_add_fetch(&statSnapShared, 1, __ATOMIC_RELAXED);
+	return s;
+}
+
+
+/***********************************************************************************
+ *	Note every '\n' in buf (which lands at base in the file) in the record index.
+ *	Only the commit leader (or storageOpen) calls this. The new entries aren't
+ *	visible until recordCount is published.
+ **********************************************************************************/
+static void storageIndexAdd(const unsigned char *buf, size_t len, off_t base, long *count){
+	uint32_t delims[64];
+	size_t pos = 0;
+
+	while(!indexOff && pos < len){
+		size_t found = scanDelims(buf + pos, len - pos, '\n', delims, 64);
+		for(size_t i = 0; i < found; i++){
+			long chunk = *count / INDEX_CHUNK;
+			if(chunk >= INDEX_CHUNKS){
+				syslog(LOG_ERR, "More than %i records, no longer indexing them", INDEX_CHUNKS * INDEX_CHUNK);
+				__atomic_store_n(&indexOff, true, __ATOMIC_RELAXED);
+				return;
+			}
+			if(!recordIndex[chunk] && !(recordIndex[chunk] = malloc(INDEX_CHUNK * sizeof(off_t)))){
+				syslog(LOG_ERR, "Unable to grow the record index, no longer indexing records");
+				__atomic_store_n(&indexOff, true, __ATOMIC_RELAXED);
+				return;
+			}
+			recordIndex[chunk][*count % INDEX_CHUNK] = base + pos + delims[i] + 1;
+			(*count)++;
+		}
+		pos = (found == 64) ? pos + delims[63] + 1 : len;
+	}
+}
+
+
+/***********************************************************************************
+ *	Index whatever is already in the file (straight from the mapping if it's
+ *	mapped). Either way it goes a REPLY_BUF_SIZE chunk at a time, the scanner's
+ *	offsets are 32 bits and a line can be longer than that.
+ **********************************************************************************/
+static void storageIndexLoad(void){
+	if(dataMap.base){
+		long count = 0;
+		for(off_t off = 0; off < storageEnd; off += REPLY_BUF_SIZE){
+			size_t len = (storageEnd - off < REPLY_BUF_SIZE) ? storageEnd - off : REPLY_BUF_SIZE;
+			storageIndexAdd(dataMap.base + off, len, off, &count);
+		}
+		recordCount = count;
+		return;
+	}
+
+	unsigned char *buf = malloc(REPLY_BUF_SIZE);
+	if(!buf){
+		indexOff = true;
+		return;
+	}
+
+	long count = 0;
+	for(off_t off = 0; off < storageEnd;){
+		ssize_t byteCount = pread(sharedFd, buf, REPLY_BUF_SIZE, off);
+		if(byteCount <= 0){
+			if(byteCount < 0 && errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "Unable to index %s", dataPath);
+			__atomic_store_n(&indexOff, true, __ATOMIC_RELAXED);
+			break;
+		}
+		storageIndexAdd(buf, byteCount, off, &count);
+		off += byteCount;
+	}
+	free(buf);
+	recordCount = count;
+}
+
+
+/***********************************************************************************
+ *	The record count, and where a record starts (record count is the end of
+ *	the last one), no lock needed
+ **********************************************************************************/
+static long fileRecordCount(void){
+	return __atomic_load_n(&indexOff, __ATOMIC_RELAXED) ? -1 : __atomic_load_n(&recordCount, __ATOMIC_ACQUIRE);
+}
+
+static off_t fileRecordOffset(long record){
+	if(record <= 0)
+		return 0;
+	record--;
+	if(logMap.base)
+		return storageLogEntry(record)->end;
+	return recordIndex[record / INDEX_CHUNK][record % INDEX_CHUNK];
+}
+
+
+/***********************************************************************************
+ *	The committed length, no lock needed
+ **********************************************************************************/
+static off_t fileSize(void){
+	return __atomic_load_n(&storageEnd, __ATOMIC_ACQUIRE);
+}
+
+
+/***********************************************************************************
+ *	Load what's already in the file into the first snapshot. Mapped, the
+ *	snapshot is the mapping, and it holds an extra reference so it's never
+ *	freed (it isn't ours to free).
+ **********************************************************************************/
+static void storageSnapLoad(void){
+	if(dataMap.base){
+		mapSnap = (storageSnap_t){.refs = 2, .size = MAPPED_MAX, .len = storageEnd, .data = dataMap.base};
+		snapOff = false;
+		storageSnapPublish(&mapSnap);
+		return;
+	}
+	if(snapOff || !storageEnd)
+		return;
+	if(storageEnd > SNAPSHOT_MAX){
+		snapOff = true;
+		return;
+	}
+
+	//The file itself stands in for a staging file, so it's read straight in
+	commitReq_t load = {.stageFd = sharedFd, .stageLen = storageEnd, .buf = "", .len = 0};
+	storageSnapExtend(&load, storageEnd);
+}
+
+
+/***********************************************************************************
+ *	Write the iovs in one go at offset at, finishing off piece by piece if the
+ *	kernel only takes part of them.
+ **********************************************************************************/
+static int storageWriteIov(int fd, struct iovec *iov, int count, size_t total, off_t at){
+	ssize_t byteCount;
+	do{
+		byteCount = pwritev(fd, iov, count, at);
+	}while(byteCount == -1 && errno == EINTR);
+	if(byteCount == -1)
+		return -1;
+
+	size_t done = byteCount;
+
+	//Short write, whatever is left goes one pwrite at a time
+	size_t pos = 0;
+	for(int i = 0; i < count && done < total; i++){
+		size_t skip = (done > pos) ? done - pos : 0;
+		pos += iov[i].iov_len;
+		if(skip >= iov[i].iov_len)
+			continue;
+
+		while(skip < iov[i].iov_len){
+			byteCount = pwrite(fd, (char *)iov[i].iov_base + skip, iov[i].iov_len - skip, at + done);
+			if(byteCount == -1 && errno == EINTR)
+				continue;
+			if(byteCount <= 0)
+				return -1;
+			skip += byteCount;
+			done += byteCount;
+		}
+	}
+	return 0;
+}
+
+
+/***********************************************************************************
+ *	Copy len staged bytes into the file at offset at. copy_file_range() keeps
+ *	it in the kernel (and the staging file lives next to the data file, so a
+ *	filesystem that can share extents doesn't copy at all). If it can't be
+ *	used here we fall back to reading and writing a block at a time.
+ **********************************************************************************/
+static int storageCopyStage(int fd, int stageFd, off_t len, off_t at){
+	off_t in = 0;
+	off_t out = at;
+
+	while(in < len){
+		ssize_t byteCount = copy_file_range(stageFd, &in, fd, &out, len - in, 0);
+		if(byteCount > 0)
+			continue;
+		if(byteCount == -1 && errno == EINTR)
+			continue;
+		if(byteCount == -1 && errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP)
+			return -1;
+		if(!byteCount)
+			return -1;		//The staging file is shorter than it should be
+		break;
+	}
+	if(in == len)
+		return 0;
+
+	unsigned char *buf = malloc(REPLY_BUF_SIZE);
+	if(!buf)
+		return -1;
+	int rc = 0;
+	while(!rc && in < len){
+		ssize_t byteCount = pread(stageFd, buf, (len - in < REPLY_BUF_SIZE) ? len - in : REPLY_BUF_SIZE, in);
+		if(byteCount == -1 && errno == EINTR)
+			continue;
+		if(byteCount <= 0){
+			rc = -1;
+			break;
+		}
+		struct iovec iov = {.iov_base = buf, .iov_len = byteCount};
+		rc = storageWriteIov(fd, &iov, 1, byteCount, out);
+		in += byteCount;
+		out += byteCount;
+	}
+	free(buf);
+	return rc;
+}
+
+
+/***********************************************************************************
+ *	Write a batch at the end of the file. Everything between staged appends
+ *	goes out with a single pwritev(), a staged one's bytes are copied over
+ *	from its staging file in between.
+ **********************************************************************************/
+static int storageWriteBatch(int fd, const commitReq_t *batch){
+	struct iovec iov[MAX_BATCH];
+	int count = 0;
+	size_t pending = 0;
+	off_t at = storageEnd;
+
+	for(const commitReq_t *r = batch; r; r = r->next){
+		if(r->stageLen){
+			if(count && storageWriteIov(fd, iov, count, pending, at))
+				return -1;
+			at += pending;
+			count = 0;
+			pending = 0;
+
+			if(storageCopyStage(fd, r->stageFd, r->stageLen, at))
+				return -1;
+			at += r->stageLen;
+		}
+		iov[count].iov_base = (void *)r->buf;
+		iov[count].iov_len = r->len;
+		pending += r->len;
+		count++;
+	}
+	return count ? storageWriteIov(fd, iov, count, pending, at) : 0;
+}
+
+
+/***********************************************************************************
+ *	Make sure the mapping reaches at least end, growing it by whole segments.
+ *	The file's blocks for them are allocated up front where the filesystem
+ *	can (without changing its length), so running out of space mostly shows
+ *	up here rather than as a SIGBUS when we write to the mapping.
+ **********************************************************************************/
+static int storageMapGrow(storageMap_t *m, off_t end){
+	if(end <= m->mapped)
+		return 0;
+
+	off_t grown = (end + MAP_SEGMENT - 1) / MAP_SEGMENT * MAP_SEGMENT;
+	if(grown > MAPPED_MAX){
+		syslog(LOG_ERR, "%s would be over the %lld bytes we can map", m->path, (long long)MAPPED_MAX);
+		errno = EFBIG;
+		return -1;
+	}
+
+	if(fallocate(m->fd, FALLOC_FL_KEEP_SIZE, m->mapped, grown - m->mapped) && errno != EOPNOTSUPP){
+		syslog(LOG_ERR, "Unable to grow %s: %s", m->path, strerror(errno));
+		return -1;
+	}
+	if(mmap(m->base + m->mapped, grown - m->mapped, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, m->fd, m->mapped) == MAP_FAILED){
+		syslog(LOG_ERR, "Unable to map %s: %s", m->path, strerror(errno));
+		return -1;
+	}
+	__atomic_store_n(&m->mapped, grown, __ATOMIC_RELAXED);
+	return 0;
+}
+
+
+/***********************************************************************************
+ *	Reserve the address space for a mapping of fd, and map as much of the file
+ *	as there already is
+ **********************************************************************************/
+static int storageMapOpen(storageMap_t *m, int fd, off_t length){
+	m->fd = fd;
+	m->mapped = 0;
+	m->base = mmap(NULL, MAPPED_MAX, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if(m->base == MAP_FAILED){
+		syslog(LOG_ERR, "Unable to reserve %lld bytes to map %s: %s", (long long)MAPPED_MAX, m->path, strerror(errno));
+		m->base = NULL;
+		return -1;
+	}
+	if(storageMapGrow(m, length)){
+		munmap(m->base, MAPPED_MAX);
+		m->base = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+static void storageMapClose(storageMap_t *m){
+	if(m->base)
+		munmap(m->base, MAPPED_MAX);
+	m->base = NULL;
+	m->mapped = 0;
+}
+
+
+/***********************************************************************************
+ *	Write a batch at the end of the mapped file. The file is stretched to
+ *	cover it (a page of the mapping past the end of the file can't be
+ *	touched, and this keeps the file exactly as long as the log for anyone
+ *	reading it), then it's copied into place (staged bytes are read straight
+ *	in from their staging file), past storageEnd where no reader looks until
+ *	the commit publishes it.
+ **********************************************************************************/
+static int storageMapBatch(int fd, const commitReq_t *batch, size_t total){
+	off_t at = storageEnd;
+
+	if(storageMapGrow(&dataMap, at + total))
+		return -1;
+	if(ftruncate(fd, at + total)){
+		syslog(LOG_ERR, "Unable to grow %s: %s", dataPath, strerror(errno));
+		return -1;
+	}
+
+	for(const commitReq_t *r = batch; r; r = r->next){
+		for(off_t done = 0; done < r->stageLen;){
+			ssize_t byteCount = pread(r->stageFd, dataMap.base + at, r->stageLen - done, done);
+			if(byteCount <= 0){
+				if(byteCount < 0 && errno == EINTR)
+					continue;
+				return -1;
+			}
+			done += byteCount;
+			at += byteCount;
+		}
+		memcpy(dataMap.base + at, r->buf, r->len);
+		at += r->len;
+	}
+	return 0;
+}
+
+
+/***********************************************************************************
+ *	The n'th entry in the log index
+ **********************************************************************************/
+static logEntry_t *storageLogEntry(long n){
+	return (logEntry_t *)(logMap.base + LOG_HEADER) + n;
+}
+
+
+/***********************************************************************************
+ *	Make room for count entries in the log index. The file grows a segment at
+ *	a time (zeros, which are never a good entry), since the mapping can't be
+ *	written past its end.
+ **********************************************************************************/
+static int storageLogReserve(long count){
+	off_t end = LOG_HEADER + count * (off_t)sizeof(logEntry_t);
+
+	if(storageMapGrow(&logMap, end))
+		return -1;
+	if(end <= logLength)
+		return 0;
+
+	off_t grown = (end + MAP_SEGMENT - 1) / MAP_SEGMENT * MAP_SEGMENT;
+	if(ftruncate(logMap.fd, grown)){
+		syslog(LOG_ERR, "Unable to grow %s: %s", indexPath, strerror(errno));
+		return -1;
+	}
+	logLength = grown;
+	return 0;
+}
+
+
+/***********************************************************************************
+ *	Carry a checksum on over [start, end) of the data file, straight from the
+ *	mapping if there is one
+ **********************************************************************************/
+static int storageLogCrcRange(off_t start, off_t end, uint32_t *crc){
+	if(dataMap.base){
+		*crc = crc32c(*crc, dataMap.base + start, end - start);
+		return 0;
+	}
+
+	unsigned char *buf = malloc(REPLY_BUF_SIZE);
+	if(!buf)
+		return -1;
+	int rc = 0;
+	while(start < end){
+		ssize_t byteCount = pread(sharedFd, buf, (end - start < REPLY_BUF_SIZE) ? end - start : REPLY_BUF_SIZE, start);
+		if(byteCount == -1 && errno == EINTR)
+			continue;
+		if(byteCount <= 0){
+			rc = -1;
+			break;
+		}
+		*crc = crc32c(*crc, buf, byteCount);
+		start += byteCount;
+	}
+	free(buf);
+	return rc;
+}
+
+
+/***********************************************************************************
+ *	Write the n'th entry, for a record that ends at end
+ **********************************************************************************/
+static int storageLogPut(long n, off_t end, uint32_t crc){
+	if(storageLogReserve(n + 1))
+		return -1;
+	logEntry_t entry = {.end = end, .crc = crc};
+	entry.check = crc32c(0, &entry, offsetof(logEntry_t, check));
+	*storageLogEntry(n) = entry;
+	return 0;
+}
+
+
+/***********************************************************************************
+ *	Write the entries for a committed batch (the leader, with the file mutex
+ *	held). A record is a line, so it can start in an earlier batch and the
+ *	running checksum is carried over. Staged bytes are checksummed from
+ *	where they landed in the data file. The entries aren't seen until the
+ *	record count is published.
+ **********************************************************************************/
+static int storageLogAdd(const commitReq_t *batch, long *records){
+	uint32_t crc = lineCrc;
+	long count = *records;
+
+	for(const commitReq_t *r = batch; r; r = r->next){
+		off_t at = r->end - r->len - r->stageLen;
+		if(r->stageLen && storageLogCrcRange(at, at + r->stageLen, &crc))
+			return -1;
+		at += r->stageLen;
+
+		const unsigned char *p = r->buf;
+		const unsigned char *end = p + r->len;
+		while(p < end){
+			const unsigned char *newline = memchr(p, '\n', end - p);
+			const unsigned char *stop = newline ? newline + 1 : end;
+			crc = crc32c(crc, p, stop - p);
+			at += stop - p;
+			p = stop;
+			if(!newline)
+				break;
+
+			if(storageLogPut(count++, at, crc))
+				return -1;
+			crc = 0;
+		}
+	}
+
+	lineCrc = crc;
+	*records = count;
+	return 0;
+}
+
+
+/***********************************************************************************
+ *	Write a checkpoint once enough has been added since the last one (or
+ *	whenever anything has, if forced). Only the leader (or open and close) gets
+ *	here, so the record count and length hold still.
+ **********************************************************************************/
+static int storageLogCheckpoint(bool force){
+	uint64_t records = recordCount;
+	uint64_t length = storageEnd;
+
+	if(records == checkpoint.records && length == checkpoint.length)
+		return 0;
+	if(!force && records - checkpoint.records < CHECKPOINT_RECORDS && length - checkpoint.length < CHECKPOINT_BYTES)
+		return 0;
+
+	//Everything it vouches for has to be on disk before it is
+	if(fdatasync(sharedFd) || fdatasync(logMap.fd)){
+		syslog(LOG_ERR, "Unable to sync %s: %s", dataPath, strerror(errno));
+		return -1;
+	}
+
+	logCheckpoint_t c = {.magic = LOG_MAGIC, .sequence = checkpoint.sequence + 1, .records = records, .length = length,
+							.valid = records ? storageLogEntry(records - 1)->end : 0};
+	c.crc = crc32c(0, &c, sizeof(c));
+
+	struct iovec iov = {.iov_base = &c, .iov_len = sizeof(c)};
+	if(storageWriteIov(logMap.fd, &iov, 1, sizeof(c), (c.sequence % 2) * LOG_SLOT) || fdatasync(logMap.fd)){
+		syslog(LOG_ERR, "Unable to write a checkpoint to %s: %s", indexPath, strerror(errno));
+		return -1;
+	}
+	checkpoint = c;
+	__atomic_add_fetch(&statCheckpoints, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+
+/***********************************************************************************
+ *	Unmap and close the log index
+ **********************************************************************************/
+static void storageLogRelease(void){
+	storageMapClose(&logMap);
+	if(logMap.fd != -1)
+		close(logMap.fd);
+	logMap.fd = -1;
+	logLength = 0;
+}
+
+
+/***********************************************************************************
+ *	Index the records in the data file past valid that the log index has no
+ *	entries for (it's gone, or it's behind), checksumming each one as it's
+ *	found. records and valid move on past the last whole line.
+ **********************************************************************************/
+static int storageLogRebuild(long *records, off_t *valid){
+	unsigned char *buf = malloc(REPLY_BUF_SIZE);
+	if(!buf)
+		return -1;
+
+	uint32_t crc = 0;
+	off_t off = *valid;
+	int rc = 0;
+	while(!rc && off < storageEnd){
+		size_t want = (storageEnd - off < REPLY_BUF_SIZE) ? storageEnd - off : REPLY_BUF_SIZE;
+		const unsigned char *p = dataMap.base ? dataMap.base + off : buf;
+		ssize_t byteCount = dataMap.base ? (ssize_t)want : pread(sharedFd, buf, want, off);
+		if(byteCount == -1 && errno == EINTR)
+			continue;
+		if(byteCount <= 0){
+			rc = -1;
+			break;
+		}
+
+		const unsigned char *end = p + byteCount;
+		while(p < end){
+			const unsigned char *newline = memchr(p, '\n', end - p);
+			const unsigned char *stop = newline ? newline + 1 : end;
+			crc = crc32c(crc, p, stop - p);
+			off += stop - p;
+			p = stop;
+			if(!newline)
+				break;
+
+			if(storageLogPut(*records, off, crc)){
+				rc = -1;
+				break;
+			}
+			(*records)++;
+			*valid = off;
+			crc = 0;
+		}
+	}
+	free(buf);
+	return rc;
+}
+
+
+/***********************************************************************************
+ *	Open (or start) the log index for what's already in the data file. The
+ *	newest good checkpoint vouches for the records before it, so only the
+ *	ones after it are checked, however big the log is. Checking stops at the
+ *	first entry that's torn or doesn't match its record, and the data file is
+ *	cut back to the end of the last good one (whatever was being written when
+ *	we stopped, and any unfinished line).
+ *
+ *	That's only if the checkpoint agrees with the files though. A missing or
+ *	stale index proves nothing about the data, so then (and for records past
+ *	the last entry there is) the records are indexed again from the data
+ *	file, and only an unfinished line is cut.
+ **********************************************************************************/
+static int storageLogOpen(void){
+	logMap.fd = open(indexPath, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if(logMap.fd == -1){
+		syslog(LOG_ERR, "open %s: %s", indexPath, strerror(errno));
+		return -1;
+	}
+
+	struct stat st;
+	if(fstat(logMap.fd, &st) || storageMapOpen(&logMap, logMap.fd, st.st_size)){
+		storageLogRelease();
+		return -1;
+	}
+	logLength = st.st_size;
+	if(storageLogReserve(0)){
+		storageLogRelease();
+		return -1;
+	}
+	long onDisk = (st.st_size > LOG_HEADER) ? (st.st_size - LOG_HEADER) / sizeof(logEntry_t) : 0;
+
+	logCheckpoint_t c = {0};
+	for(int i = 0; i < 2; i++){
+		logCheckpoint_t slot;
+		memcpy(&slot, logMap.base + i * LOG_SLOT, sizeof(slot));
+		uint32_t crc = slot.crc;
+		slot.crc = 0;
+		if(slot.magic == LOG_MAGIC && crc32c(0, &slot, sizeof(slot)) == crc && slot.sequence > c.sequence){
+			c = slot;
+			c.crc = crc;
+		}
+	}
+
+	//It has to agree with the files, otherwise the whole log is checked
+	bool agrees = c.records <= (uint64_t)onDisk && c.valid <= c.length && c.length <= (uint64_t)storageEnd &&
+					(c.records ? storageLogEntry(c.records - 1)->end == c.valid : !c.valid);
+	if(!agrees){
+		syslog(LOG_WARNING, "The checkpoint in %s doesn't match %s, checking and reindexing all of it", indexPath, dataPath);
+		c.records = c.length = c.valid = 0;
+	}
+	checkpoint = c;
+
+	long good = c.records;
+	off_t valid = c.valid;
+	bool torn = false;
+	for(; good < onDisk; good++){
+		logEntry_t entry = *storageLogEntry(good);
+		uint32_t crc = 0;
+		if(!entry.end && !entry.crc && !entry.check)
+			break;			//Zeros, the entries ran out here
+		if(entry.check != crc32c(0, &entry, offsetof(logEntry_t, check)) ||
+				entry.end <= (uint64_t)valid || entry.end > (uint64_t)storageEnd ||
+				storageLogCrcRange(valid, entry.end, &crc) || crc != entry.crc){
+			torn = true;
+			break;
+		}
+		valid = entry.end;
+	}
+
+	//Whole lines past that are records unless a trusted index says otherwise
+	long checked = good;
+	if((!torn || !agrees) && storageLogRebuild(&good, &valid)){
+		syslog(LOG_ERR, "Unable to reindex %s, not starting with it", dataPath);
+		storageLogRelease();
+		return -1;
+	}
+
+	if(storageEnd > valid){
+		syslog(LOG_WARNING, "Cutting %lld bytes of torn or unfinished tail off %s", (long long)(storageEnd - valid), dataPath);
+		if(ftruncate(sharedFd, valid)){
+			syslog(LOG_ERR, "Unable to truncate %s: %s", dataPath, strerror(errno));
+			storageLogRelease();
+			return -1;
+		}
+		statTruncated = storageEnd - valid;
+		storageEnd = valid;
+	}
+
+	//Stale entries past the last good one go, so they can't pass for new ones later
+	logLength = LOG_HEADER + good * (off_t)sizeof(logEntry_t);
+	if(ftruncate(logMap.fd, logLength)){
+		syslog(LOG_ERR, "Unable to truncate %s: %s", indexPath, strerror(errno));
+		storageLogRelease();
+		return -1;
+	}
+
+	recordCount = good;
+	lineCrc = 0;
+	statRecovered = good;
+	statChecked = checked - c.records;
+	statRebuilt = good - checked;
+	syslog(LOG_INFO, "Recovered %ld records (%lld bytes) from %s, %ld of them checked past the checkpoint and %ld reindexed (crc32c is %s)",
+			good, (long long)storageEnd, dataPath, statChecked, statRebuilt, crc32cName());
+	return storageLogCheckpoint(true);
+}
+
+
+/***********************************************************************************
+ *	Checkpoint everything, so the next startup has nothing to check
+ **********************************************************************************/
+static void storageLogClose(void){
+	if(!logMap.base)
+		return;
+
+	storageLogCheckpoint(true);
+	storageLogRelease();
+}
+
+
+/***********************************************************************************
+ *	Put a queue at the back (or front) of the round robin
+ **********************************************************************************/
+static void storageQueueActivate(commitQueue_t *q, bool front){
+	q->next = NULL;
+	if(!activeHead)
+		activeHead = activeTail = q;
+	else if(front){
+		q->next = activeHead;
+		activeHead = q;
+	}
+	else{
+		activeTail->next = q;
+		activeTail = q;
+	}
+}
+
+
+/***********************************************************************************
+ *	Queue an append behind the others from its source. Sources are hashed into
+ *	the queues, so two that collide share one (and its turn).
+ **********************************************************************************/
+static void storageQueueAdd(commitReq_t *req){
+	commitQueue_t *q = &commitQueues[((req->source * 2654435761u) >> 16) % COMMIT_QUEUES];
+
+	if(q->tail)
+		q->tail->next = req;
+	else{
+		q->head = req;
+		storageQueueActivate(q, false);
+		if(++activeCount > statPeakSources)
+			statPeakSources = activeCount;
+	}
+	q->tail = req;
+}
+
+
+/***********************************************************************************
+ *	Take the next batch off the queues. Each queue in turn is credited
+ *	COMMIT_QUANTUM bytes and gives up appends while it's in credit (an append
+ *	bigger than its credit still goes, the queue just owes it next time),
+ *	until the batch is full.
+ **********************************************************************************/
+static commitReq_t *storageQueueTake(int *count, size_t *total){
+	commitReq_t *batch = NULL;
+	commitReq_t *last = NULL;
+
+	while(activeHead && *count < MAX_BATCH && *total < BATCH_BYTES){
+		commitQueue_t *q = activeHead;
+		activeHead = q->next;
+		if(!activeHead)
+			activeTail = NULL;
+
+		if(!q->midTurn)
+			q->deficit += COMMIT_QUANTUM;
+		q->midTurn = false;
+
+		while(q->head && q->deficit > 0 && *count < MAX_BATCH && *total < BATCH_BYTES){
+			commitReq_t *r = q->head;
+			q->head = r->next;
+			if(!q->head)
+				q->tail = NULL;
+
+			r->next = NULL;
+			if(last)
+				last->next = r;
+			else
+				batch = r;
+			last = r;
+
+			q->deficit -= r->stageLen + r->len;
+			*total += r->stageLen + r->len;
+			(*count)++;
+		}
+
+		if(!q->head){
+			//An empty queue doesn't save up credit
+			q->deficit = 0;
+			activeCount--;
+		}
+		else if(q->deficit > 0){
+			//The batch is full, it picks up where it left off next time
+			q->midTurn = true;
+			storageQueueActivate(q, true);
+		}
+		else
+			storageQueueActivate(q, false);
+	}
+	return batch;
+}
+
+
+/***********************************************************************************
+ *	Commit the next batch, we're the leader. The commit lock is held on the way
+ *	in and out, but not while we write. A checkpoint is only written if
+ *	checkpoint is set. Returns true if we're still the leader (a queued append
+ *	is next, and there's nobody behind it to hand the lead to), so go again.
+ **********************************************************************************/
+static bool storageCommit(pthread_mutex_t *mutex, int fd, bool checkpoint){
+	size_t total = 0;
+	int count = 0;
+	int staged = 0;
+	off_t stagedBytes = 0;
+
+	commitReq_t *batch = storageQueueTake(&count, &total);
+	for(commitReq_t *r = batch; r; r = r->next){
+		staged += (r->stageLen != 0);
+		stagedBytes += r->stageLen;
+	}
+	pthread_mutex_unlock(&commitLock);
+
+	//One lock, one write for the whole batch
+	int rc = pthread_mutex_lock(mutex);
+	if(rc){
+		errno = rc;
+		perror("pthread_mutex_lock");
+	}
+	else{
+		DEBUG_PRINT("--Writing %i appends to the output file %s\n", count, dataPath);
+		rc = dataMap.base ? storageMapBatch(fd, batch, total) : storageWriteBatch(fd, batch);
+		if(rc)
+			syslog(LOG_ERR, "write to %s failed", dataPath);
+
+		//Each append's reply covers the file up to the end of it
+		off_t end = storageEnd;
+		for(commitReq_t *r = batch; r; r = r->next){
+			end += r->stageLen + r->len;
+			r->end = end;
+		}
+
+		//Persistent, the log index (with each record's checksum) is the record index
+		long records = recordCount;
+		if(!rc && logMap.base && storageLogAdd(batch, &records)){
+			syslog(LOG_ERR, "write to %s failed", indexPath);
+			rc = -1;
+		}
+
+		//Whatever did get written past storageEnd (part of the batch, or all of
+		//	it with the file already stretched to fit) would sit at the end of the
+		//	file for anyone reading it, until the next batch wrote over it
+		if(rc && ftruncate(fd, storageEnd))
+			syslog(LOG_ERR, "Unable to cut a failed write off %s: %s", dataPath, strerror(errno));
+		if(!rc){
+			storageSnapExtend(batch, total);
+
+			//Staged bytes are the front of a line that was still arriving, so
+			//	only buf can hold the '\n' that ends it
+			for(commitReq_t *r = batch; r && !logMap.base; r = r->next)
+				storageIndexAdd(r->buf, r->len, r->end - r->len, &records);
+
+			//The length goes first, so anyone who sees the new records sees the bytes they cover
+			__atomic_store_n(&storageEnd, storageEnd + total, __ATOMIC_RELEASE);
+			__atomic_store_n(&recordCount, records, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(mutex);
+
+		//We're still the leader, so nothing is added while it syncs. The batch
+		//	that crosses the line waits for it, the rest never do.
+		if(!rc && logMap.base && checkpoint)
+			storageLogCheckpoint(false);
+	}
+
+	pthread_mutex_lock(&commitLock);
+	for(commitReq_t *r = batch, *next; r; r = next){
+		next = r->next;
+		r->rc = rc ? -1 : 0;
+		r->done = true;
+		if(r->queued)
+			free(r);
+	}
+
+	statAppends += count;
+	statBatches++;
+	if(staged && !rc){
+		__atomic_add_fetch(&statStaged, staged, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&statStagedBytes, stagedBytes, __ATOMIC_RELAXED);
+	}
+	int bucket = 0;
+	while(bucket < HIST_BUCKETS - 1 && (1 << bucket) < count)
+		bucket++;
+	statBatchHist[bucket]++;
+
+	//Whoever is next in line leads the next batch. Nobody is waiting on a
+	//	queued append, so if that's next we carry on leading.
+	bool again = false;
+	if(!activeHead)
+		commitLeader = false;
+	else if(activeHead->head->queued)
+		again = true;
+	else
+		activeHead->head->lead = true;
+	pthread_cond_broadcast(&commitCond);
+	return again;
+}
+
+
+/***********************************************************************************
+ *	Open the data file, appends pick up from whatever is already there
+ **********************************************************************************/
+static int storageDataOpen(void){
+	DEBUG_PRINT("--Opening the output file\n");
+	sharedFd = open(dataPath, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if(sharedFd == -1){
+		syslog(LOG_ERR, "open %s: %s", dataPath, strerror(errno));
+		return -1;
+	}
+
+	struct stat st;
+	if(fstat(sharedFd, &st)){
+		syslog(LOG_ERR, "fstat: %s", strerror(errno));
+		close(sharedFd);
+		sharedFd = -1;
+		return -1;
+	}
+	storageEnd = st.st_size;
+	return 0;
+}
+
+
+/***********************************************************************************
+ *	Index what's in the data file (or recover it, if it's persistent) and load
+ *	the snapshot
+ **********************************************************************************/
+static int storageDataLoad(void){
+	if(persistent){
+		if(storageLogOpen())
+			return -1;
+	}
+	else
+		storageIndexLoad();
+	storageSnapLoad();
+	statsRegister(storageStats);
+	return 0;
+}
+
+static int fileOpen(void){
+	if(storageDataOpen())
+		return -1;
+	if(storageDataLoad()){
+		close(sharedFd);
+		sharedFd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+
+/***********************************************************************************
+ *	Open the data file and map it
+ **********************************************************************************/
+static int mmapOpen(void){
+	if(storageDataOpen())
+		return -1;
+	if(storageMapOpen(&dataMap, sharedFd, storageEnd) || storageDataLoad()){
+		storageMapClose(&dataMap);
+		close(sharedFd);
+		sharedFd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+
+/***********************************************************************************
+ *	Close the data file, and delete it unless it's persistent (otherwise it
+ *	only lasts as long as the server)
+ **********************************************************************************/
+static void fileClose(void){
+	storageLogClose();
+	if(sharedFd != -1)
+		close(sharedFd);
+	sharedFd = -1;
+
+	storageSnapPublish(NULL);
+	if(!persistent)
+		unlink(dataPath);
+}
+
+
+/***********************************************************************************
+ *	Unmap the data file, and close it
+ **********************************************************************************/
+static void mmapClose(void){
+	storageSnapPublish(NULL);
+	storageMapClose(&dataMap);
+	fileClose();
+}
+
+
+/***********************************************************************************
+ *	Everyone shares the descriptor opened at startup
+ **********************************************************************************/
+static int fileAcquire(void){
+	return sharedFd;
+}
+
+static void fileRelease(int fd){
+}
+
+
+/***********************************************************************************
+ *	Read back part of the file, always at our own offset (the shared
+ *	descriptor's position is never used)
+ **********************************************************************************/
+static ssize_t fileRead(int fd, void *buf, size_t len, off_t off){
+	return pread(fd, buf, len, off);
+}
+
+
+/***********************************************************************************
+ *	Copy part of the log out of the mapping, up to what's been committed
+ **********************************************************************************/
+static ssize_t mmapRead(int fd, void *buf, size_t len, off_t off){
+	off_t end = __atomic_load_n(&storageEnd, __ATOMIC_ACQUIRE);
+	if(off < 0){
+		errno = EINVAL;
+		return -1;
+	}
+	if(off >= end)
+		return 0;
+	if(len > (size_t)(end - off))
+		len = end - off;
+	memcpy(buf, dataMap.base + off, len);
+	return len;
+}
+
+
+/***********************************************************************************
+ *	Stage part of a packet that's still arriving. The staging file is an
+ *	anonymous one in the data file's directory (so it's gone as soon as it's
+ *	closed, even if we crash, and can be copied in without leaving the
+ *	filesystem).
+ **********************************************************************************/
+static int fileStageWrite(int *stageFd, off_t *stageLen, const void *buf, size_t len){
+	if(*stageFd == -1){
+		char path[PATH_MAX];
+		memcpy(path, dataPath, sizeof(path));
+		char *dir = dirname(path);
+
+		*stageFd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+		if(*stageFd == -1 && (errno == EOPNOTSUPP || errno == EISDIR || errno == EINVAL)){
+			//No O_TMPFILE here, an unlinked temporary file does the same job
+			char name[PATH_MAX + 16];
+			snprintf(name, sizeof(name), "%s/.stageXXXXXX", dir);
+			*stageFd = mkostemp(name, O_CLOEXEC);
+			if(*stageFd != -1)
+				unlink(name);
+		}
+		if(*stageFd == -1){
+			syslog(LOG_ERR, "Unable to create a staging file in %s: %s", dir, strerror(errno));
+			return -1;
+		}
+		*stageLen = 0;
+	}
+
+	struct iovec iov = {.iov_base = (void *)buf, .iov_len = len};
+	if(storageWriteIov(*stageFd, &iov, 1, len, *stageLen)){
+		syslog(LOG_ERR, "Unable to write to the staging file: %s", strerror(errno));
+		return -1;
+	}
+	*stageLen += len;
+	return 0;
+}
+
+
+/***********************************************************************************
+ *	Append the staged bytes and then buf, as one append
+ **********************************************************************************/
+static int fileAppend(pthread_mutex_t *mutex, int fd, uint32_t source, int stageFd, off_t stageLen,
+						const void *buf, size_t len, off_t *end, storageSnap_t **snap){
+	//Join the queue. If nobody is committing we lead, otherwise we wait until the
+	//	leader has written ours (or hands the lead to us). A leader whose own
+	//	append didn't make its batch (its source is out of credit) carries on
+	//	leading, or waits again if it handed the lead on.
+	commitReq_t req = {.source = source, .stageFd = stageFd, .stageLen = stageLen, .buf = buf, .len = len};
+
+	pthread_mutex_lock(&commitLock);
+	storageQueueAdd(&req);
+
+	while(!req.done){
+		if(commitLeader && !req.lead){
+			pthread_cond_wait(&commitCond, &commitLock);
+			continue;
+		}
+		req.lead = false;
+		commitLeader = true;
+		while(storageCommit(mutex, fd, true));
+	}
+	pthread_mutex_unlock(&commitLock);
+
+	if(end)
+		*end = req.end;
+	return req.rc;
+}
+
+
+/***********************************************************************************
+ *	Queue an append and don't wait for it. If a batch is being written it goes
+ *	out with the next one and whoever writes that frees it. Otherwise the queue
+ *	is empty and we lead, which is one small write of our own (it never stops
+ *	for a checkpoint, the next client batch does that).
+ **********************************************************************************/
+static int fileAppendQueued(pthread_mutex_t *mutex, int fd, const void *buf, size_t len){
+	commitReq_t *req = malloc(sizeof(*req) + len);
+	if(!req)
+		return -1;
+	*req = (commitReq_t){.stageFd = -1, .buf = req + 1, .len = len, .queued = true};
+	memcpy(req + 1, buf, len);
+
+	pthread_mutex_lock(&commitLock);
+	storageQueueAdd(req);
+	if(!commitLeader){
+		commitLeader = true;
+		while(storageCommit(mutex, fd, false));
+	}
+	pthread_mutex_unlock(&commitLock);
+	return 0;
+}
+
+
+static const storageBackend_t fileBackend = {
+	.name = "file",
+	.timestamps = true,
+	.descriptors = true,
+	.persists = true,
+	.open = fileOpen,
+	.close = fileClose,
+	.acquire = fileAcquire,
+	.release = fileRelease,
+	.append = fileAppend,
+	.read = fileRead,
+	.size = fileSize,
+	.appendQueued = fileAppendQueued,
+	.stageWrite = fileStageWrite,
+	.recordCount = fileRecordCount,
+	.recordOffset = fileRecordOffset,
+	.snapshot = fileSnapshot,
+};
+
+//The same log and group commit, but written to and read from a mapping of the
+//	data file, which is also every reply's snapshot
+static const storageBackend_t mmapBackend = {
+	.name = "mmap",
+	.timestamps = true,
+	.descriptors = true,
+	.persists = true,
+	.open = mmapOpen,
+	.close = mmapClose,
+	.acquire = fileAcquire,
+	.release = fileRelease,
+	.append = fileAppend,
+	.read = mmapRead,
+	.size = fileSize,
+	.appendQueued = fileAppendQueued,
+	.stageWrite = fileStageWrite,
+	.recordCount = fileRecordCount,
+	.recordOffset = fileRecordOffset,
+	.snapshot = fileSnapshot,
+};
+
+static const storageBackend_t *backends[] = {&fileBackend, &mmapBackend, &charDevBackend, &memRingBackend};
+
+
+/***********************************************************************************
+ *	Pick the backend by name
+ **********************************************************************************/
+int storageSelect(const char *name){
+	for(size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++){
+		if(!strcmp(name, backends[i]->name)){
+			backend = backends[i];
+			return 0;
+		}
+	}
+	return -1;
+}
+
+const storageBackend_t *storageBackend(void){
+	return backend;
+}
+
+void storageSetPersistent(bool keep){
+	persistent = keep;
+}
+
+int storageSetPath(const char *path){
+	if(strlen(path) + sizeof(".index") > sizeof(dataPath)){
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	snprintf(dataPath, sizeof(dataPath), "%s", path);
+	snprintf(indexPath, sizeof(indexPath), "%s.index", path);
+	return 0;
+}
+
+
+/***********************************************************************************
+ *	The rest go to whichever backend we're using. Anything it doesn't do is
+ *	answered the way the char device always has been: nothing is staged, no
+ *	lengths or records (-1) and no snapshot.
+ **********************************************************************************/
+int storageOpen(void){
+	if(!backend && storageSelect(STORAGE_DEFAULT))
+		return -1;
+	if(persistent && !backend->persists){
+		syslog(LOG_ERR, "The %s backend can't keep its data across restarts", backend->name);
+		return -1;
+	}
+	syslog(LOG_INFO, "Storing to the %s backend%s", backend->name, persistent ? ", kept across restarts" : "");
+	return backend->open();
+}
+
+void storageClose(void){
+	backend->close();
+}
+
+int storageAcquire(void){
+	return backend->acquire();
+}
+
+void storageRelease(int fd){
+	if(fd != -1)
+		backend->release(fd);
+}
+
+ssize_t storageRead(int fd, void *buf, size_t len, off_t off){
+	return backend->read(fd, buf, len, off);
+}
+
+int storageSeekTo(int fd, uint32_t command, uint32_t offset, off_t *start, off_t *end, storageSnap_t **snap){
+	if(snap)
+		*snap = NULL;
+	if(!backend->seekTo){
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	return backend->seekTo(fd, command, offset, start, end, snap);
+}
+
+int storageStageWrite(int *stageFd, off_t *stageLen, const void *buf, size_t len){
+	if(!backend->stageWrite){
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	return backend->stageWrite(stageFd, stageLen, buf, len);
+}
+
+
+/***********************************************************************************
+ *	Throw away a staging file (after it's been appended, or the packet never
+ *	finished)
+ **********************************************************************************/
+void storageStageDrop(int *stageFd, off_t *stageLen){
+	if(*stageFd != -1)
+		close(*stageFd);
+	*stageFd = -1;
+	*stageLen = 0;
+}
+
+int storageAppend(pthread_mutex_t *mutex, int fd, const void *buf, size_t len, off_t *end){
+	return storageAppendStaged(mutex, fd, 0, -1, 0, buf, len, end, NULL);
+}
+
+int storageAppendQueued(pthread_mutex_t *mutex, int fd, const void *buf, size_t len){
+	if(backend->appendQueued)
+		return backend->appendQueued(mutex, fd, buf, len);
+	return storageAppend(mutex, fd, buf, len, NULL);
+}
+
+int storageAppendStaged(pthread_mutex_t *mutex, int fd, uint32_t source, int stageFd, off_t stageLen,
+							const void *buf, size_t len, off_t *end, storageSnap_t **snap){
+	if(snap)
+		*snap = NULL;
+
+	//Only a backend that can stage is ever given staged bytes
+	if(stageLen && !backend->stageWrite){
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	return backend->append(mutex, fd, source, stageFd, stageLen, buf, len, end, snap);
+}
+
+off_t storageCommitted(void){
+	return backend->size();
+}
+
+long storageRecordCount(void){
+	return backend->recordCount ? backend->recordCount() : -1;
+}
+
+off_t storageRecordOffset(long record){
+	return backend->recordOffset ? backend->recordOffset(record) : -1;
+}
+
+storageSnap_t *storageSnapshot(off_t end){
+	return backend->snapshot ? backend->snapshot(end) : NULL;
+}
@@ -0,0 +1,149 @@
+
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+//A refcounted copy of the data file (file mode). Appends are copied onto the end
+//	of the current one, so a snapshot's bytes never change once a reader can see
+//	them, and a reader only looks at the part its own reply covers. The mmap
+//	backend's one is the mapping itself, which is never freed.
+typedef struct {
+	int refs;
+	size_t size;
+	off_t len;				//How much of data is valid, only ever grows (read with __atomic)
+	unsigned char *data;	//Usually right after the struct, in the same allocation
+}storageSnap_t;
+
+//A backing store. One is picked at startup, and the storage functions below
+//	all go through it. The optional ones are left NULL by a backend that can't
+//	do them, and the storage function answers the way the char device always
+//	has (nothing staged, -1 for lengths and records, no snapshot).
+typedef struct {
+	const char *name;
+	bool timestamps;		//The timestamp timer writes to it
+	bool descriptors;		//acquire() gives real descriptors that replies can be read (or sendfile()d) from.
+							//	Otherwise it's just a handle, and replies come from a snapshot or read().
+	bool persists;			//Can keep its data across restarts (storageSetPersistent())
+
+	int (*open)(void);
+	void (*close)(void);
+	int (*acquire)(void);
+	void (*release)(int fd);
+	int (*append)(pthread_mutex_t *mutex, int fd, uint32_t source, int stageFd, off_t stageLen,
+					const void *buf, size_t len, off_t *end, storageSnap_t **snap);
+	ssize_t (*read)(int fd, void *buf, size_t len, off_t off);
+	off_t (*size)(void);
+	int (*seekTo)(int fd, uint32_t command, uint32_t offset, off_t *start, off_t *end, storageSnap_t **snap);
+
+	//Optional
+	int (*appendQueued)(pthread_mutex_t *mutex, int fd, const void *buf, size_t len);
+	int (*stageWrite)(int *stageFd, off_t *stageLen, const void *buf, size_t len);
+	long (*recordCount)(void);
+	off_t (*recordOffset)(long record);
+	storageSnap_t *(*snapshot)(off_t end);
+}storageBackend_t;
+
+//Pick the backend ("file", "mmap", "aesdchar" or "ring") before storageOpen(). Returns
+//	-1 if there's no such backend. STORAGE_DEFAULT is used otherwise.
+int storageSelect(const char *name);
+const storageBackend_t *storageBackend(void);
+
+//Keep the data file across restarts (file and mmap only), before storageOpen().
+//	Each record's end and CRC32C go in a log index beside it (LOG_INDEX_PATH),
+//	which is checkpointed now and then, and startup only checks the records
+//	after the last checkpoint, cutting off a torn tail.
+void storageSetPersistent(bool keep);
+
+//Use path for the data file (file and mmap), and path.index for its log index,
+//	before storageOpen(). The server always uses FILE_PATH, this is for the
+//	benchmark. Returns -1 if the path is too long.
+int storageSetPath(const char *path);
+
+//Open the backing store, once at startup (before any connections or the timer)
+int storageOpen(void);
+void storageClose(void);
+
+//Get a descriptor for a request. In file mode everyone shares the one opened at
+//	startup (and never moves its file position). The char device keeps the
+//	seek position in the descriptor, so there each request gets one of its own
+//	from a pool. The ring has nothing to open, it hands out a handle that's
+//	only good for passing back to it.
+int storageAcquire(void);
+void storageRelease(int fd);
+
+//Read len bytes of the store from off (-1 means the descriptor's own
+//	position, for the char device). Returns what read() would.
+ssize_t storageRead(int fd, void *buf, size_t len, off_t off);
+
+//Move to offset bytes into the command'th record still held (the
+//	AESDCHAR_IOCSEEKTO command). The reply is [start, end), where -1 means
+//	the descriptor's position and its end. Returns -1 if the position isn't
+//	there, or the backend can't seek by command (errno EOPNOTSUPP).
+//
+//	The ring's records drop off the front, so its offsets only mean anything in
+//	the ring they came from. Given snap, it puts a reference to a snapshot of
+//	exactly that ring there, for the reply to be sent from (the others leave
+//	it NULL, their bytes never move). Release it with storageSnapRelease().
+int storageSeekTo(int fd, uint32_t command, uint32_t offset, off_t *start, off_t *end, storageSnap_t **snap);
+
+//Append buf to the store. In file mode appends are group committed: they queue
+//	up and one thread writes a batch of them with a single pwritev() at our
+//	tracked end of the file (holding the mutex), while the rest wait. The mmap
+//	backend does the same, except the batch is copied into the mapping (which
+//	grows a segment at a time). The file's end after this append (what the
+//	reply should cover) is returned in end, -1 for the char device, which
+//	leaves the descriptor at the start of what the reply should send. Returns
+//	-1 on failure.
+int storageAppend(pthread_mutex_t *mutex, int fd, const void *buf, size_t len, off_t *end);
+
+//Append buf without waiting for it to be written, for the timestamps: the
+//	loop that fires them mustn't sit behind a batch (a big staged copy, or a
+//	checkpoint's sync). The record is copied and queued, and goes out with the
+//	next batch. A failed write is only logged. Where appends aren't queued it's
+//	just storageAppend(). Returns -1 if it couldn't be queued.
+int storageAppendQueued(pthread_mutex_t *mutex, int fd, const void *buf, size_t len);
+
+//A packet too big to hold in memory is staged (file and mmap only, the others
+//	return -1 with errno EOPNOTSUPP). Its bytes are
+//	written to a private staging file as they arrive (*stageFd starts at -1,
+//	the file is created on the first write), where no reader can see them.
+//	Once the rest shows up, storageAppendStaged() appends the stageLen staged
+//	bytes followed by buf as a single append, so the record appears all at
+//	once or not at all. The staged part must not hold a '\n' (it's the front
+//	of the record that buf finishes). Returns -1 on failure.
+//
+//	Batches are fair queued by source (a client's address, storageAppend() uses
+//	0): each source's appends stay in order, but sources take turns by bytes
+//	written, so a busy one can't keep the others waiting. snap is as for
+//	storageSeekTo(), the ring's snapshot is of the ring right after this append.
+int storageStageWrite(int *stageFd, off_t *stageLen, const void *buf, size_t len);
+void storageStageDrop(int *stageFd, off_t *stageLen);
+int storageAppendStaged(pthread_mutex_t *mutex, int fd, uint32_t source, int stageFd, off_t stageLen,
+							const void *buf, size_t len, off_t *end, storageSnap_t **snap);
+
+//Length of the file covering every completed append, published by the writer
+//	after the data is in place, so it can be read (and read up to) without any
+//	lock. -1 for the char device, which keeps its own length. For the ring it's
+//	what it holds right now (old records drop off the front).
+off_t storageCommitted(void);
+
+//Records are the lines in the store. The count, and where record n starts
+//	(n == count gives the end of the last one), read without any lock and in
+//	O(1). Only for n up to a count you've seen. -1 for the char device and
+//	the ring, where record numbers move as old ones drop off.
+long storageRecordCount(void);
+off_t storageRecordOffset(long record);
+
+//Get a reference to the snapshot if it holds at least [0, end), NULL if not
+//	(too big to keep, or the char device, which can change under us). Lock
+//	free for the file, it never waits on a writer. The ring copies itself into
+//	a new one when it has changed since the last.
+storageSnap_t *storageSnapshot(off_t end);
+void storageSnapRelease(storageSnap_t *snap);
+
+#endif //STORAGE_H
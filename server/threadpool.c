@@ -0,0 +1,280 @@
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include "main.h"
+#include "connection.h"
+#include "stats.h"
+#include "affinity.h"
+#include "admission.h"
+#include "threadpool.h"
+
+//A connection waiting for a worker
+typedef struct {
+	int socket;
+	uint32_t ip;
+}poolJob_t;
+
+//Each worker owns a bounded deque. The owner takes the oldest job from the head,
+//	idle workers steal the newest job from the tail.
+typedef struct {
+	pthread_mutex_t lock;
+	poolJob_t *jobs;
+	int head;
+	int count;
+
+	pthread_t thread;
+	int index;
+	unsigned long processed;
+	unsigned long stolen;		//Jobs this worker took from someone else's queue
+	unsigned long rejected;		//Submits that found this queue full
+}poolWorker_t;
+
+static poolWorker_t *workers = NULL;
+static int workerCount = 0;
+static int queueCount = 0;
+static int queueDepth = 0;
+static pthread_mutex_t *fileMutex;
+
+//One post per queued job (plus one per worker when stopping), so a worker that
+//	gets through sem_wait has a job waiting for it somewhere in the pool.
+static sem_t pending;
+static int queued = 0;
+static volatile bool stopping = false;
+static unsigned int nextWorker = 0;
+static unsigned long dropped = 0;
+
+
+/***********************************************************************************
+ *	Take the oldest job from our own queue
+ **********************************************************************************/
+static bool poolPopOwn(poolWorker_t *w, poolJob_t *job){
+	bool found = false;
+
+	pthread_mutex_lock(&w->lock);
+	if(w->count){
+		*job = w->jobs[w->head];
+		w->head = (w->head + 1) % queueDepth;
+		w->count--;
+		found = true;
+	}
+	pthread_mutex_unlock(&w->lock);
+	return found;
+}
+
+
+/***********************************************************************************
+ *	Take the newest job from another worker's queue
+ **********************************************************************************/
+static bool poolSteal(poolWorker_t *victim, poolJob_t *job){
+	bool found = false;
+
+	pthread_mutex_lock(&victim->lock);
+	if(victim->count){
+		victim->count--;
+		*job = victim->jobs[(victim->head + victim->count) % queueDepth];
+		found = true;
+	}
+	pthread_mutex_unlock(&victim->lock);
+	return found;
+}
+
+
+/***********************************************************************************
+ *	Find a job, preferring our own queue and stealing when it is empty.
+ **********************************************************************************/
+static bool poolTake(poolWorker_t *w, poolJob_t *job){
+
+	if(poolPopOwn(w, job))
+		return true;
+
+	for(int i = 1; i < workerCount; i++){
+		if(poolSteal(&workers[(w->index + i) % workerCount], job)){
+			__atomic_add_fetch(&w->stolen, 1, __ATOMIC_RELAXED);
+			return true;
+		}
+	}
+	return false;
+}
+
+
+/***********************************************************************************
+ *	Worker thread. Handles one connection at a time until we're stopped.
+ **********************************************************************************/
+static void *poolWorker(void *arg){
+	poolWorker_t *w = arg;
+	poolJob_t job;
+
+	//Each worker gets its own CPU (if we've been given any)
+	affinityApplySelf(AFFINITY_WORKER, w->index);
+
+	while(1){
+		while(sem_wait(&pending) && errno == EINTR);
+
+		//Our job might have been submitted to a queue we already looked in,
+		//	so keep looking until it turns up.
+		bool found;
+		while(!(found = poolTake(w, &job))){
+			//Nothing left and nothing more coming, we're done
+			if(stopping && !__atomic_load_n(&queued, __ATOMIC_ACQUIRE))
+				return NULL;
+			sched_yield();
+		}
+		__atomic_sub_fetch(&queued, 1, __ATOMIC_RELEASE);
+
+		conn_t conn;
+		if(connInit(&conn, job.socket, job.ip, fileMutex)){
+			admitShed(job.socket);
+			continue;
+		}
+		connRun(&conn);
+		connClose(&conn);
+
+		__atomic_add_fetch(&w->processed, 1, __ATOMIC_RELAXED);
+	}
+}
+
+
+/***********************************************************************************
+ *	Log the depth of each worker queue (registered with the stats dump)
+ **********************************************************************************/
+static void poolStats(void){
+	syslog(LOG_INFO, "pool: %i workers, queue depth %i, %lu dropped (all queues full)",
+			workerCount, queueDepth, __atomic_load_n(&dropped, __ATOMIC_RELAXED));
+
+	for(int i = 0; i < workerCount; i++){
+		poolWorker_t *w = &workers[i];
+		pthread_mutex_lock(&w->lock);
+		int depth = w->count;
+		pthread_mutex_unlock(&w->lock);
+
+		syslog(LOG_INFO, "pool worker %i: queued %i, processed %lu, stolen %lu, rejected %lu",
+				i, depth, __atomic_load_n(&w->processed, __ATOMIC_RELAXED),
+				__atomic_load_n(&w->stolen, __ATOMIC_RELAXED),
+				__atomic_load_n(&w->rejected, __ATOMIC_RELAXED));
+	}
+}
+
+
+/***********************************************************************************
+ *	Hand a connection to the next worker with room in its queue
+ **********************************************************************************/
+int poolSubmit(int socket, uint32_t ip){
+	unsigned int start = __atomic_fetch_add(&nextWorker, 1, __ATOMIC_RELAXED);
+
+	for(int i = 0; i < workerCount; i++){
+		poolWorker_t *w = &workers[(start + i) % workerCount];
+
+		pthread_mutex_lock(&w->lock);
+		if(w->count < queueDepth){
+			w->jobs[(w->head + w->count) % queueDepth] = (poolJob_t){.socket = socket, .ip = ip};
+			w->count++;
+			__atomic_add_fetch(&queued, 1, __ATOMIC_RELEASE);
+			pthread_mutex_unlock(&w->lock);
+
+			sem_post(&pending);
+			return 0;
+		}
+		pthread_mutex_unlock(&w->lock);
+		__atomic_add_fetch(&w->rejected, 1, __ATOMIC_RELAXED);
+	}
+
+	__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+	return -1;
+}
+
+
+/***********************************************************************************
+ *	Create the worker queues and start the workers
+ **********************************************************************************/
+int poolStart(int count, int depth, pthread_mutex_t *mutex){
+
+	if(count < 1)
+		count = 1;
+	if(depth < 1)
+		depth = 1;
+
+	workers = calloc(count, sizeof(poolWorker_t));
+	if(!workers){
+		syslog(LOG_ERR, "calloc: %s", strerror(errno));
+		return -1;
+	}
+	queueCount = count;
+	queueDepth = depth;
+	fileMutex = mutex;
+	stopping = false;
+
+	if(sem_init(&pending, 0, 0)){
+		syslog(LOG_ERR, "sem_init: %s", strerror(errno));
+		free(workers);
+		workers = NULL;
+		return -1;
+	}
+
+	for(int i = 0; i < count; i++){
+		pthread_mutex_init(&workers[i].lock, NULL);
+		workers[i].index = i;
+		workers[i].jobs = malloc(depth * sizeof(poolJob_t));
+		if(!workers[i].jobs){
+			syslog(LOG_ERR, "malloc: %s", strerror(errno));
+			poolStop();
+			return -1;
+		}
+	}
+
+	//The workers must never be the thread that takes our signals
+	sigset_t oldSet;
+	blockSignals(&oldSet);
+	for(workerCount = 0; workerCount < count; workerCount++){
+		int rc = pthread_create(&workers[workerCount].thread, NULL, poolWorker, &workers[workerCount]);
+		if(rc){
+			errno = rc;
+			perror("pthread_create");
+			break;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &oldSet, NULL);
+
+	if(workerCount != count){
+		poolStop();
+		return -1;
+	}
+
+	statsRegister(poolStats);
+	syslog(LOG_INFO, "Started %i pool workers (queue depth %i)", workerCount, queueDepth);
+	return 0;
+}
+
+
+/***********************************************************************************
+ *	Let the workers finish whatever is queued, then wait for them to exit
+ **********************************************************************************/
+void poolStop(void){
+	if(!workers)
+		return;
+
+	stopping = true;
+	for(int i = 0; i < workerCount; i++)
+		sem_post(&pending);
+	for(int i = 0; i < workerCount; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	//workerCount only covers the threads that were started, but every queue may
+	//	have been allocated
+	for(int i = 0; i < queueCount; i++)
+		free(workers[i].jobs);
+	free(workers);
+	workers = NULL;
+	workerCount = 0;
+	queueCount = 0;
+	sem_destroy(&pending);
+}
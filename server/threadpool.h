@@ -0,0 +1,18 @@
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+//Start workerCount threads, each with its own queue of up to queueDepth connections
+int poolStart(int workerCount, int queueDepth, pthread_mutex_t *fileMutex);
+
+//Hand an accepted connection to the pool. This never blocks, if every queue is full
+//	-1 is returned and the caller still owns the socket.
+int poolSubmit(int socket, uint32_t ip);
+
+//Finish everything that was queued and stop the workers
+void poolStop(void);
+
+#endif //THREADPOOL_H
@@ -0,0 +1,855 @@
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE		//linux/fs.h has its own, we want ours from main.h
+#include "main.h"
+#include "connection.h"
+#include "stats.h"
+#include "affinity.h"
+#include "admission.h"
+#include "bufpool.h"
+#include "logger.h"
+#include "interval.h"
+#include "uring.h"
+
+#define RING_ENTRIES		1024
+#define RECV_BUF_SIZE		2048		//Size of each provided receive buffer
+#define RECV_BUF_COUNT		256
+#define RECV_BUF_GROUP		1
+#define MAX_CHAIN_PAIRS		8			//read+send pairs linked in one submission
+
+//What a completion is for, kept in the low bits of user_data (the rest is the
+//	connection pointer, which malloc keeps at least 8 byte aligned).
+enum {
+	OP_ACCEPT = 0,
+	OP_PROVIDE,
+	OP_RECV,
+	OP_READ,
+	OP_SEND,
+	OP_TIMEOUT,
+	OP_HEAD,			//Sending a command reply's header line
+	OP_TICK,			//The timestamp timer expired
+	OP_MASK = 7
+};
+
+typedef struct _uconn_t {
+	conn_t conn;
+	int pending;			//Requests in flight for this connection
+	off_t startOff;			//Where in outf the reply starts
+	off_t total;			//Where the reply ends (-1 means read until EOF)
+	off_t sent;				//Reply bytes the client has been sent
+	bool eof;
+
+	struct _uconn_t *prev;
+	struct _uconn_t *next;
+}uconn_t;
+
+typedef struct {
+	int fd;
+	unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+	unsigned *cqHead, *cqTail, *cqMask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sqPtr, *cqPtr;
+	size_t sqSize, cqSize, sqesSize;
+	unsigned sqLocalTail;
+	unsigned toSubmit;
+}ring_t;
+
+static ring_t ring;
+static int listenFd;
+static int tickFd;						//The timestamp timer (-1 for none)
+static pthread_mutex_t *fileMutex;
+static uconn_t *conns = NULL;
+static unsigned char *recvBufs = NULL;
+static bool multishotAccept = true;
+static struct sockaddr_in acceptAddr;
+static socklen_t acceptAddrLen;
+static const sigset_t *waitMask;
+static struct __kernel_timespec sweepTime;		//How often we check for slow clients
+
+//Counters for the stats dump
+static unsigned long statSubmits = 0;
+static unsigned long statSqes = 0;
+static unsigned long statCqes = 0;
+static unsigned long statRequests = 0;
+
+
+/***********************************************************************************
+ *	The raw syscalls, we don't depend on liburing
+ **********************************************************************************/
+static int ringSetup(unsigned entries, struct io_uring_params *p){
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int ringEnter(unsigned toSubmit, unsigned minComplete, unsigned flags, const sigset_t *sig){
+	return syscall(__NR_io_uring_enter, ring.fd, toSubmit, minComplete, flags, sig, _NSIG / 8);
+}
+
+static int ringRegister(unsigned opcode, void *arg, unsigned nrArgs){
+	return syscall(__NR_io_uring_register, ring.fd, opcode, arg, nrArgs);
+}
+
+
+/***********************************************************************************
+ *	Tell the kernel about the SQEs we've filled in, optionally waiting for at
+ *	least one completion.
+ **********************************************************************************/
+static int ringSubmit(bool wait){
+	__atomic_store_n(ring.sqTail, ring.sqLocalTail, __ATOMIC_RELEASE);
+
+	//Our signals are only unblocked while we wait, so one can't slip in between
+	//	checking the close flag and going to sleep.
+	int ret = wait ? ringEnter(ring.toSubmit, 1, IORING_ENTER_GETEVENTS, waitMask)
+				   : ringEnter(ring.toSubmit, 0, 0, NULL);
+	if(ret < 0)
+		return -1;
+
+	statSubmits++;
+	ring.toSubmit -= ret;
+	return 0;
+}
+
+
+/***********************************************************************************
+ *	Make sure there's room for count SQEs, flushing what we have if the ring is
+ *	full. A linked chain can't be split across submits, so chains reserve their
+ *	whole length first.
+ **********************************************************************************/
+static int ringReserve(unsigned count){
+	while(ring.sqLocalTail + count - __atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE) > RING_ENTRIES){
+		if(ringSubmit(false) && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			return -1;
+	}
+	return 0;
+}
+
+/***********************************************************************************
+ *	Get the next free SQE
+ **********************************************************************************/
+static struct io_uring_sqe *ringGetSqe(void){
+	if(ringReserve(1))
+		return NULL;
+
+	unsigned index = ring.sqLocalTail & *ring.sqMask;
+	struct io_uring_sqe *sqe = &ring.sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ring.sqArray[index] = index;
+	ring.sqLocalTail++;
+	ring.toSubmit++;
+	statSqes++;
+	return sqe;
+}
+
+
+/***********************************************************************************
+ *	Helpers to queue each kind of request we use
+ **********************************************************************************/
+static struct io_uring_sqe *queueOp(uconn_t *uc, int op, int opcode, int fd){
+	struct io_uring_sqe *sqe = ringGetSqe();
+	if(!sqe)
+		return NULL;
+
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->user_data = (uint64_t)(uintptr_t)uc | op;
+	if(uc)
+		uc->pending++;
+	return sqe;
+}
+
+static int queueAccept(void){
+	struct io_uring_sqe *sqe = queueOp(NULL, OP_ACCEPT, IORING_OP_ACCEPT, listenFd);
+	if(!sqe)
+		return -1;
+
+	if(multishotAccept){
+		//Every connection gets its own completion, we'll look up the address after
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	}
+	else{
+		acceptAddrLen = sizeof(acceptAddr);
+		sqe->addr = (uint64_t)(uintptr_t)&acceptAddr;
+		sqe->addr2 = (uint64_t)(uintptr_t)&acceptAddrLen;
+	}
+	sqe->accept_flags = SOCK_CLOEXEC;
+	return 0;
+}
+
+static int queueProvide(int bid, int count){
+	struct io_uring_sqe *sqe = queueOp(NULL, OP_PROVIDE, IORING_OP_PROVIDE_BUFFERS, count);
+	if(!sqe)
+		return -1;
+
+	sqe->addr = (uint64_t)(uintptr_t)(recvBufs + (size_t)bid * RECV_BUF_SIZE);
+	sqe->len = RECV_BUF_SIZE;
+	sqe->off = bid;
+	sqe->buf_group = RECV_BUF_GROUP;
+	return 0;
+}
+
+static int queueRecv(uconn_t *uc){
+	struct io_uring_sqe *sqe = queueOp(uc, OP_RECV, IORING_OP_RECV, uc->conn.socket);
+	if(!sqe)
+		return -1;
+
+	//The kernel picks one of our provided buffers once data actually arrives
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = RECV_BUF_GROUP;
+	sqe->len = RECV_BUF_SIZE;
+	return 0;
+}
+
+static struct io_uring_sqe *queueRw(uconn_t *uc, int op, int opcode, int fd, void *buf, size_t len, off_t off){
+	struct io_uring_sqe *sqe = queueOp(uc, op, opcode, fd);
+	if(!sqe)
+		return NULL;
+
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = off;
+	return sqe;
+}
+
+//The timer is non-blocking (a read would just fail straight away), so we wait
+//	for it to be readable and read it ourselves
+static int queueTick(void){
+	if(tickFd == -1)
+		return 0;
+
+	struct io_uring_sqe *sqe = queueOp(NULL, OP_TICK, IORING_OP_POLL_ADD, tickFd);
+	if(!sqe)
+		return -1;
+	sqe->poll32_events = POLLIN;
+	return 0;
+}
+
+static int queueSweep(void){
+	struct io_uring_sqe *sqe = queueOp(NULL, OP_TIMEOUT, IORING_OP_TIMEOUT, -1);
+	if(!sqe)
+		return -1;
+
+	sqe->addr = (uint64_t)(uintptr_t)&sweepTime;
+	sqe->len = 1;
+	return 0;
+}
+
+
+/***********************************************************************************
+ *	Queue the next part of the reply. A reply from memory (the snapshot, or a
+ *	search's matches) is a single send.
+ *	Otherwise, when we know where the reply ends we can link the reads and sends
+ *	together (they all share the reply buffer, but the links make sure they run
+ *	in order). A short read breaks the chain, and we
+ *	pick up from what was actually sent once everything has completed.
+ **********************************************************************************/
+static int queueReply(uconn_t *uc){
+	struct io_uring_sqe *prev = NULL;
+	off_t off = uc->startOff + uc->sent;
+
+	if(uc->conn.sendLen || uc->conn.snap){
+		//It's all in memory already, one send covers the lot
+		unsigned char *data = uc->conn.sendLen ? uc->conn.sendBuf : uc->conn.snap->data;
+		struct io_uring_sqe *sqe = queueRw(uc, OP_SEND, IORING_OP_SEND, uc->conn.socket,
+											data + off, uc->total - off, 0);
+		if(!sqe)
+			return -1;
+		sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+		return 0;
+	}
+
+	if(uc->total < 0){
+		//We don't know how much there is, so just read the next block
+		return queueRw(uc, OP_READ, IORING_OP_READ, uc->conn.outf, uc->conn.sendBuf, uc->conn.sendSize, off) ? 0 : -1;
+	}
+
+	if(ringReserve(MAX_CHAIN_PAIRS * 2))
+		return -1;
+
+	for(int pair = 0; pair < MAX_CHAIN_PAIRS && off < uc->total; pair++){
+		size_t len = uc->conn.sendSize;
+		if(uc->total - off < (off_t)len)
+			len = uc->total - off;
+
+		if(prev)
+			prev->flags |= IOSQE_IO_LINK;
+		prev = queueRw(uc, OP_READ, IORING_OP_READ, uc->conn.outf, uc->conn.sendBuf, len, off);
+		if(!prev)
+			return -1;
+
+		prev->flags |= IOSQE_IO_LINK;
+		prev = queueRw(uc, OP_SEND, IORING_OP_SEND, uc->conn.socket, uc->conn.sendBuf, len, 0);
+		if(!prev)
+			return -1;
+		prev->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+		off += len;
+	}
+	return 0;
+}
+
+
+/***********************************************************************************
+ *	Drop a connection and free it.
+ **********************************************************************************/
+static void uconnDrop(uconn_t *uc){
+	if(uc->prev)
+		uc->prev->next = uc->next;
+	else
+		conns = uc->next;
+	if(uc->next)
+		uc->next->prev = uc->prev;
+
+	connClose(&uc->conn);
+	free(uc);
+}
+
+
+/***********************************************************************************
+ *	Get the reply ready to queue: from the snapshot, or a buffer to read it into.
+ *	The reads are done on the ring, so they need a real descriptor, a backend
+ *	without them can only reply from a snapshot (unless there's nothing to
+ *	read, like a search or a header line on its own).
+ **********************************************************************************/
+static int uconnReplySource(uconn_t *uc){
+	conn_t *conn = &uc->conn;
+	if(connReplySnapshot(conn))
+		return 0;
+
+	if(!storageBackend()->descriptors && conn->sendRemain && !conn->sendLen){
+		syslog(LOG_ERR, "No snapshot to reply from");
+		return -1;
+	}
+	return connReplyBuffer(conn);
+}
+
+
+/***********************************************************************************
+ *	We have a full packet. Store it (the append goes at the shared descriptor's
+ *	tracked end under the file mutex, so it's done here rather than on the ring)
+ *	and set up the reply for uconnAdvance() to queue, unless only the last
+ *	packet gets one.
+ **********************************************************************************/
+static int uconnStore(uconn_t *uc){
+	conn_t *conn = &uc->conn;
+	connEcho_t policy = connEchoPolicy();
+
+	//A single packet connection ignores anything sent after the '\n'
+	if(policy == CONN_ECHO_ONCE){
+		conn->dataLen = conn->packetLen;
+		conn->delimCount = 0;
+	}
+	conn->packets++;
+
+	if(connStore(conn))
+		return -1;
+
+	//The reply covers the file up to the end of our write (or the range a
+	//	command asked for), or for the char device, everything from wherever
+	//	the store (or command) left it
+	uc->startOff = (conn->sendOff >= 0) ? conn->sendOff : lseek(conn->outf, 0, SEEK_CUR);
+	uc->total = (conn->sendOff >= 0 && conn->sendRemain >= 0) ? conn->sendOff + conn->sendRemain : -1;
+
+	//A search reply is already sitting in sendBuf
+	if(conn->sendLen){
+		uc->startOff = 0;
+		uc->total = conn->sendLen;
+	}
+	if(policy == CONN_ECHO_LAST)
+		return 0;
+
+	if(uconnReplySource(uc))
+		return -1;
+	uc->sent = 0;
+	uc->eof = false;
+	conn->state = CONN_SEND;
+	return 0;
+}
+
+
+/***********************************************************************************
+ *	The client half-closed. If the last packet still needs its reply, it's the
+ *	one that packet's store set up.
+ **********************************************************************************/
+static int uconnPeerClosed(uconn_t *uc){
+	conn_t *conn = &uc->conn;
+
+	if(connPeerClosed(conn) < 0)
+		return -1;
+	if(conn->state != CONN_SEND)
+		return 0;
+
+	if(uconnReplySource(uc))
+		return -1;
+	uc->sent = 0;
+	uc->eof = false;
+	return 0;
+}
+
+
+/***********************************************************************************
+ *	Called once nothing is in flight for a connection, decides what's next. We
+ *	keep going until something has been queued (or the connection is dropped).
+ **********************************************************************************/
+static void uconnAdvance(uconn_t *uc){
+	conn_t *conn = &uc->conn;
+
+	while(!uc->pending){
+		if(conn->failed || conn->state == CONN_DONE){
+			uconnDrop(uc);
+			return;
+		}
+
+		if(conn->state == CONN_SEND){
+			//A command's header line goes before the data
+			if(conn->headPos < conn->headLen){
+				struct io_uring_sqe *sqe = queueRw(uc, OP_HEAD, IORING_OP_SEND, conn->socket,
+													conn->head + conn->headPos, conn->headLen - conn->headPos, 0);
+				if(!sqe)
+					goto fail;
+				sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+				continue;
+			}
+
+			//We're sending, see if there is anything left
+			if(!uc->eof && (uc->total < 0 || uc->startOff + uc->sent < uc->total)){
+				if(queueReply(uc))
+					goto fail;
+				continue;
+			}
+
+			statRequests++;
+			connReplyDone(conn);
+			if(connEchoPolicy() != CONN_ECHO_EACH || conn->peerClosed){
+				conn->state = CONN_DONE;
+				continue;
+			}
+			connNextPacket(conn);
+			conn->state = CONN_RECV;
+		}
+
+		//A packet that was stored without a reply is finished with now
+		if(conn->packetLen)
+			connNextPacket(conn);
+
+		//Packets carried over from an earlier receive come before reading any more
+		if(connFindPacket(conn)){
+			if(uconnStore(uc))
+				goto fail;
+			continue;
+		}
+
+		if(conn->peerClosed){
+			if(uconnPeerClosed(uc))
+				goto fail;
+			continue;
+		}
+
+		//A long packet moves out to its staging file before we read more of it
+		if(connStage(conn))
+			goto fail;
+		if(queueRecv(uc))
+			goto fail;
+	}
+	return;
+
+fail:
+	conn->failed = true;
+	if(!uc->pending)
+		uconnDrop(uc);
+}
+
+
+/***********************************************************************************
+ *	Received data. Copy it out of the provided buffer (so the buffer can go
+ *	straight back to the kernel), uconnAdvance() looks for the end of the packet.
+ **********************************************************************************/
+static void onRecv(uconn_t *uc, struct io_uring_cqe *cqe){
+	conn_t *conn = &uc->conn;
+
+	if(cqe->res == -ENOBUFS)
+		return;		//Everything was in use, uconnAdvance() will try again
+	if(!cqe->res && connEchoPolicy() != CONN_ECHO_ONCE){
+		conn->peerClosed = true;
+		return;
+	}
+	if(cqe->res <= 0){
+		if(!cqe->res)
+			LOG_FAST(LOG_ERR, "We did not receive a full packet from the client, dropping");
+		conn->failed = true;
+		return;
+	}
+
+	int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	unsigned char *buf = recvBufs + (size_t)bid * RECV_BUF_SIZE;
+	int len = cqe->res;
+
+	if(conn->dataLen + len > conn->dataSize){
+		if(connGrow(conn, conn->dataLen + len)){
+			queueProvide(bid, 1);
+			conn->failed = true;
+			return;
+		}
+	}
+	memcpy(conn->recvData + conn->dataLen, buf, len);
+	queueProvide(bid, 1);
+	conn->dataLen += len;
+}
+
+
+/***********************************************************************************
+ *	Check every connection that's replying is keeping up. The sends are all in
+ *	the kernel, so for one that's too slow we shut the socket down, which
+ *	fails whatever it has in flight, and it's dropped once that completes.
+ **********************************************************************************/
+static void onSweep(void){
+	if(queueSweep())
+		syslog(LOG_ERR, "Unable to queue the slow client sweep");
+
+	for(uconn_t *uc = conns; uc; uc = uc->next){
+		if(uc->conn.state != CONN_SEND || uc->conn.failed)
+			continue;
+
+		//A send still in flight has part of its bytes in the socket already, so
+		//	they're counted twice, which only makes us call it behind a bit sooner
+		off_t pending = (uc->total >= 0) ? uc->total - uc->startOff - uc->sent : 0;
+		if(connTooSlow(&uc->conn, pending)){
+			uc->conn.failed = true;
+			shutdown(uc->conn.socket, SHUT_RDWR);
+		}
+	}
+}
+
+
+/***********************************************************************************
+ *	A new client connection
+ **********************************************************************************/
+static void onAccept(struct io_uring_cqe *cqe){
+
+	//Grab the address before the accept is queued again and can overwrite it
+	struct sockaddr_in addr = acceptAddr;
+
+	bool rearm = !(cqe->flags & IORING_CQE_F_MORE);
+	if(cqe->res == -EINVAL && multishotAccept){
+		//Older kernel, we'll queue one accept at a time instead
+		syslog(LOG_INFO, "io_uring multishot accept unsupported, using single shot");
+		multishotAccept = false;
+		queueAccept();
+		return;
+	}
+	if(rearm && queueAccept())
+		syslog(LOG_ERR, "Unable to queue accept");
+
+	if(cqe->res < 0){
+		//Out of descriptors is handled (the waiting client is turned away) with
+		//	a plain accept, anything else is just logged
+		if(cqe->res != -ECONNABORTED && cqe->res != -EINTR)
+			while(admitAcceptFailed(listenFd, -cqe->res));
+		return;
+	}
+
+	int clientSocket = cqe->res;
+	if(multishotAccept){
+		socklen_t addrLen = sizeof(addr);
+		if(getpeername(clientSocket, (struct sockaddr *)&addr, &addrLen))
+			memset(&addr, 0, sizeof(addr));
+	}
+
+	uint32_t ip = ntohl(addr.sin_addr.s_addr);
+	LOG_FAST(LOG_INFO, "Accepted connection from %u.%u.%u.%u",
+			ip >> 24, (ip >> 16) & 0xFF, (ip >> 8) & 0xFF, ip & 0xFF);
+	if(!admitConnection(clientSocket))
+		return;
+
+	uconn_t *uc = calloc(1, sizeof(uconn_t));
+	if(!uc){
+		syslog(LOG_ERR, "Unable to allocate content for new client connection");
+		admitShed(clientSocket);
+		return;
+	}
+	if(connInit(&uc->conn, clientSocket, ip, fileMutex)){
+		free(uc);
+		admitShed(clientSocket);
+		return;
+	}
+
+	uc->next = conns;
+	if(conns)
+		conns->prev = uc;
+	conns = uc;
+	uconnAdvance(uc);
+}
+
+
+/***********************************************************************************
+ *	Handle a single completion
+ **********************************************************************************/
+static void onCompletion(struct io_uring_cqe *cqe){
+	int op = cqe->user_data & OP_MASK;
+	uconn_t *uc = (uconn_t *)(uintptr_t)(cqe->user_data & ~(uint64_t)OP_MASK);
+
+	statCqes++;
+	switch(op){
+	case OP_ACCEPT:
+		onAccept(cqe);
+		return;
+
+	case OP_PROVIDE:
+		if(cqe->res < 0)
+			syslog(LOG_ERR, "provide buffers: %s", strerror(-cqe->res));
+		return;
+
+	case OP_TIMEOUT:
+		onSweep();
+		return;
+
+	case OP_TICK:
+		if(cqe->res > 0)
+			intervalFire(tickFd);
+		if(queueTick())
+			syslog(LOG_ERR, "Unable to queue the timestamp timer");
+		return;
+
+	case OP_HEAD:
+		if(cqe->res > 0)
+			uc->conn.headPos += cqe->res;
+		else{
+			syslog(LOG_ERR, "error sending to client: %s", strerror(-cqe->res));
+			uc->conn.failed = true;
+		}
+		break;
+
+	case OP_RECV:
+		onRecv(uc, cqe);
+		break;
+
+	case OP_READ:
+		//Cancelled means an earlier link was short, we'll resume from what was sent
+		if(cqe->res < 0 && cqe->res != -ECANCELED){
+			syslog(LOG_ERR, "read: %s", strerror(-cqe->res));
+			uc->conn.failed = true;
+		}
+		else if(!cqe->res)
+			uc->eof = true;
+		else if(cqe->res > 0 && uc->total < 0 && uc->pending == 1){
+			//Unknown length, send what we read linked with the next read
+			struct io_uring_sqe *sqe = queueRw(uc, OP_SEND, IORING_OP_SEND, uc->conn.socket, uc->conn.sendBuf, cqe->res, 0);
+			if(!sqe){
+				uc->conn.failed = true;
+				break;
+			}
+			sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+			sqe->flags |= IOSQE_IO_LINK;
+			if(!queueRw(uc, OP_READ, IORING_OP_READ, uc->conn.outf, uc->conn.sendBuf, uc->conn.sendSize,
+						uc->startOff + uc->sent + cqe->res))
+				uc->conn.failed = true;
+		}
+		break;
+
+	case OP_SEND:
+		if(cqe->res > 0)
+			uc->sent += cqe->res;
+		else if(cqe->res != -ECANCELED){
+			syslog(LOG_ERR, "error sending to client: %s", strerror(-cqe->res));
+			uc->conn.failed = true;
+		}
+		break;
+	}
+
+	if(!--uc->pending)
+		uconnAdvance(uc);
+}
+
+
+/***********************************************************************************
+ *	Log how much ring traffic each request has cost (registered with the stats dump)
+ **********************************************************************************/
+static void uringStats(void){
+	syslog(LOG_INFO, "io_uring: %lu requests, %lu submits, %lu sqes, %lu cqes, multishot accept %s",
+			statRequests, statSubmits, statSqes, statCqes, multishotAccept ? "on" : "off");
+}
+
+
+/***********************************************************************************
+ *	Create the ring and map it, and check the kernel supports the ops we need.
+ **********************************************************************************/
+static int ringInit(void){
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	memset(&ring, 0, sizeof(ring));
+
+	ring.fd = ringSetup(RING_ENTRIES, &p);
+	if(ring.fd < 0){
+		syslog(LOG_INFO, "io_uring_setup: %s", strerror(errno));
+		return -1;
+	}
+
+	//Make sure every op we use is there before we commit to the ring
+	size_t probeSize = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, probeSize);
+	if(!probe || ringRegister(IORING_REGISTER_PROBE, probe, 256)){
+		syslog(LOG_INFO, "io_uring probe failed");
+		free(probe);
+		close(ring.fd);
+		return -1;
+	}
+	static const int neededOps[] = {IORING_OP_ACCEPT, IORING_OP_PROVIDE_BUFFERS, IORING_OP_RECV,
+									IORING_OP_SEND, IORING_OP_READ, IORING_OP_TIMEOUT, IORING_OP_POLL_ADD};
+	for(int i = 0; i < (int)(sizeof(neededOps)/sizeof(neededOps[0])); i++){
+		int op = neededOps[i];
+		if(op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)){
+			syslog(LOG_INFO, "io_uring op %i unsupported", op);
+			free(probe);
+			close(ring.fd);
+			return -1;
+		}
+	}
+	free(probe);
+
+	ring.sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring.cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP){
+		if(ring.cqSize > ring.sqSize)
+			ring.sqSize = ring.cqSize;
+		ring.cqSize = 0;
+	}
+
+	ring.sqPtr = mmap(NULL, ring.sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	if(ring.sqPtr == MAP_FAILED)
+		goto failMap;
+
+	ring.cqPtr = ring.sqPtr;
+	if(ring.cqSize){
+		ring.cqPtr = mmap(NULL, ring.cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+		if(ring.cqPtr == MAP_FAILED){
+			munmap(ring.sqPtr, ring.sqSize);
+			goto failMap;
+		}
+	}
+
+	ring.sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring.sqes = mmap(NULL, ring.sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if(ring.sqes == MAP_FAILED){
+		munmap(ring.sqPtr, ring.sqSize);
+		if(ring.cqSize)
+			munmap(ring.cqPtr, ring.cqSize);
+		goto failMap;
+	}
+
+	ring.sqHead = (void *)((char *)ring.sqPtr + p.sq_off.head);
+	ring.sqTail = (void *)((char *)ring.sqPtr + p.sq_off.tail);
+	ring.sqMask = (void *)((char *)ring.sqPtr + p.sq_off.ring_mask);
+	ring.sqArray = (void *)((char *)ring.sqPtr + p.sq_off.array);
+	ring.cqHead = (void *)((char *)ring.cqPtr + p.cq_off.head);
+	ring.cqTail = (void *)((char *)ring.cqPtr + p.cq_off.tail);
+	ring.cqMask = (void *)((char *)ring.cqPtr + p.cq_off.ring_mask);
+	ring.cqes = (void *)((char *)ring.cqPtr + p.cq_off.cqes);
+	ring.sqLocalTail = *ring.sqTail;
+	return 0;
+
+failMap:
+	syslog(LOG_ERR, "mmap: %s", strerror(errno));
+	close(ring.fd);
+	return -1;
+}
+
+
+/***********************************************************************************
+ *	Unmap and close the ring
+ **********************************************************************************/
+static void ringClose(void){
+	munmap(ring.sqes, ring.sqesSize);
+	if(ring.cqSize)
+		munmap(ring.cqPtr, ring.cqSize);
+	munmap(ring.sqPtr, ring.sqSize);
+	close(ring.fd);
+}
+
+
+/***********************************************************************************
+ *	Run the io_uring server until we're told to close
+ **********************************************************************************/
+int uringRun(int listenSocket, int timerFd, pthread_mutex_t *mutex, bool *closeFlag){
+
+	listenFd = listenSocket;
+	tickFd = timerFd;
+	fileMutex = mutex;
+
+	//Everything happens on this thread, so it's our only worker
+	affinityApplySelf(AFFINITY_WORKER, 0);
+
+	if(ringInit())
+		return URING_UNAVAILABLE;
+
+	recvBufs = malloc((size_t)RECV_BUF_SIZE * RECV_BUF_COUNT);
+	if(!recvBufs){
+		syslog(LOG_ERR, "malloc: %s", strerror(errno));
+		ringClose();
+		return -1;
+	}
+
+	//Hand the kernel all our receive buffers, and start accepting
+	int sweepMs = connSlowSweepMs();
+	sweepTime.tv_sec = sweepMs / 1000;
+	sweepTime.tv_nsec = (sweepMs % 1000) * 1000000L;
+	if(queueProvide(0, RECV_BUF_COUNT) || queueAccept() || (sweepMs > 0 && queueSweep()) || queueTick() || ringSubmit(false)){
+		syslog(LOG_ERR, "Unable to start the io_uring server");
+		ringClose();
+		free(recvBufs);
+		return -1;
+	}
+
+	statsRegister(uringStats);
+	syslog(LOG_INFO, "Running the io_uring server");
+
+	sigset_t oldSet;
+	blockSignals(&oldSet);
+	waitMask = &oldSet;
+
+	int ret = 0;
+	while(!*closeFlag){
+		statsPoll();
+
+		if(ringSubmit(true)){
+			if(errno == EINTR || errno == EAGAIN || errno == EBUSY)
+				continue;
+			syslog(LOG_ERR, "io_uring_enter: %s", strerror(errno));
+			ret = -1;
+			break;
+		}
+
+		unsigned head = *ring.cqHead;
+		while(head != __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE)){
+			struct io_uring_cqe cqe = ring.cqes[head & *ring.cqMask];
+			head++;
+			__atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+			onCompletion(&cqe);
+		}
+	}
+
+	pthread_sigmask(SIG_SETMASK, &oldSet, NULL);
+
+	//Closing the ring cancels everything still in flight, after that the
+	//	connections are ours to clean up.
+	ringClose();
+	while(conns){
+		conns->conn.failed = true;
+		uconnDrop(conns);
+	}
+	free(recvBufs);
+	recvBufs = NULL;
+	return ret;
+}
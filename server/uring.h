@@ -0,0 +1,14 @@
+
+#ifndef URING_H
+#define URING_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+//Run the io_uring based server on an already listening socket (and the
+//	timestamp timer, if timerFd isn't -1) until *closeFlag is set. Returns URING_UNAVAILABLE (before accepting anything) if the kernel
+//	can't give us what we need, so the caller can fall back to another mode.
+#define URING_UNAVAILABLE	1
+int uringRun(int listenSocket, int timerFd, pthread_mutex_t *fileMutex, bool *closeFlag);
+
+#endif //URING_H